@@ -35,6 +35,9 @@
 #  include <sys/types.h>
 #  include <sys/socket.h>
 #  include <sys/un.h>
+#  include <sys/uio.h>
+#  include <netinet/in.h>
+#  include <netinet/tcp.h>
 #  include <resolv.h>
 #  include <arpa/inet.h>
 #  include <netdb.h>
@@ -407,6 +410,83 @@ NetSock::WriteAll(const void *Buffer, int Size)
   return Size;
 }
 
+int
+NetSock::WriteAllV(const void *const *Buffers, const int *Sizes, int Count)
+{
+  if(this->socket == -1)
+    return -1;
+
+  int total = 0;
+  for(int i = 0; i < Count; i++)
+    total += Sizes[i];
+
+#ifdef __unix__
+  const int MaxIov = 16;
+  struct iovec iov[MaxIov];
+  int sent = 0;
+
+  while(sent != total)
+  {
+    // Describe whatever is left to send, skipping the buffers (and the
+    // part of the buffer) that were already sent.
+    int iovcnt = 0, skip = sent;
+    for(int i = 0; i < Count && iovcnt < MaxIov; i++)
+    {
+      if(skip >= Sizes[i])
+      {
+        skip -= Sizes[i];
+        continue;
+      }
+
+      iov[iovcnt].iov_base = (int8_t*)Buffers[i] + skip;
+      iov[iovcnt].iov_len  = Sizes[i] - skip;
+      skip = 0;
+      iovcnt++;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t ret = sendmsg(this->socket, &msg, 0);
+    if(ret == -1)
+    {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        continue;
+
+      return 0;
+    }
+
+    sent += (int)ret;
+  }
+#else
+  // Winsock 1 (winsock.h) has no scatter/gather send, so the buffers simply
+  // go out one after another. This is the intended fallback; it costs one
+  // system call (and possibly one TCP segment) per buffer.
+  for(int i = 0; i < Count; i++)
+  {
+    if(this->WriteAll(Buffers[i], Sizes[i]) != Sizes[i])
+      return 0;
+  }
+#endif
+
+  return total;
+}
+
+bool
+NetSock::SetNoDelay(bool NoDelay)
+{
+  if(this->socket == -1)
+    return false;
+
+  int value = NoDelay ? 1 : 0;
+
+  // Windows requires a const char* cast here.
+  return setsockopt(this->socket, IPPROTO_TCP, TCP_NODELAY,
+                    (const char*)&value, sizeof(value)) == 0;
+}
+
 
 unsigned short 
 NetSock::GetPort() const
@@ -86,6 +86,14 @@ public:
   // all the data is transmited.
   int Write(const void *Buffer, int Size);
   int WriteAll(const void *Buffer, int Size);
+
+  // Same as WriteAll, but sends Count buffers one after another, in as few
+  // system calls as possible (i.e. scatter/gather I/O).
+  int WriteAllV(const void *const *Buffers, const int *Sizes, int Count);
+
+  // Disables (or enables back) Nagle's algorithm, i.e. TCP_NODELAY. Useful
+  // if small messages need to go out right away.
+  bool SetNoDelay(bool NoDelay);
   
   // Use BroadcastUDP to send packets to broadcast addresses.
   // Due to some change in Windows 7 BroadcastUDP cannot use 255.255.255.255 as source address,
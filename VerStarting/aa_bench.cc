@@ -0,0 +1,180 @@
+// Anti-aliasing benchmark. Compares adaptive anti-aliasing with uniform N x N
+// supersampling: camera rays, render time and the mean difference from a
+// 8 x 8 supersampled reference image.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "mythtracer.h"
+#include "primitive_triangle.h"
+
+using math3d::V3D;
+using namespace raytracer;
+
+const int W = 160;
+const int H = 90;
+const int kReferenceGrid = 8;
+
+static void AddTriangle(Scene *scene, Material *mtl,
+                        const V3D& a, const V3D& b, const V3D& c) {
+  V3D normal = (b - a).Cross(c - a);
+  normal.Norm();
+
+  Triangle *tr = new Triangle();
+  tr->vertex[0] = a;
+  tr->vertex[1] = b;
+  tr->vertex[2] = c;
+  for (int i = 0; i < 3; i++) {
+    tr->normal[i] = normal;
+  }
+  tr->mtl = mtl;
+  tr->CacheAABB();
+  scene->tree.AddPrimitive(tr);
+}
+
+static Material *AddMaterial(Scene *scene, const char *name, const V3D& color) {
+  auto mtl = std::make_unique<Material>();
+  mtl->ambient = color * 0.2;
+  mtl->diffuse = color;
+  mtl->specular = { 0.3, 0.3, 0.3 };
+  mtl->specular_exp = 20.0;
+  Material *m = mtl.get();
+  scene->materials[name] = std::move(mtl);
+  return m;
+}
+
+// A checkerboard floor (lots of material edges, which is where anti-aliasing
+// matters) with a few slanted triangles standing on it. Most of the image is
+// flat though, so adaptive sampling should be able to skip it.
+static void BuildScene(Scene *scene) {
+  Material *white = AddMaterial(scene, "white", { 0.9, 0.9, 0.9 });
+  Material *black = AddMaterial(scene, "black", { 0.1, 0.1, 0.1 });
+  Material *red = AddMaterial(scene, "red", { 0.9, 0.2, 0.1 });
+
+  for (int j = 0; j < 8; j++) {
+    for (int i = 0; i < 8; i++) {
+      Material *m = (i + j) % 2 == 0 ? white : black;
+      const double x = i * 50.0, z = j * 50.0;
+      AddTriangle(scene, m, {x, 0.0, z}, {x, 0.0, z + 50.0},
+                            {x + 50.0, 0.0, z + 50.0});
+      AddTriangle(scene, m, {x + 50.0, 0.0, z + 50.0}, {x + 50.0, 0.0, z},
+                            {x, 0.0, z});
+    }
+  }
+
+  for (int i = 0; i < 5; i++) {
+    const double x = 60.0 + i * 60.0, z = 100.0 + (i % 2) * 80.0;
+    AddTriangle(scene, red, {x, 0.0, z}, {x + 30.0, 0.0, z + 10.0},
+                            {x + 10.0, 70.0 + i * 10.0, z + 5.0});
+  }
+
+  scene->lights.push_back(Light{
+      { 300.0, 300.0, -100.0 },
+      { 0.0, 0.0, 0.0 },
+      { 1.0, 1.0, 1.0 },
+      { 1.0, 1.0, 1.0 }
+  });
+}
+
+struct BenchResult {
+  double seconds;
+  RenderStats stats;
+  std::vector<uint8_t> bitmap;  // W x H, RGB.
+};
+
+// Renders the image at scale times the resolution without anti-aliasing, and
+// then averages each scale x scale block of pixels (i.e. uniform scale x scale
+// supersampling). A scale of 1 uses the settings as given.
+static BenchResult Render(MythTracer *mt, const Camera& cam,
+                          const RenderSettings& settings, int scale) {
+  WorkChunk chunk{};
+  chunk.image_width = chunk.chunk_width = W * scale;
+  chunk.image_height = chunk.chunk_height = H * scale;
+  chunk.camera = cam;
+  chunk.settings = settings;
+  chunk.output_bitmap.resize(W * H * scale * scale * 3);
+
+  auto start = std::chrono::steady_clock::now();
+  mt->RayTrace(&chunk);
+  auto end = std::chrono::steady_clock::now();
+
+  BenchResult res{
+    std::chrono::duration<double>(end - start).count(),
+    chunk.output_stats,
+    std::vector<uint8_t>(W * H * 3)
+  };
+
+  const int row = W * scale * 3;
+  for (int j = 0; j < H; j++) {
+    for (int i = 0; i < W; i++) {
+      for (int k = 0; k < 3; k++) {
+        int sum = 0;
+        for (int sy = 0; sy < scale; sy++) {
+          for (int sx = 0; sx < scale; sx++) {
+            sum += chunk.output_bitmap[
+                (j * scale + sy) * row + (i * scale + sx) * 3 + k];
+          }
+        }
+        res.bitmap[(j * W + i) * 3 + k] =
+            (uint8_t)((sum + scale * scale / 2) / (scale * scale));
+      }
+    }
+  }
+
+  return res;
+}
+
+static double MeanDifference(const std::vector<uint8_t>& a,
+                             const std::vector<uint8_t>& b) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < a.size(); i++) {
+    sum += abs((int)a[i] - (int)b[i]);
+  }
+  return (double)sum / a.size();
+}
+
+int main(void) {
+  MythTracer mt;
+  BuildScene(mt.GetScene());
+
+  Camera cam{
+    { 200.0, 120.0, -150.0 },
+     30.0, 0.0, 0.0,
+     90.0
+  };
+
+  RenderSettings settings;
+  const BenchResult reference = Render(&mt, cam, settings, kReferenceGrid);
+
+  struct Row {
+    const char *name;
+    int grid;
+    BenchResult res;
+  };
+  std::vector<Row> rows;
+  rows.push_back({ "none", 1, Render(&mt, cam, settings, 1) });
+  for (int grid = 2; grid <= 4; grid++) {
+    rows.push_back({ "uniform", grid, Render(&mt, cam, settings, grid) });
+
+    RenderSettings adaptive = settings;
+    adaptive.aa_grid = grid;
+    rows.push_back({ "adaptive", grid, Render(&mt, cam, adaptive, 1) });
+  }
+
+  printf("\nreference: uniform %ix%i, %llu camera rays, %.3fs\n\n",
+         kReferenceGrid, kReferenceGrid,
+         (unsigned long long)reference.stats.camera_rays, reference.seconds);
+  puts("mode     grid | camera rays | rays/pixel | time    | mean diff");
+  for (const auto& row : rows) {
+    printf("%-8s %ix%i  | %11llu | %10.2f | %6.3fs | %9.3f\n",
+           row.name, row.grid, row.grid,
+           (unsigned long long)row.res.stats.camera_rays,
+           (double)row.res.stats.camera_rays / (W * H),
+           row.res.seconds,
+           MeanDifference(row.res.bitmap, reference.bitmap));
+  }
+
+  return 0;
+}
@@ -1,3 +1,4 @@
+#pragma once
 #include "math3d.h"
 
 namespace raytracer {
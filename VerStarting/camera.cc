@@ -63,11 +63,39 @@ void Camera::Sensor::Reset() {
 }
 
 Ray Camera::Sensor::GetRay(int x, int y) const {
+  return GetSubpixelRay(x, y);
+}
+
+Ray Camera::Sensor::GetSubpixelRay(V3D::basetype x, V3D::basetype y) const {
   V3D direction = start_point + (delta_scanline * y) + (delta_pixel * x);
   direction.Norm();
   return { cam->origin, direction };
 }
 
+bool Camera::Sensor::Project(
+    const V3D& point, V3D::basetype *x, V3D::basetype *y) const {
+  // Find where the line between the camera and the point crosses the sensor
+  // plane (i.e. the plane of start_point + delta_pixel * x + ...), then get
+  // the coordinates of the crossing within the plane.
+  const V3D normal = delta_pixel.Cross(delta_scanline);
+  const V3D direction = point - cam->origin;
+  const V3D::basetype direction_dot = direction.Dot(normal);
+  if (direction_dot == 0.0) {
+    return false;
+  }
+
+  const V3D::basetype scale = start_point.Dot(normal) / direction_dot;
+  if (scale <= 0.0) {
+    return false;
+  }
+
+  const V3D on_sensor = direction * scale - start_point;
+  const V3D::basetype normal_sqr = normal.Dot(normal);
+  *x = on_sensor.Cross(delta_scanline).Dot(normal) / normal_sqr;
+  *y = delta_pixel.Cross(on_sensor).Dot(normal) / normal_sqr;
+  return true;
+}
+
 void Camera::Serialize(std::vector<uint8_t> *bytes) {
   bytes->resize(kSerializedSize);
 
@@ -15,6 +15,14 @@ class Camera {
    public:
     Ray GetRay(int x, int y) const;
 
+    // Same as above, but at an arbitrary point on the sensor (e.g. x + 0.5
+    // is the middle of the pixel).
+    Ray GetSubpixelRay(V3D::basetype x, V3D::basetype y) const;
+
+    // The inverse of the above, i.e. finds where on the sensor the point is
+    // seen. Returns false if the point is behind the camera.
+    bool Project(const V3D& point, V3D::basetype *x, V3D::basetype *y) const;
+
    private:
     void Reset();
     V3D delta_scanline;
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <cstring>
+
+namespace raytracer {
+
+// IEEE 754 binary16 conversions, used for compact storage of colors.
+// Denormals are flushed to zero, values out of range are saturated to the
+// largest finite half and there's no handling of infinities or NaNs.
+inline uint16_t FloatToHalf(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+
+  const uint32_t sign = (x >> 16) & 0x8000;
+  const int exponent = (int)((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = x & 0x7fffff;
+
+  if (exponent <= 0) {
+    return sign;
+  }
+
+  if (exponent >= 31) {
+    return sign | 0x7bff;  // Largest finite half.
+  }
+
+  // Round to nearest.
+  mantissa += 0x1000;
+  if (mantissa & 0x800000) {
+    mantissa = 0;
+    if (exponent + 1 >= 31) {
+      return sign | 0x7bff;
+    }
+    return sign | ((exponent + 1) << 10);
+  }
+
+  return sign | (exponent << 10) | (mantissa >> 13);
+}
+
+inline float HalfToFloat(uint16_t h) {
+  const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  const uint32_t exponent = (h >> 10) & 0x1f;
+  const uint32_t mantissa = h & 0x3ff;
+
+  uint32_t x = sign;
+  if (exponent != 0) {
+    x |= ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  }
+
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+}  // namespace raytracer
+
@@ -0,0 +1,171 @@
+// Direct lighting benchmark. Renders a synthetic scene with an increasing
+// number of point lights, with and without the light tree. The last column
+// re-shades the camera ray hits kept from the previous light count (except
+// for the first row), as when iterating on the lighting of a scene.
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "mythtracer.h"
+#include "primitive_triangle.h"
+#include "test_helper.h"
+
+using math3d::V3D;
+using namespace raytracer;
+using test::Rand;
+
+const int W = 160;
+const int H = 90;
+
+static void AddQuad(Scene *scene, Material *mtl,
+                    const V3D& a, const V3D& b, const V3D& c, const V3D& d) {
+  V3D normal = (b - a).Cross(c - a);
+  normal.Norm();
+
+  const V3D quad[2][3] = { { a, b, c }, { c, d, a } };
+  for (const auto& vertices : quad) {
+    Triangle *tr = new Triangle();
+    for (int i = 0; i < 3; i++) {
+      tr->vertex[i] = vertices[i];
+      tr->normal[i] = normal;
+    }
+    tr->mtl = mtl;
+    tr->CacheAABB();
+    scene->tree.AddPrimitive(tr);
+  }
+}
+
+static void AddBox(Scene *scene, Material *mtl,
+                   const V3D& min, const V3D& max) {
+  const V3D& a = min;
+  const V3D& b = max;
+  AddQuad(scene, mtl, {a.v[0], a.v[1], a.v[2]}, {b.v[0], a.v[1], a.v[2]},
+                      {b.v[0], b.v[1], a.v[2]}, {a.v[0], b.v[1], a.v[2]});
+  AddQuad(scene, mtl, {a.v[0], a.v[1], b.v[2]}, {b.v[0], a.v[1], b.v[2]},
+                      {b.v[0], b.v[1], b.v[2]}, {a.v[0], b.v[1], b.v[2]});
+  AddQuad(scene, mtl, {a.v[0], a.v[1], a.v[2]}, {a.v[0], b.v[1], a.v[2]},
+                      {a.v[0], b.v[1], b.v[2]}, {a.v[0], a.v[1], b.v[2]});
+  AddQuad(scene, mtl, {b.v[0], a.v[1], a.v[2]}, {b.v[0], b.v[1], a.v[2]},
+                      {b.v[0], b.v[1], b.v[2]}, {b.v[0], a.v[1], b.v[2]});
+  AddQuad(scene, mtl, {a.v[0], b.v[1], a.v[2]}, {b.v[0], b.v[1], a.v[2]},
+                      {b.v[0], b.v[1], b.v[2]}, {a.v[0], b.v[1], b.v[2]});
+}
+
+static void BuildScene(Scene *scene) {
+  auto mtl = std::make_unique<Material>();
+  mtl->ambient = { 0.8, 0.8, 0.8 };
+  mtl->diffuse = { 0.8, 0.8, 0.8 };
+  mtl->specular = { 0.3, 0.3, 0.3 };
+  mtl->specular_exp = 20.0;
+  Material *m = mtl.get();
+  scene->materials["bench"] = std::move(mtl);
+
+  // Floor split into a grid, so that the octree has something to do.
+  for (int j = 0; j < 20; j++) {
+    for (int i = 0; i < 20; i++) {
+      const double x = i * 20.0, z = j * 20.0;
+      AddQuad(scene, m, {x, 0.0, z}, {x, 0.0, z + 20.0},
+                        {x + 20.0, 0.0, z + 20.0}, {x + 20.0, 0.0, z});
+    }
+  }
+
+  // A few pillars casting shadows.
+  uint32_t seed = 42;
+  for (int i = 0; i < 40; i++) {
+    const double x = Rand(&seed) * 380.0, z = Rand(&seed) * 380.0;
+    const double height = 20.0 + Rand(&seed) * 60.0;
+    AddBox(scene, m, {x, 0.0, z}, {x + 10.0, height, z + 10.0});
+  }
+}
+
+// Lights are spread over the room and the storey below it (so some of them are
+// behind the floor).
+static void SetLights(Scene *scene, int count) {
+  uint32_t seed = 1234;
+  const double power = 2.0 / count;
+  scene->lights.clear();
+  for (int i = 0; i < count; i++) {
+    scene->lights.push_back(Light{
+        { Rand(&seed) * 400.0,
+          -50.0 + Rand(&seed) * 150.0,
+          Rand(&seed) * 400.0 },
+        { 0.0, 0.0, 0.0 },
+        { power, power, power },
+        { power, power, power }
+    });
+  }
+}
+
+struct BenchResult {
+  double seconds;
+  RenderStats stats;
+};
+
+static BenchResult Render(MythTracer *mt, const Camera& cam,
+                          const RenderSettings& settings) {
+  WorkChunk chunk{};
+  chunk.image_width = chunk.chunk_width = W;
+  chunk.image_height = chunk.chunk_height = H;
+  chunk.camera = cam;
+  chunk.settings = settings;
+  chunk.output_bitmap.resize(W * H * 3);
+
+  auto start = std::chrono::steady_clock::now();
+  mt->RayTrace(&chunk);
+  auto end = std::chrono::steady_clock::now();
+
+  return {
+    std::chrono::duration<double>(end - start).count(),
+    chunk.output_stats
+  };
+}
+
+int main(void) {
+  MythTracer mt;
+  BuildScene(mt.GetScene());
+
+  Camera cam{
+    { 200.0, 150.0, -100.0 },
+     35.0, 0.0, 0.0,
+     90.0
+  };
+
+  RenderSettings linear;
+  linear.use_light_tree = false;
+
+  RenderSettings tree;
+
+  RenderSettings tree_budget;
+  tree_budget.light_error_budget = 1.0 / 16.0;
+
+  RenderSettings tree_gbuffer;
+  tree_gbuffer.reuse_primary_hits = true;
+
+  std::vector<std::pair<int, BenchResult[4]>> results;
+  for (int count = 1; count <= 1024; count *= 2) {
+    SetLights(mt.GetScene(), count);
+    results.emplace_back();
+    results.back().first = count;
+    results.back().second[0] = Render(&mt, cam, linear);
+    results.back().second[1] = Render(&mt, cam, tree);
+    results.back().second[2] = Render(&mt, cam, tree_budget);
+    results.back().second[3] = Render(&mt, cam, tree_gbuffer);
+  }
+
+  puts("\nlights | linear         | tree           | tree, budget 1/16 |"
+       " tree, G-buffer");
+  puts("       | time   shadows | time   shadows | time   shadows    |"
+       " time   shadows");
+  for (const auto& [count, res] : results) {
+    printf("%6i |", count);
+    for (int i = 0; i < 4; i++) {
+      printf(" %6.3fs %7llu |", res[i].seconds,
+             (unsigned long long)res[i].stats.shadow_rays);
+    }
+    putchar('\n');
+  }
+
+  return 0;
+}
+
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include "light_tree.h"
+
+namespace raytracer {
+
+void LightTree::Build(const std::vector<Light>& lights) {
+  nodes.clear();
+  light_indices.resize(lights.size());
+  leaf_lights.resize(lights.size());
+  total_ambient = {};
+
+  for (size_t i = 0; i < lights.size(); i++) {
+    light_indices[i] = i;
+    leaf_lights[i] = { lights[i].position, lights[i].diffuse,
+                       lights[i].specular };
+    total_ambient += lights[i].ambient;
+  }
+
+  if (lights.empty()) {
+    return;
+  }
+
+  nodes.reserve(lights.size() * 2);
+  BuildNode(0, (uint32_t)lights.size());
+
+  // Reorder the light data to match the order of the indices.
+  for (size_t i = 0; i < lights.size(); i++) {
+    const Light& light = lights[light_indices[i]];
+    leaf_lights[i] = { light.position, light.diffuse, light.specular };
+  }
+}
+
+uint32_t LightTree::BuildNode(uint32_t first, uint32_t count) {
+  const uint32_t node_idx = (uint32_t)nodes.size();
+  nodes.emplace_back();
+
+  Node node;
+  node.first = first;
+  node.count = count;
+
+  const V3D& first_position = leaf_lights[light_indices[first]].position;
+  node.aabb = { first_position, first_position };
+  for (uint32_t i = first; i < first + count; i++) {
+    const LeafLight& light = leaf_lights[light_indices[i]];
+    node.aabb.Extend(light.position);
+    node.diffuse += light.diffuse;
+    node.specular += light.specular;
+  }
+
+  if (count > LEAF_SIZE) {
+    // Split at the median along the longest axis.
+    const V3D size = node.aabb.max - node.aabb.min;
+    int axis = 0;
+    if (size.v[1] > size.v[axis]) axis = 1;
+    if (size.v[2] > size.v[axis]) axis = 2;
+
+    const uint32_t half = count / 2;
+    auto begin = light_indices.begin() + first;
+    std::nth_element(begin, begin + half, begin + count,
+        [this, axis](size_t a, size_t b) {
+      return leaf_lights[a].position.v[axis] < leaf_lights[b].position.v[axis];
+    });
+
+    BuildNode(first, half);
+    node.right = BuildNode(first + half, count - half);
+  }
+
+  nodes[node_idx] = node;
+  return node_idx;
+}
+
+void LightTree::SelectLights(
+    const V3D& point, const V3D& normal,
+    const V3D& diffuse_weight, const V3D& specular_weight,
+    V3D::basetype error_budget,
+    LightSelection *selection) const {
+  selection->lights.clear();
+  if (nodes.empty()) {
+    return;
+  }
+
+  const V3D::basetype point_dot = point.Dot(normal);
+
+  uint32_t stack[64];
+  size_t stack_size = 0;
+  stack[stack_size++] = 0;
+
+  while (stack_size > 0) {
+    const Node& node = nodes[stack[--stack_size]];
+
+    // Find the corner of the AABB that is the furthest in the direction of the
+    // normal. If even that corner is behind the surface, so are all the lights.
+    V3D::basetype max_dot = -point_dot;
+    for (int i = 0; i < 3; i++) {
+      max_dot += normal.v[i] * (normal.v[i] > 0.0 ? node.aabb.max.v[i] :
+                                                    node.aabb.min.v[i]);
+    }
+
+    if (max_dot <= 0.0) {
+      selection->culled_facing += node.count;
+      continue;
+    }
+
+    // Check whether the whole group is dim enough to be dropped.
+    if (error_budget > 0.0) {
+      const V3D bound = diffuse_weight * node.diffuse +
+                        specular_weight * node.specular;
+      const V3D::basetype max_bound =
+          std::max({ bound.v[0], bound.v[1], bound.v[2] });
+      if (max_bound <= error_budget) {
+        error_budget -= max_bound;
+        selection->dropped += node.count;
+        continue;
+      }
+    }
+
+    if (node.right != 0 && stack_size + 2 <= sizeof(stack) / sizeof(*stack)) {
+      stack[stack_size++] = node.right;
+      stack[stack_size++] = (uint32_t)(&node - &nodes[0]) + 1;
+      continue;
+    }
+
+    // Leaf (or a stack overflow, which should never happen with a balanced
+    // tree); check the lights one by one.
+    for (uint32_t i = node.first; i < node.first + node.count; i++) {
+      if ((leaf_lights[i].position - point).Dot(normal) <= 0.0) {
+        selection->culled_facing++;
+        continue;
+      }
+
+      selection->lights.push_back(light_indices[i]);
+    }
+  }
+}
+
+V3D LightTree::GetTotalAmbient() const {
+  return total_ambient;
+}
+
+}  // namespace raytracer
+
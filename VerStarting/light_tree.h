@@ -0,0 +1,74 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+#include "aabb.h"
+#include "light.h"
+#include "math3d.h"
+
+namespace raytracer {
+
+using math3d::V3D;
+
+// Result of the light selection for a single shaded point.
+struct LightSelection {
+  std::vector<size_t> lights;  // Indices into the scene's light vector.
+  uint64_t culled_facing = 0;  // Lights skipped as being behind the surface.
+  uint64_t dropped = 0;  // Lights skipped due to the error budget.
+};
+
+// A bounding volume hierarchy built over the point lights of a scene. Each
+// node knows the bounds of its lights and their total power, so whole groups
+// of lights can be rejected for a shaded point at once.
+class LightTree {
+ public:
+  // (Re)builds the tree. The tree doesn't keep any references to the lights,
+  // but it needs to be rebuilt every time they change.
+  void Build(const std::vector<Light>& lights);
+
+  // Selects the lights that should be considered when shading a point with the
+  // given normal. Lights behind the surface are always skipped. Lights (or
+  // groups of lights) whose maximum contribution to the color, i.e.
+  //   diffuse_weight * light.diffuse + specular_weight * light.specular
+  // still fits within the error budget are dropped as well, and their
+  // contribution is subtracted from the budget. A zero budget means exact
+  // lighting.
+  void SelectLights(
+      const V3D& point, const V3D& normal,
+      const V3D& diffuse_weight, const V3D& specular_weight,
+      V3D::basetype error_budget,
+      LightSelection *selection) const;
+
+  // Sum of ambient components of all the lights.
+  V3D GetTotalAmbient() const;
+
+ private:
+  // Nodes with this many lights or fewer are not split any further.
+  static const size_t LEAF_SIZE = 4;
+
+  // Nodes are stored in depth-first order, so the left child (if any) always
+  // immediately follows its parent.
+  struct Node {
+    AABB aabb;
+    V3D diffuse;   // Total diffuse power of the lights in this node.
+    V3D specular;  // Total specular power of the lights in this node.
+    uint32_t first = 0, count = 0;  // Range in the light_indices vector.
+    uint32_t right = 0;  // Index of the right child; 0 for leaves.
+  };
+
+  // Light data copied from the scene, in the same order as light_indices.
+  struct LeafLight {
+    V3D position;
+    V3D diffuse;
+    V3D specular;
+  };
+
+  uint32_t BuildNode(uint32_t first, uint32_t count);
+
+  std::vector<Node> nodes;
+  std::vector<size_t> light_indices;
+  std::vector<LeafLight> leaf_lights;
+  V3D total_ambient;
+};
+
+}  // namespace raytracer
+
@@ -0,0 +1,76 @@
+#include <algorithm>
+#include <vector>
+#include "light_tree.h"
+#include "test_helper.h"
+
+using namespace test;
+using raytracer::Light;
+using raytracer::LightSelection;
+using raytracer::LightTree;
+using math3d::V3D;
+
+int main(void) {
+  uint32_t seed = 1337;
+
+  std::vector<Light> lights;
+  for (int i = 0; i < 100; i++) {
+    lights.push_back(Light{
+        { Rand(&seed) * 100.0, Rand(&seed) * 100.0, Rand(&seed) * 100.0 },
+        { 0.01, 0.01, 0.01 },
+        { 0.1, 0.1, 0.1 },
+        { 0.1, 0.1, 0.1 }
+    });
+  }
+
+  LightTree tree;
+  tree.Build(lights);
+  TESTEQ(tree.GetTotalAmbient(), (V3D{1.0, 1.0, 1.0}));
+
+  const V3D one{1.0, 1.0, 1.0};
+  LightSelection selection;
+
+  for (int i = 0; i < 50; i++) {
+    V3D point{ Rand(&seed) * 100.0, Rand(&seed) * 100.0, Rand(&seed) * 100.0 };
+    V3D normal{ Rand(&seed) - 0.5, Rand(&seed) - 0.5, Rand(&seed) - 0.5 };
+    normal.Norm();
+
+    // Without an error budget the selection must be exactly the set of lights
+    // in front of the surface.
+    std::vector<size_t> expected;
+    for (size_t j = 0; j < lights.size(); j++) {
+      if ((lights[j].position - point).Dot(normal) > 0.0) {
+        expected.push_back(j);
+      }
+    }
+
+    selection = LightSelection{};
+    tree.SelectLights(point, normal, one, one, 0.0, &selection);
+    std::sort(selection.lights.begin(), selection.lights.end());
+    TESTEQ(selection.lights == expected, true);
+    TESTEQ(selection.culled_facing,
+           (uint64_t)(lights.size() - expected.size()));
+    TESTEQ(selection.dropped, (uint64_t)0);
+
+    // Each light contributes at most 0.2 here, so a budget of 1.0 allows
+    // dropping at most 5 of them (although the counter might also include
+    // lights behind the surface that were in the same group).
+    selection = LightSelection{};
+    tree.SelectLights(point, normal, one, one, 1.0, &selection);
+    std::sort(selection.lights.begin(), selection.lights.end());
+    TESTEQ(selection.lights.size() + selection.dropped +
+           selection.culled_facing, lights.size());
+    TESTEQ(std::includes(expected.begin(), expected.end(),
+                         selection.lights.begin(), selection.lights.end()),
+           true);
+    TESTEQ(selection.lights.size() + 5 >= expected.size(), true);
+  }
+
+  // Empty scene.
+  tree.Build({});
+  selection = LightSelection{};
+  tree.SelectLights({}, one, one, one, 0.0, &selection);
+  TESTEQ(selection.lights.empty(), true);
+
+  return 0;
+}
+
@@ -17,6 +17,7 @@ using raytracer::AABB;
 using raytracer::PerPixelDebugInfo;
 using raytracer::Camera;
 using raytracer::Light;
+using raytracer::RenderSettings;
 const int W = 1920/4;  // 960 480
 const int H = 1080/4;  // 540 270
 
@@ -47,6 +48,9 @@ int main(void) {
 
   std::vector<PerPixelDebugInfo> debug(W * H);
   std::vector<uint8_t> bitmap(W * H * 3);
+
+  RenderSettings settings;
+
   int frame = 0;
   for (double angle = 0.0; angle <= 360.0; angle += 2.0, frame++) {
 
@@ -119,7 +123,7 @@ int main(void) {
 
   //mt.RayTrace(&chunk);
 
-  mt.RayTrace(W, H, &cam, &bitmap);
+  mt.RayTrace(W, H, &cam, &bitmap, settings);
 
 
   puts("Writing");
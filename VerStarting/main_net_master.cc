@@ -1,17 +1,29 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
 #include <vector>
-#ifdef __unix__
-#  include <sys/stat.h>
-#  include <sys/types.h>
-#else
-#  include <direct.h>
+// Note: Unlike the worker, the master builds only on Linux.
+#ifndef __linux__
+#  error "The master's event loop uses epoll, which is Linux-specific."
 #endif
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <chrono>
+#include <condition_variable>
 #include <thread>
 #include <mutex>
 #include <unordered_map>
 #include <list>
-#include <time.h>
+#include <deque>
+#include <limits>
 #include "mythtracer.h"
 #include "camera.h"
 #include "octtree.h"
@@ -24,16 +36,348 @@ const int H = 1080;  // 540 270
 const int CHUNK_W = 128;
 const int CHUNK_H = 128;
 
+// Bounds of the adaptive chunks. Sizes are powers of two, so that the chunks
+// always line up with the cost map cells.
+const int MIN_CHUNK_SIZE = 32;
+const int MAX_CHUNK_SIZE = 256;
+
+// How many work chunks are sent to a worker ahead of time, so that it never
+// waits for the next chunk after sending in the results. Can be changed on
+// the command line. This is for a worker of average speed, faster workers get
+// proportionally more (up to MAX_WINDOW_SCALE times as many) and slower ones
+// fewer (but at least one).
+const size_t DEFAULT_CHUNKS_IN_FLIGHT = 3;
+const size_t MAX_WINDOW_SCALE = 4;
+
+// Straggler handling: once there is no more work to hand out, chunks which
+// take longer than TIME_PERCENTILE of the usual render time (per pixel) times
+// DEADLINE_SLACK are copied to idle workers, and whichever copy comes back
+// first is used. The render times are those of the last TIME_SAMPLES chunks,
+// per worker and overall.
+const double TIME_PERCENTILE = 0.9;
+const double DEADLINE_SLACK = 1.5;
+const size_t TIME_SAMPLES = 64;
+const size_t MIN_TIME_SAMPLES = 8;
+
 class ReadyWorkChunk {
  public:
   std::unique_ptr<WorkChunk> work;
   std::string id;  // Who has done the work.
 };
 
-std::mutex g_work_available_guard;
-std::list<unique_ptr<WorkChunk>> g_work_available;
+// Estimated render time of any part of the image, based on how long the
+// chunks covering it took in the previous frame.
+class CostMap {
+ public:
+  void Record(const WorkChunk& work, double seconds);
+
+  // Returns false if the cost of some part of the frame isn't known yet.
+  bool IsComplete(int width, int height) const;
+
+  // In seconds. Unknown parts of the area count as free.
+  double Estimate(int x, int y, int width, int height) const;
+
+ private:
+  static const int kCellSize = MIN_CHUNK_SIZE;
+
+  int width = 0;
+  int height = 0;
+  int columns = 0;
+  int rows = 0;
+  std::vector<double> density;  // Seconds per pixel, negative if unknown.
+};
+
+void CostMap::Record(const WorkChunk& work, double seconds) {
+  if (work.image_width != width || work.image_height != height) {
+    width = work.image_width;
+    height = work.image_height;
+    columns = (width + kCellSize - 1) / kCellSize;
+    rows = (height + kCellSize - 1) / kCellSize;
+    density.assign((size_t)columns * rows, -1.0);
+  }
+
+  const int area = work.chunk_width * work.chunk_height;
+  if (area <= 0) {
+    return;
+  }
+
+  const int x_end = std::min(work.chunk_x + work.chunk_width, width);
+  const int y_end = std::min(work.chunk_y + work.chunk_height, height);
+  for (int y = work.chunk_y / kCellSize; y * kCellSize < y_end; y++) {
+    for (int x = work.chunk_x / kCellSize; x * kCellSize < x_end; x++) {
+      density[y * columns + x] = seconds / area;
+    }
+  }
+}
+
+bool CostMap::IsComplete(int width, int height) const {
+  if (width != this->width || height != this->height) {
+    return false;
+  }
+
+  return std::none_of(density.begin(), density.end(),
+                      [](double d) { return d < 0.0; });
+}
+
+double CostMap::Estimate(int x, int y, int width, int height) const {
+  const int x_end = std::min(x + width, this->width);
+  const int y_end = std::min(y + height, this->height);
+  double cost = 0.0;
+  for (int cy = y / kCellSize; cy * kCellSize < y_end; cy++) {
+    for (int cx = x / kCellSize; cx * kCellSize < x_end; cx++) {
+      const double d = density[cy * columns + cx];
+      if (d <= 0.0) {
+        continue;
+      }
+
+      // Only the part of the cell which is within the area counts.
+      const int w = std::min(x_end, (cx + 1) * kCellSize) -
+                    std::max(x, cx * kCellSize);
+      const int h = std::min(y_end, (cy + 1) * kCellSize) -
+                    std::max(y, cy * kCellSize);
+      cost += d * w * h;
+    }
+  }
+  return cost;
+}
+
+// Decides how a frame is split into work chunks.
+class ChunkPolicy {
+ public:
+  struct Rect {
+    int x, y, width, height;
+  };
+
+  virtual ~ChunkPolicy() { }
+  virtual const char *GetName() const = 0;
+
+  // Returns chunks covering the whole frame.
+  virtual std::vector<Rect> Split(int width, int height,
+                                  const CostMap& costs) const = 0;
+};
+
+// The same chunk size everywhere.
+class FixedChunkPolicy : public ChunkPolicy {
+ public:
+  const char *GetName() const override { return "fixed"; }
+  std::vector<Rect> Split(int width, int height,
+                          const CostMap& costs) const override;
+};
+
+std::vector<ChunkPolicy::Rect> FixedChunkPolicy::Split(
+    int width, int height, const CostMap&) const {
+  std::vector<Rect> chunks;
+  for (int j = 0; j < height; j += CHUNK_H) {
+    for (int i = 0; i < width; i += CHUNK_W) {
+      chunks.push_back({
+          i, j, std::min(CHUNK_W, width - i), std::min(CHUNK_H, height - j)
+      });
+    }
+  }
+  return chunks;
+}
+
+// Big chunks where the previous frame was cheap to render and small ones
+// where it was expensive, so that all chunks take about the same time and
+// there are no stragglers holding up the end of the frame. The first frame
+// (when nothing is known yet) is split like the fixed policy does it.
+class AdaptiveChunkPolicy : public ChunkPolicy {
+ public:
+  const char *GetName() const override { return "adaptive"; }
+  std::vector<Rect> Split(int width, int height,
+                          const CostMap& costs) const override;
+
+ private:
+  // Splits the square into quarters until each is cheap enough.
+  void SplitSquare(int x, int y, int size, int width, int height,
+                   const CostMap& costs, double target_cost,
+                   std::vector<Rect> *chunks) const;
+};
+
+std::vector<ChunkPolicy::Rect> AdaptiveChunkPolicy::Split(
+    int width, int height, const CostMap& costs) const {
+  const double total_cost = costs.Estimate(0, 0, width, height);
+  if (!costs.IsComplete(width, height) || total_cost <= 0.0) {
+    return FixedChunkPolicy().Split(width, height, costs);
+  }
+
+  // About as many chunks as the fixed policy makes, but of equal cost
+  // instead of equal size.
+  const double target_cost =
+      total_cost * (CHUNK_W * CHUNK_H) / ((double)width * height);
+
+  std::vector<Rect> chunks;
+  for (int j = 0; j < height; j += MAX_CHUNK_SIZE) {
+    for (int i = 0; i < width; i += MAX_CHUNK_SIZE) {
+      SplitSquare(i, j, MAX_CHUNK_SIZE, width, height, costs, target_cost,
+                  &chunks);
+    }
+  }
+  return chunks;
+}
+
+void AdaptiveChunkPolicy::SplitSquare(
+    int x, int y, int size, int width, int height, const CostMap& costs,
+    double target_cost, std::vector<Rect> *chunks) const {
+  if (x >= width || y >= height) {
+    return;
+  }
+
+  const int w = std::min(size, width - x);
+  const int h = std::min(size, height - y);
+  if (size <= MIN_CHUNK_SIZE || costs.Estimate(x, y, w, h) <= target_cost) {
+    chunks->push_back({ x, y, w, h });
+    return;
+  }
+
+  const int half = size / 2;
+  SplitSquare(x, y, half, width, height, costs, target_cost, chunks);
+  SplitSquare(x + half, y, half, width, height, costs, target_cost, chunks);
+  SplitSquare(x, y + half, half, width, height, costs, target_cost, chunks);
+  SplitSquare(x + half, y + half, half, width, height, costs, target_cost,
+              chunks);
+}
+
+// Work chunks waiting to be sent to the workers, best ones first:
+//   1. Chunks which took the most time to render in the previous frame, so
+//      that the slow ones don't end up being the last ones in a frame.
+//   2. Chunks returned by disconnected workers, as they are late already.
+//      This matters mostly in the first frame, when there are no costs yet.
+//   3. Chunks closest to the center of the image, so that the preview of the
+//      first frame shows the interesting part first.
+class WorkQueue {
+ public:
+  // Replaces all the queued chunks.
+  void Reset(std::vector<std::unique_ptr<WorkChunk>> chunks);
+
+  void Push(std::unique_ptr<WorkChunk> work, bool retry);
+
+  // Returns nullptr if there is no work available at the moment.
+  std::unique_ptr<WorkChunk> TryPop();
+
+  // Remembers how long it took to render the chunk, for the next frame.
+  void RecordCost(const WorkChunk& work, double seconds);
+
+  // Returns the costs recorded so far.
+  CostMap GetCostMap();
+
+  // Render time stats of the chunks finished since the last call.
+  struct CostStats {
+    size_t count = 0;
+    double min = 0.0;
+    double max = 0.0;
+    double sum = 0.0;
+  };
+  CostStats TakeCostStats();
+
+ private:
+  struct Entry {
+    double cost;
+    bool retry;
+    double center_distance;
+    uint64_t sequence;  // Keeps the order stable between equal entries.
+    std::unique_ptr<WorkChunk> work;
+
+    // Note: std::push_heap et al. keep the "largest" entry at the front.
+    bool operator<(const Entry& other) const {
+      if (cost != other.cost) {
+        return cost < other.cost;
+      }
+
+      if (retry != other.retry) {
+        return !retry;
+      }
+
+      if (center_distance != other.center_distance) {
+        return center_distance > other.center_distance;
+      }
+
+      return sequence > other.sequence;
+    }
+  };
+
+  // Must be called with the lock held.
+  void PushLocked(std::unique_ptr<WorkChunk> work, bool retry);
+
+  std::mutex m;
+  std::vector<Entry> heap;
+  uint64_t next_sequence = 0;
+
+  CostMap costs;
+  CostStats stats;
+};
+
+void WorkQueue::Reset(std::vector<std::unique_ptr<WorkChunk>> chunks) {
+  std::lock_guard<std::mutex> lock(m);
+  heap.clear();
+  for (auto& work : chunks) {
+    PushLocked(std::move(work), false);
+  }
+}
+
+void WorkQueue::Push(std::unique_ptr<WorkChunk> work, bool retry) {
+  std::lock_guard<std::mutex> lock(m);
+  PushLocked(std::move(work), retry);
+}
+
+void WorkQueue::PushLocked(std::unique_ptr<WorkChunk> work, bool retry) {
+  const double cost = costs.Estimate(
+      work->chunk_x, work->chunk_y, work->chunk_width, work->chunk_height);
+  const double dx =
+      work->chunk_x + work->chunk_width / 2 - work->image_width / 2;
+  const double dy =
+      work->chunk_y + work->chunk_height / 2 - work->image_height / 2;
+
+  Entry entry{
+    cost,
+    retry,
+    dx * dx + dy * dy,
+    next_sequence++,
+    std::move(work)
+  };
+
+  heap.push_back(std::move(entry));
+  std::push_heap(heap.begin(), heap.end());
+}
+
+std::unique_ptr<WorkChunk> WorkQueue::TryPop() {
+  std::lock_guard<std::mutex> lock(m);
+  if (heap.empty()) {
+    return nullptr;
+  }
+
+  std::pop_heap(heap.begin(), heap.end());
+  std::unique_ptr<WorkChunk> work = std::move(heap.back().work);
+  heap.pop_back();
+  return work;
+}
+
+void WorkQueue::RecordCost(const WorkChunk& work, double seconds) {
+  std::lock_guard<std::mutex> lock(m);
+  costs.Record(work, seconds);
+
+  stats.min = stats.count == 0 ? seconds : std::min(stats.min, seconds);
+  stats.max = std::max(stats.max, seconds);
+  stats.sum += seconds;
+  stats.count++;
+}
+
+CostMap WorkQueue::GetCostMap() {
+  std::lock_guard<std::mutex> lock(m);
+  return costs;
+}
+
+WorkQueue::CostStats WorkQueue::TakeCostStats() {
+  std::lock_guard<std::mutex> lock(m);
+  CostStats taken = stats;
+  stats = CostStats();
+  return taken;
+}
+
+WorkQueue g_work_available;
 
 std::mutex g_work_finished_guard;
+std::condition_variable g_work_finished_cv;
 std::list<unique_ptr<ReadyWorkChunk>> g_work_finished;
 
 // https://stackoverflow.com/questions/10890242/get-the-status-of-a-stdfuture
@@ -42,210 +386,915 @@ std::list<unique_ptr<ReadyWorkChunk>> g_work_finished;
   { return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
 */
 
+void NotifyWorkAvailable();
 
 void CommitWorkChunk(WorkChunk *work, const std::string& id) {
   auto ready = std::make_unique<ReadyWorkChunk>();
   ready->work.reset(work);
   ready->id = id;
 
-  std::lock_guard<std::mutex> lock(g_work_finished_guard);
-  g_work_finished.push_back(std::move(ready));
+  {
+    std::lock_guard<std::mutex> lock(g_work_finished_guard);
+    g_work_finished.push_back(std::move(ready));
+  }
+  g_work_finished_cv.notify_one();
+}
+
+// Returns the given percentile (0 to 1) of the values.
+double Percentile(const std::deque<double>& values, double percentile) {
+  if (values.empty()) {
+    return 0.0;
+  }
+
+  std::vector<double> sorted(values.begin(), values.end());
+  const size_t idx = std::min(
+      (size_t)(percentile * sorted.size()), sorted.size() - 1);
+  std::nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+  return sorted[idx];
 }
 
-void ReturnWorkChunk(WorkChunk *work_ptr) {
+void ReturnWorkChunk(WorkChunk *work) {
   puts("Returning work to queue.");
-  std::lock_guard<std::mutex> lock(g_work_available_guard);
-  std::unique_ptr<WorkChunk> work(work_ptr);
-  g_work_available.push_back(std::move(work));
+  g_work_available.Push(std::unique_ptr<WorkChunk>(work), /*retry=*/true);
+  NotifyWorkAvailable();
 }
 
-WorkChunk *GetWorkChunk() {
-  // Work might not be available immediately.
-  WorkChunk *work = nullptr;
-  for (;;)
-  {
-    {
-      std::lock_guard<std::mutex> lock(g_work_available_guard);
-      if (!g_work_available.empty()) {
-        work = g_work_available.front().release();  
-        g_work_available.pop_front();
-        break;
-      }
+// Handles all the worker connections on a single thread, with non-blocking
+// sockets and epoll. Work is dispatched whenever a worker has free slots
+// and there is work available (see WakeUp).
+class MasterServer {
+ public:
+  MasterServer(NetSock *listener, size_t chunks_in_flight,
+               const netproto::MasterScene::PackedScene *scene)
+      : listener(listener), chunks_in_flight(chunks_in_flight),
+        scene(scene) { }
+  ~MasterServer();
+
+  bool Init();
+  void Run();  // Never returns.
+
+  // Makes the server check for new work. Can be called from any thread.
+  void WakeUp();
+
+ private:
+  struct WorkReturner {
+    void operator()(WorkChunk *work) const {
+      ReturnWorkChunk(work);
+    };
+  };
+
+  struct InFlightChunk {
+    uint32_t id;  // See netproto::MasterRenderOrder.
+    std::unique_ptr<WorkChunk, WorkReturner> work;
+    std::chrono::steady_clock::time_point sent;
+  };
+
+  struct Worker {
+    std::unique_ptr<NetSock> sock;
+    std::string addr;
+    std::string id;  // Empty until RDY! is received.
+    uint32_t features = 0;  // See netproto::WorkerFeatures.
+    netproto::WorkerCapabilities capabilities;
+
+    // Pixels per second once measured, before that the benchmark score
+    // converted to the same unit (see UpdateWindows). Zero if unknown.
+    double speed = 0.0;
+    size_t window = 0;  // How many chunks can be in flight at a time.
+    netproto::PacketReader reader{netproto::kCommunicationSide::kMaster};
+    netproto::PacketWriter writer;
+    bool waiting_for_write = false;  // Whether EPOLLOUT is enabled.
+    bool work_queued = false;  // WORK queued since the last DispatchWork.
+
+    // Chunks sent to the worker, oldest first. Results are matched by the
+    // chunk ID, as cancelled chunks are skipped by the worker. Whatever is
+    // still here when the worker disconnects goes back to the queue.
+    std::deque<InFlightChunk> in_flight;
+
+    // When the previous results came in, i.e. more or less when the worker
+    // started rendering the oldest chunk in flight (unless it was idle).
+    std::chrono::steady_clock::time_point last_result_time;
+
+    // Render times of the recent chunks, in seconds per pixel.
+    std::deque<double> render_times;
+  };
+
+  void AcceptConnections();
+  bool HandleInput(Worker *w);
+  bool HandlePacket(Worker *w, netproto::NetworkProto *p);
+  bool Flush(Worker *w);
+  void DispatchWork();
+  void SendOrder(Worker *w, std::unique_ptr<WorkChunk> work, uint32_t id);
+  void SpeculateOnStragglers();
+  void CancelCopies(uint32_t id);
+  void RecordRenderTime(Worker *w, const WorkChunk& work, double seconds);
+  void UpdateWindows();
+  void DropWorker(Worker *w);
+
+  std::unique_ptr<NetSock> listener;
+  size_t chunks_in_flight;
+  const netproto::MasterScene::PackedScene *scene;
+  int epoll_fd = -1;
+  int wake_fd = -1;  // eventfd.
+  std::unordered_map<int, std::unique_ptr<Worker>> workers;  // By socket.
+
+  uint32_t next_chunk_id = 0;
+
+  // Number of workers each chunk was sent to, by chunk ID. More than one if
+  // it was copied for being late.
+  std::unordered_map<uint32_t, size_t> copies;
+
+  std::deque<double> render_times;  // Like Worker::render_times, for all.
+};
+
+MasterServer *g_server;
+
+void NotifyWorkAvailable() {
+  if (g_server != nullptr) {
+    g_server->WakeUp();
+  }
+}
+
+MasterServer::~MasterServer() {
+  workers.clear();
+
+  if (wake_fd != -1) {
+    close(wake_fd);
+  }
+
+  if (epoll_fd != -1) {
+    close(epoll_fd);
+  }
+}
+
+bool MasterServer::Init() {
+  epoll_fd = epoll_create1(0);
+  wake_fd = eventfd(0, EFD_NONBLOCK);
+  if (epoll_fd == -1 || wake_fd == -1) {
+    perror("error: failed to create epoll/eventfd");
+    return false;
+  }
+
+  listener->SetMode(NetSock::ASYNCHRONIC);
+
+  for (int fd : { wake_fd, listener->GetDescriptor() }) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      perror("error: epoll_ctl failed");
+      return false;
     }
-    
-    std::this_thread::sleep_for(100ms);
   }
 
-  return work;
+  printf("CH: Listening at: %s:%u\n",
+      listener->GetStrBindIP(), listener->GetBindPort());
+  fflush(stdout);
+  return true;
 }
 
-void WorkerHandler(NetSock *sock) {
-  unique_ptr<NetSock> s(sock);
-  char addr[32]{};
-  sprintf(addr, "%s:%u", s->GetStrIP(), s->GetPort());
+void MasterServer::WakeUp() {
+  const uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+    // The counter is already non-zero, so the server will wake up anyway.
+  }
+}
 
-  // Handle initial RDY! packet.
-  std::unique_ptr<netproto::NetworkProto> p(
-      netproto::ReceivePacket(s.get(), netproto::kCommunicationSide::kMaster));
-  if (p == nullptr) {
-    printf("WH:%s: invalid proto or disconnected before RDY\n", addr);
-    fflush(stdout);
-    return;
+void MasterServer::Run() {
+  const int kMaxEvents = 64;
+  epoll_event events[kMaxEvents];
+
+  for (;;) {
+    // While chunks are in flight, look for stragglers every now and then,
+    // even if nothing happens.
+    const int kStragglerCheckMs = 100;
+    const int count = epoll_wait(epoll_fd, events, kMaxEvents,
+                                 copies.empty() ? -1 : kStragglerCheckMs);
+    if (count == -1) {
+      if (errno != EINTR) {
+        perror("error: epoll_wait failed");
+        std::this_thread::sleep_for(1s);
+      }
+      continue;
+    }
+
+    // Dispatching is done once all the events are handled, as the results
+    // which came in free up slots in the workers' queues.
+    bool dispatch = count == 0;
+    for (int i = 0; i < count; i++) {
+      const int fd = events[i].data.fd;
+      if (fd == wake_fd) {
+        uint64_t value;
+        if (read(wake_fd, &value, sizeof(value)) == sizeof(value)) {
+          dispatch = true;
+        }
+        continue;
+      }
+
+      if (fd == listener->GetDescriptor()) {
+        AcceptConnections();
+        continue;
+      }
+
+      auto it = workers.find(fd);
+      if (it == workers.end()) {
+        continue;
+      }
+
+      Worker *w = it->second.get();
+      bool ok = true;
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ok = HandleInput(w);
+      }
+
+      if (ok && (events[i].events & EPOLLOUT)) {
+        ok = Flush(w);
+      }
+
+      if (!ok) {
+        DropWorker(w);
+        continue;
+      }
+
+      dispatch = true;
+    }
+
+    if (dispatch) {
+      DispatchWork();
+    }
   }
+}
+
+void MasterServer::AcceptConnections() {
+  for (;;) {
+    NetSock *s = listener->Accept();
+    if (s == nullptr) {
+      return;  // Nothing more to accept for now.
+    }
+
+    auto w = std::make_unique<Worker>();
+    w->sock.reset(s);
+    char addr[32]{};
+    sprintf(addr, "%s:%u", s->GetStrIP(), s->GetPort());
+    w->addr = addr;
+
+    s->SetMode(NetSock::ASYNCHRONIC);
+
+    // Packets are written whole (see PacketWriter), so there's nothing to
+    // gain from Nagle's algorithm, only the delay.
+    s->SetNoDelay(true);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = s->GetDescriptor();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
+      perror("error: epoll_ctl failed");
+      continue;
+    }
 
-  if (p->GetTag() != "RDY!") {
-    printf("WH:%s: expected RDY!, got %s\n", addr, p->GetTag().c_str());
+    printf("CH: New connection from %s\n", addr);
     fflush(stdout);
-    return;
+    workers[ev.data.fd] = std::move(w);
   }
+}
 
-  std::string id = p->id;
-  p.reset();
-
-  printf("WH:%s is %s\n", addr, id.c_str());
+bool MasterServer::HandleInput(Worker *w) {
+  const bool connected = w->reader.ReadAvailable(w->sock.get());
 
-  // Until the worker disconnects or times out, send it stuff to do.
-  // Unless there is no more stuff to do.
+  // Packets which arrived before a disconnect are still handled.
+  bool error = false;
   for (;;) {
-    struct WorkReturner {
-      void operator()(WorkChunk *work) const {
-        ReturnWorkChunk(work);
-      };
-    };
-    std::unique_ptr<WorkChunk, WorkReturner> work(GetWorkChunk());
-    if (work == nullptr) {
-      // Done!
+    std::unique_ptr<netproto::NetworkProto> p(w->reader.Next(&error));
+    if (p == nullptr) {
       break;
     }
 
-    // Send camera.
-    p.reset(netproto::MasterSetCamera::Make(id, &work->camera));
-    if (!netproto::SendPacket(s.get(), p.get())) {
-      printf("WH:%s: failed to send or disconnected\n", id.c_str());
-      fflush(stdout);
-      return;
+    if (!HandlePacket(w, p.get())) {
+      return false;
     }
+    w->reader.Recycle(&p->bytes);
+  }
 
-    // Send work chunk.
-    p.reset(netproto::MasterRenderOrder::Make(id, work.get()));
-    if (!netproto::SendPacket(s.get(), p.get())) {
-      printf("WH:%s: failed to send or disconnected\n", id.c_str());
-      fflush(stdout);
-      return;
-    }
+  if (error) {
+    printf("WH:%s: invalid proto\n", w->addr.c_str());
+    fflush(stdout);
+    return false;
+  }
 
-    printf("WH:%s: camera and work sent\n", id.c_str());
+  if (!connected) {
+    printf("WH:%s: disconnected\n", w->addr.c_str());
     fflush(stdout);
+    return false;
+  }
 
-    // Wait for response.
-    p.reset(netproto::ReceivePacket(s.get(), 
-                                    netproto::kCommunicationSide::kMaster));
-    if (p == nullptr) {
-      printf("WH:%s: invalid proto or disconnected\n", id.c_str());
+  return true;
+}
+
+bool MasterServer::HandlePacket(Worker *w, netproto::NetworkProto *p) {
+  // Handle initial RDY! packet.
+  if (w->id.empty()) {
+    if (p->GetTag() != "RDY!") {
+      printf("WH:%s: expected RDY!, got %s\n",
+             w->addr.c_str(), p->GetTag().c_str());
       fflush(stdout);
-      return;
+      return false;
     }
 
-    if (p->GetTag() != "PXLS") {
-      printf("WH:%s: expected PXLS, got %s\n", id.c_str(), p->GetTag().c_str());
+    w->id = p->id;
+    printf("WH:%s is %s\n", w->addr.c_str(), w->id.c_str());
+
+    std::vector<uint64_t> cached_scenes;
+    if (!static_cast<netproto::WorkerReady*>(p)->Parse(
+            &w->features, &w->capabilities, &cached_scenes)) {
+      printf("WH:%s: invalid RDY!\n", w->id.c_str());
       fflush(stdout);
-      return;
+      return false;
     }
 
-    if (!work->DeserializeOutput(p->bytes)) {
-      printf("WH:%s: failed to deserialize PXLS\n", id.c_str());
-      fflush(stdout);
-      return;
+    const double kGB = 1024.0 * 1024.0 * 1024.0;
+    printf("WH:%s: %u cores, %.1f GB of memory, benchmark score %.2f\n",
+           w->id.c_str(), w->capabilities.cores,
+           (double)w->capabilities.memory / kGB,
+           w->capabilities.benchmark_score);
+    if (w->capabilities.memory != 0 &&
+        w->capabilities.memory < scene->size) {
+      printf("WH:%s: warning: the scene (%.1f GB) might not fit in memory\n",
+             w->id.c_str(), (double)scene->size / kGB);
     }
+    UpdateWindows();
+
+    // The scene goes before any work, and the worker can't render without it
+    // anyway.
+    const bool cached = std::find(cached_scenes.begin(), cached_scenes.end(),
+                                  scene->hash) != cached_scenes.end();
+    if (cached) {
+      printf("WH:%s: has the scene cached\n", w->id.c_str());
+    } else {
+      printf("WH:%s: sending the scene (%.1f MB)\n", w->id.c_str(),
+             (double)scene->data.size() / (1024.0 * 1024.0));
+    }
+    fflush(stdout);
+
+    std::unique_ptr<netproto::NetworkProto> scne(
+        netproto::MasterScene::Make(w->id, *scene, !cached));
+    w->writer.Queue(scne.get());
+    return Flush(w);
+  }
+
+  if (p->GetTag() != "PXLS") {
+    printf("WH:%s: expected PXLS, got %s\n", w->id.c_str(), p->GetTag().c_str());
+    fflush(stdout);
+    return false;
+  }
+
+  uint32_t chunk_id;
+  auto *result = static_cast<netproto::WorkerRenderResult*>(p);
+  if (!result->GetChunkId(&chunk_id)) {
+    printf("WH:%s: failed to deserialize PXLS\n", w->id.c_str());
+    fflush(stdout);
+    return false;
+  }
 
-    printf("WH:%s: sent in pixels!\n", id.c_str());
+  const auto now = std::chrono::steady_clock::now();
+  auto it = std::find_if(w->in_flight.begin(), w->in_flight.end(),
+      [chunk_id](const InFlightChunk& c) { return c.id == chunk_id; });
+  if (it == w->in_flight.end()) {
+    // Most likely a copy of a chunk which another worker sent in first.
+    printf("WH:%s: ignoring pixels of chunk %u (not in flight)\n",
+           w->id.c_str(), chunk_id);
     fflush(stdout);
+    w->last_result_time = now;
+    return true;
+  }
 
-    CommitWorkChunk(work.release(), id);
+  WorkChunk *work = it->work.get();
+  float render_time;
+  if (!result->GetRenderTime(&render_time) || !result->GetOutput(work)) {
+    printf("WH:%s: failed to deserialize PXLS\n", w->id.c_str());
+    fflush(stdout);
+    return false;
   }
 
-  printf("WH:%s: no more work, disconnecting!\n", addr);
+  printf("WH:%s: sent in pixels!\n", w->id.c_str());
   fflush(stdout);
+
+  // The worker measures the time itself, as the time between its results
+  // would also include e.g. loading the scene before the first chunk.
+  RecordRenderTime(w, *work, render_time);
+  w->last_result_time = now;
+
+  CommitWorkChunk(it->work.release(), w->id);
+  w->in_flight.erase(it);
+  CancelCopies(chunk_id);
+  return true;
 }
 
-void ConnectionHandler(NetSock *server_sock) {
-  std::unique_ptr<NetSock> server(server_sock);
+void MasterServer::RecordRenderTime(
+    Worker *w, const WorkChunk& work, double seconds) {
+  g_work_available.RecordCost(work, seconds);
 
-  printf("CH: Listening at: %s:%u\n",
-      server->GetStrBindIP(), server->GetBindPort());
+  const double pixels = (double)work.chunk_width * work.chunk_height;
+  if (pixels <= 0.0) {
+    return;
+  }
+
+  for (std::deque<double> *times : { &w->render_times, &render_times }) {
+    times->push_back(seconds / pixels);
+    if (times->size() > TIME_SAMPLES) {
+      times->pop_front();
+    }
+  }
+
+  UpdateWindows();
+}
+
+void MasterServer::UpdateWindows() {
+  // The benchmark only tells how fast the workers are compared to each other,
+  // so it's converted to pixels per second using the workers whose speed was
+  // already measured. Until any is measured, scores are compared directly.
+  const auto measured_speed = [](const Worker *w) {
+    if (w->render_times.size() < MIN_TIME_SAMPLES) {
+      return 0.0;
+    }
+    const double rate = Percentile(w->render_times, 0.5);
+    return rate > 0.0 ? 1.0 / rate : 0.0;
+  };
+
+  double speed_per_point = 0.0;
+  size_t calibrated = 0;
+  bool any_measured = false;
+  for (auto& entry : workers) {
+    const Worker *w = entry.second.get();
+    const double speed = measured_speed(w);
+    if (speed > 0.0) {
+      any_measured = true;
+      if (w->capabilities.benchmark_score > 0.0f) {
+        speed_per_point += speed / w->capabilities.benchmark_score;
+        calibrated++;
+      }
+    }
+  }
+
+  if (calibrated != 0) {
+    speed_per_point /= calibrated;
+  } else if (!any_measured) {
+    speed_per_point = 1.0;
+  }
+
+  double speed_sum = 0.0;
+  size_t speed_count = 0;
+  for (auto& entry : workers) {
+    Worker *w = entry.second.get();
+    if (w->id.empty()) {
+      continue;
+    }
+
+    w->speed = measured_speed(w);
+    if (w->speed == 0.0) {
+      w->speed = w->capabilities.benchmark_score * speed_per_point;
+    }
+
+    if (w->speed > 0.0) {
+      speed_sum += w->speed;
+      speed_count++;
+    }
+  }
+
+  // Workers of unknown speed are assumed to be average.
+  const double average_speed =
+      speed_count != 0 ? speed_sum / speed_count : 0.0;
+  for (auto& entry : workers) {
+    Worker *w = entry.second.get();
+    if (w->id.empty()) {
+      continue;
+    }
+
+    size_t window = chunks_in_flight;
+    if (w->speed > 0.0 && average_speed > 0.0) {
+      // Measured speeds fluctuate, so the window changes only once it's well
+      // past the rounding point.
+      const double scaled = chunks_in_flight * w->speed / average_speed;
+      window = w->window != 0 && std::fabs(scaled - w->window) < 0.75 ?
+          w->window : (size_t)std::round(scaled);
+      window = std::clamp<size_t>(
+          window, 1, chunks_in_flight * MAX_WINDOW_SCALE);
+    }
+
+    if (window != w->window) {
+      printf("WH:%s: %zu chunks in flight at most (speed %.4g)\n",
+             w->id.c_str(), window, w->speed);
+      w->window = window;
+    }
+  }
   fflush(stdout);
+}
 
-  // TODO: Add a future/promise to know when to exit.
-  for (;;) {
-     NetSock *s = server->Accept();
-     if (s == nullptr) {
-       continue;
-     }
+void MasterServer::CancelCopies(uint32_t id) {
+  auto it = copies.find(id);
+  if (it == copies.end()) {
+    return;
+  }
+
+  const size_t count = it->second;
+  copies.erase(it);
+  if (count == 1) {
+    return;
+  }
 
-     std::thread worker_handler_thread(WorkerHandler, s);
-     worker_handler_thread.detach();
+  for (auto& entry : workers) {
+    Worker *w = entry.second.get();
+    auto c = std::find_if(w->in_flight.begin(), w->in_flight.end(),
+        [id](const InFlightChunk& c) { return c.id == id; });
+    if (c == w->in_flight.end()) {
+      continue;
+    }
 
-     printf("CH: New connection from %s:%u\n",
-         server->GetStrIP(), server->GetPort());
-     fflush(stdout);
+    // The copy isn't needed anymore, so it doesn't go back to the queue.
+    delete c->work.release();
+    w->in_flight.erase(c);
+
+    printf("WH:%s: cancelling chunk %u, it's done already\n",
+           w->id.c_str(), id);
+    std::unique_ptr<netproto::NetworkProto> p(
+        netproto::MasterCancelOrder::Make(w->id, id));
+    w->writer.Queue(p.get());
+  }
+  fflush(stdout);
+}
+
+bool MasterServer::Flush(Worker *w) {
+  if (!w->writer.Flush(w->sock.get())) {
+    printf("WH:%s: failed to send or disconnected\n", w->addr.c_str());
+    fflush(stdout);
+    return false;
   }
+
+  // Wait for the socket to become writable only if there's anything left.
+  const bool waiting_for_write = !w->writer.IsEmpty();
+  if (waiting_for_write != w->waiting_for_write) {
+    epoll_event ev{};
+    ev.events = waiting_for_write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.fd = w->sock->GetDescriptor();
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, ev.data.fd, &ev);
+    w->waiting_for_write = waiting_for_write;
+  }
+
+  return true;
+}
+
+void MasterServer::DispatchWork() {
+  // Chunks are handed out one per worker at a time, so that with little work
+  // left it's spread among the workers. The fastest workers go first, as
+  // they'll be done with the last chunks soonest.
+  std::vector<Worker*> ready;
+  for (auto& entry : workers) {
+    if (!entry.second->id.empty()) {
+      ready.push_back(entry.second.get());
+    }
+  }
+  std::sort(ready.begin(), ready.end(), [](const Worker *a, const Worker *b) {
+      return a->speed > b->speed;
+  });
+
+  bool work_left = true;
+  bool progress = true;
+  while (work_left && progress) {
+    progress = false;
+    for (Worker *w : ready) {
+      if (w->in_flight.size() >= w->window) {
+        continue;
+      }
+
+      std::unique_ptr<WorkChunk> work = g_work_available.TryPop();
+      if (work == nullptr) {
+        work_left = false;
+        break;
+      }
+
+      SendOrder(w, std::move(work), next_chunk_id++);
+      progress = true;
+    }
+  }
+
+  if (!work_left) {
+    SpeculateOnStragglers();
+  }
+
+  std::vector<Worker*> failed;
+  for (auto& entry : workers) {
+    Worker *w = entry.second.get();
+    if (w->writer.IsEmpty()) {
+      continue;
+    }
+
+    if (!Flush(w)) {
+      failed.push_back(w);
+      continue;
+    }
+
+    // The writer might also hold just a CNCL, or a packet from before.
+    if (w->work_queued) {
+      printf("WH:%s: camera and work sent, %zu/%zu chunks in flight\n",
+             w->id.c_str(), w->in_flight.size(), w->window);
+      fflush(stdout);
+      w->work_queued = false;
+    }
+  }
+
+  for (Worker *w : failed) {
+    DropWorker(w);
+  }
+}
+
+void MasterServer::SendOrder(
+    Worker *w, std::unique_ptr<WorkChunk> work, uint32_t id) {
+  std::unique_ptr<netproto::NetworkProto> p(
+      netproto::MasterSetCamera::Make(w->id, &work->camera));
+  w->writer.Queue(p.get());
+  // Compressing the results costs the worker very little time compared to
+  // rendering, so it's used whenever supported.
+  const auto encoding =
+      (w->features & netproto::kFeatureCompressedPixels) ?
+          netproto::PixelEncoding::kDeltaDeflate :
+          netproto::PixelEncoding::kRaw;
+  p.reset(netproto::MasterRenderOrder::Make(w->id, work.get(), id, encoding));
+  w->writer.Queue(p.get());
+  w->work_queued = true;
+  w->in_flight.push_back({
+      id,
+      std::unique_ptr<WorkChunk, WorkReturner>(work.release()),
+      std::chrono::steady_clock::now() });
+  copies[id]++;
+}
+
+void MasterServer::SpeculateOnStragglers() {
+  // Only idle workers get copies, so that they never delay the regular work.
+  std::vector<Worker*> idle;
+  for (auto& entry : workers) {
+    Worker *w = entry.second.get();
+    if (!w->id.empty() && w->in_flight.empty()) {
+      idle.push_back(w);
+    }
+  }
+
+  if (idle.empty() || render_times.size() < MIN_TIME_SAMPLES) {
+    return;
+  }
+
+  // The fastest workers take the copies first. Workers with no render times
+  // yet go last.
+  std::vector<std::pair<double, Worker*>> helpers;
+  for (Worker *w : idle) {
+    const double rate = w->render_times.empty() ?
+        std::numeric_limits<double>::max() :
+        Percentile(w->render_times, 0.5);
+    helpers.emplace_back(rate, w);
+  }
+  std::sort(helpers.begin(), helpers.end());
+
+  const auto now = std::chrono::steady_clock::now();
+  size_t next_helper = 0;
+  for (auto& entry : workers) {
+    Worker *w = entry.second.get();
+    if (w->in_flight.empty()) {
+      continue;
+    }
+
+    // The deadline comes from the worker's own render times, so that a
+    // worker which slows down (e.g. gets throttled) is noticed. Workers which
+    // are always slow have their chunks copied anyway if an idle worker is
+    // expected to do them much sooner.
+    const std::deque<double>& times =
+        w->render_times.size() >= MIN_TIME_SAMPLES ?
+            w->render_times : render_times;
+    const double deadline_rate =
+        Percentile(times, TIME_PERCENTILE) * DEADLINE_SLACK;
+    const double usual_rate = Percentile(times, 0.5);
+
+    // Chunks are rendered in order, so the ones further back in the queue
+    // are due later.
+    const double elapsed = std::chrono::duration<double>(
+        now - std::max(w->in_flight.front().sent, w->last_result_time))
+        .count();
+    double deadline = 0.0;
+    double expected = 0.0;
+    for (const auto& c : w->in_flight) {
+      if (next_helper == helpers.size()) {
+        return;
+      }
+
+      const double pixels = (double)c.work->chunk_width * c.work->chunk_height;
+      deadline += pixels * deadline_rate;
+      expected += pixels * usual_rate;
+      if (copies[c.id] > 1) {
+        continue;
+      }
+
+      Worker *helper = helpers[next_helper].second;
+      const double helper_time = pixels * helpers[next_helper].first;
+      const bool late = elapsed > deadline;
+      const bool helper_faster = helper_time * 2.0 < expected - elapsed;
+      if (!late && !helper_faster) {
+        continue;
+      }
+
+      printf("WH:%s: chunk %u is %s after %.2f s, copying it to %s\n",
+             w->id.c_str(), c.id, late ? "late" : "slow", elapsed,
+             helper->id.c_str());
+      SendOrder(helper, std::make_unique<WorkChunk>(*c.work), c.id);
+      next_helper++;
+    }
+  }
+}
+
+void MasterServer::DropWorker(Worker *w) {
+  const int fd = w->sock->GetDescriptor();
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+
+  // Chunks which other workers have copies of don't go back to the queue.
+  for (auto& c : w->in_flight) {
+    auto it = copies.find(c.id);
+    if (it != copies.end() && it->second > 1) {
+      it->second--;
+      delete c.work.release();
+    } else {
+      copies.erase(c.id);
+    }
+  }
+
+  // Note: This returns the chunks in flight to the queue.
+  workers.erase(fd);
+
+  // The average speed has changed.
+  UpdateWindows();
 }
 
-// TODO(gynvael): Add scene support.
 size_t GenerateWork(const MythTracer&, const Camera& cam,
+                    const RenderSettings& settings,
+                    const ChunkPolicy& policy,
                     int width, int height) {
-  std::lock_guard<std::mutex> lock(g_work_available_guard);
-  // TODO(gynvael): Add an assert that .empty() is true.
-  g_work_available.clear();
+  const CostMap costs = g_work_available.GetCostMap();
+  const std::vector<ChunkPolicy::Rect> rects =
+      policy.Split(width, height, costs);
 
-  size_t total_chunk_count = 0;
-  for (int j = 0; j < height; j += CHUNK_H) {
-    for (int i = 0; i < width; i += CHUNK_W, total_chunk_count++) {
-      int chunk_width = std::min(CHUNK_W, width - i);
-      int chunk_height = std::min(CHUNK_H, height - j);      
+  std::vector<std::unique_ptr<WorkChunk>> chunks;
+  int min_size = std::max(width, height);
+  int max_size = 0;
+  for (const auto& rect : rects) {
+    auto work = std::make_unique<WorkChunk>();
+    work->image_width = width;
+    work->image_height = height;
+    work->chunk_x = rect.x;
+    work->chunk_y = rect.y;
+    work->chunk_width = rect.width;
+    work->chunk_height = rect.height;
+    work->camera = cam;
+    work->settings = settings;
+    chunks.push_back(std::move(work));
 
-      auto work = std::make_unique<WorkChunk>();
-      work->image_width = width;
-      work->image_height = height;
-      work->chunk_x = i;
-      work->chunk_y = j;
-      work->chunk_width = chunk_width;
-      work->chunk_height = chunk_height;
-      work->camera = cam;
+    const int size = std::max(rect.width, rect.height);
+    min_size = std::min(min_size, size);
+    max_size = std::max(max_size, size);
+  }
 
-      g_work_available.push_back(std::move(work));
-    }
+  printf("Chunks (%s): %zu, %d to %d pixels wide", policy.GetName(),
+         rects.size(), min_size, max_size);
+  if (costs.IsComplete(width, height) && !rects.empty()) {
+    printf(", %.1f ms each on average",
+           costs.Estimate(0, 0, width, height) * 1000.0 / rects.size());
   }
+  putchar('\n');
 
-  return total_chunk_count;
+  // TODO(gynvael): Add an assert that the queue was empty.
+  g_work_available.Reset(std::move(chunks));
+  NotifyWorkAvailable();
+  return rects.size();
 }
 
-void BlitWorkChunk(std::vector<uint8_t> *bitmap, WorkChunk *work) {
-  auto src_bitmap = work->output_bitmap;
+template<typename T>
+void BlitPixels(std::vector<T> *frame, const std::vector<T>& src,
+                WorkChunk *work) {
+  // Chunk rows are contiguous in the frame, so each is a single copy.
+  const size_t row_size = (size_t)work->chunk_width * 3;
+  if (src.size() < row_size * work->chunk_height ||
+      work->chunk_x + work->chunk_width > work->image_width ||
+      work->chunk_y + work->chunk_height > work->image_height ||
+      frame->size() < (size_t)work->image_width * work->image_height * 3) {
+    return;
+  }
 
   for (int j = 0; j < work->chunk_height; j++) {
-    for (int i = 0; i < work->chunk_width; i++) {
-      const size_t dst_idx =
-        ((j + work->chunk_y) * work->image_width + (i + work->chunk_x)) * 3;
-      const size_t src_idx = (j * work->chunk_width + i) * 3;
-      for (int k = 0; k < 3; k++) {
-        bitmap->at(dst_idx + k) = src_bitmap.at(src_idx + k);
+    const size_t dst_idx =
+      ((size_t)(j + work->chunk_y) * work->image_width + work->chunk_x) * 3;
+    std::copy_n(&src[j * row_size], row_size, &(*frame)[dst_idx]);
+  }
+}
+
+// Float chunks go to the HDR frame, which is tone mapped only when dumped.
+void BlitWorkChunk(std::vector<uint8_t> *bitmap, std::vector<float> *hdr,
+                   WorkChunk *work) {
+  if (work->settings.output_format == PixelFormat::kRGB8) {
+    BlitPixels(bitmap, work->output_bitmap, work);
+  } else {
+    BlitPixels(hdr, work->output_hdr, work);
+  }
+}
+
+void WriteFrame(const char *fname, const void *data, size_t size) {
+  FILE *f = fopen(fname, "wb");
+  if (f == nullptr) {
+    fprintf(stderr, "error: failed to open \"%s\" for writing\n", fname);
+    return;
+  }
+  fwrite(data, size, 1, f);
+  fclose(f);
+}
+
+const char kOutputOptionsUsage[] =
+    "  --format=rgb8|f32|f16     pixel format sent by the workers (default:\n"
+    "                            rgb8); float frames are tone mapped by the\n"
+    "                            master and also dumped as *.f32 files\n"
+    "  --tonemap=clamp|reinhard  tone mapping operator used for float frames\n"
+    "                            (default: clamp)\n"
+    "  --exposure=N              exposure used for float frames (default: 1)";
+
+// Parses the output options (see kOutputOptionsUsage) and removes them from
+// argv, leaving only the other arguments. Returns false on an unknown option
+// or a bad value.
+bool ParseOutputOptions(int *argc, char **argv,
+                        PixelFormat *format, ToneMapSettings *tone_map) {
+  int kept = 1;
+  for (int i = 1; i < *argc; i++) {
+    const char *arg = argv[i];
+    if (strncmp(arg, "--", 2) != 0) {
+      argv[kept++] = argv[i];
+      continue;
+    }
+
+    if (strcmp(arg, "--format=rgb8") == 0) {
+      *format = PixelFormat::kRGB8;
+    } else if (strcmp(arg, "--format=f32") == 0) {
+      *format = PixelFormat::kRGBF32;
+    } else if (strcmp(arg, "--format=f16") == 0) {
+      *format = PixelFormat::kRGBF16;
+    } else if (strcmp(arg, "--tonemap=clamp") == 0) {
+      tone_map->op = ToneMapSettings::Operator::kClamp;
+    } else if (strcmp(arg, "--tonemap=reinhard") == 0) {
+      tone_map->op = ToneMapSettings::Operator::kReinhard;
+    } else if (strncmp(arg, "--exposure=", 11) == 0) {
+      char *end;
+      tone_map->exposure = strtof(arg + 11, &end);
+      if (end == arg + 11 || *end != '\0' ||
+          !(tone_map->exposure > 0.0f && std::isfinite(tone_map->exposure))) {
+        return false;
       }
+    } else {
+      return false;
     }
   }
+
+  *argc = kept;
+  argv[kept] = nullptr;
+  return true;
 }
 
 
-int main(void) {
+int main(int argc, char **argv) {
+  PixelFormat output_format = PixelFormat::kRGB8;
+  ToneMapSettings tone_map;
+  const bool options_ok =
+      ParseOutputOptions(&argc, argv, &output_format, &tone_map);
+
+  std::unique_ptr<ChunkPolicy> chunk_policy;
+  if (argc <= 3 && (argc < 3 || strcmp(argv[2], "adaptive") == 0)) {
+    chunk_policy = std::make_unique<AdaptiveChunkPolicy>();
+  } else if (argc == 3 && strcmp(argv[2], "fixed") == 0) {
+    chunk_policy = std::make_unique<FixedChunkPolicy>();
+  }
+
+  if (!options_ok || chunk_policy == nullptr) {
+    printf("usage: mythtracer_master [options] "
+           "[chunks_in_flight [chunk_policy]]\n"
+           "note : chunks_in_flight is the number of work chunks sent to an\n"
+           "       average worker ahead of time (default: 3); faster workers\n"
+           "       get more, slower ones fewer\n"
+           "       chunk_policy is either adaptive (chunks sized by the\n"
+           "       render time of the previous frame; default) or fixed\n"
+           "options:\n%s\n", kOutputOptionsUsage);
+    return 1;
+  }
+
+  size_t chunks_in_flight = DEFAULT_CHUNKS_IN_FLIGHT;
+  if (argc >= 2) {
+    chunks_in_flight = (size_t)std::max(atoi(argv[1]), 1);
+  }
+
   puts("Creating /anim directory");
-#ifdef __unix__
   mkdir("anim", 0700);
-#else
-  _mkdir("anim");
-#endif
 
   puts("Loading scene...");
   MythTracer mt;
+
+  // The master doesn't render, so there is no point in decoding textures.
+  mt.GetScene()->texture_options.lazy = true;
   if (!mt.LoadObj("../Models/Living Room USSU Design.obj")) {
     return 1;
   }
@@ -284,6 +1333,23 @@ int main(void) {
           { 0.3, 0.3, 0.3 }
   });
 
+  // The workers get the scene from the master (unless they have it cached
+  // already), so it's serialized and compressed only once, up front.
+  netproto::MasterScene::PackedScene packed_scene;
+  {
+    std::vector<uint8_t> scene_bytes;
+    if (!mt.GetScene()->Serialize(&scene_bytes) ||
+        !netproto::MasterScene::Pack(scene_bytes, &packed_scene)) {
+      puts("error: failed to serialize the scene");
+      return 1;
+    }
+
+    printf("Scene: %.1f MB, %.1f MB compressed, hash %016llx\n",
+           (double)packed_scene.size / (1024.0 * 1024.0),
+           (double)packed_scene.data.size() / (1024.0 * 1024.0),
+           (unsigned long long)packed_scene.hash);
+  }
+
   printf("Resolution: %u %u\n", W, H);
 
   // Really good camera setting.
@@ -293,7 +1359,16 @@ int main(void) {
      110.0
   };
 
+  // Quality vs speed trade-offs applied to all the work chunks.
+  RenderSettings settings;
+  settings.output_format = output_format;
+
   std::vector<uint8_t> bitmap(W * H * 3);
+  std::vector<float> hdr_bitmap;
+  const bool hdr = settings.output_format != PixelFormat::kRGB8;
+  if (hdr) {
+    hdr_bitmap.resize(W * H * 3);
+  }
 
   puts("Starting server...");
   NetSock::InitNetworking();
@@ -305,39 +1380,58 @@ int main(void) {
     return 1;
   }
 
-  std::thread connection_thread(ConnectionHandler, server.release());
+#ifdef __unix__
+  // Disconnected workers are detected by failing writes instead.
+  signal(SIGPIPE, SIG_IGN);
+#endif
 
+  MasterServer master_server(
+      server.release(), chunks_in_flight, &packed_scene);
+  if (!master_server.Init()) {
+    return 1;
+  }
+  g_server = &master_server;
+
+  printf("Chunks in flight per average worker: %zu\n", chunks_in_flight);
+  std::thread server_thread(&MasterServer::Run, &master_server);
+
+  const auto kDumpInterval = 2s;
   size_t total_work_chunks = 0;
   size_t completed_work_chunks = 0;
   int frame = 0;
-  time_t last_dump = time(nullptr);
+  auto last_dump = std::chrono::steady_clock::now();
   for (;;) {
     // Check if work for the frame needs to be generated.
     if (total_work_chunks == 0) {
       puts("Generating new work..."); fflush(stdout);
       completed_work_chunks = 0;      
-      total_work_chunks = GenerateWork(mt, cam, W, H);
+      total_work_chunks =
+          GenerateWork(mt, cam, settings, *chunk_policy, W, H);
     }
 
-    // Check if any new work items finished.
+    // Wait until some work items finish, or it's time to dump the frame.
+    std::list<unique_ptr<ReadyWorkChunk>> finished;
     {
-      std::lock_guard<std::mutex> lock(g_work_finished_guard);
-      if (!g_work_finished.empty()) {
-        // Apply work chunks to the bitmap.
-        for (const auto& ready : g_work_finished) {
-          BlitWorkChunk(&bitmap, ready->work.get());
-        }
+      std::unique_lock<std::mutex> lock(g_work_finished_guard);
+      g_work_finished_cv.wait_until(lock, last_dump + kDumpInterval, [] {
+          return !g_work_finished.empty();
+      });
+      finished.swap(g_work_finished);
+    }
 
-        g_work_finished.clear();
-      }
+    // Apply work chunks to the bitmap.
+    for (const auto& ready : finished) {
+      BlitWorkChunk(&bitmap, &hdr_bitmap, ready->work.get());
+      completed_work_chunks++;
     }
 
     // Perhaps dump the current frame.
-    if (time(nullptr) > last_dump + 2) {
-      FILE *f = fopen("anim/frame_dump.raw", "wb");
-      fwrite(&bitmap[0], bitmap.size(), 1, f);
-      fclose(f);
-      last_dump = time(nullptr);
+    if (std::chrono::steady_clock::now() >= last_dump + kDumpInterval) {
+      if (hdr) {
+        ToneMap(&hdr_bitmap[0], W * H, tone_map, &bitmap[0]);
+      }
+      WriteFrame("anim/frame_dump.raw", &bitmap[0], bitmap.size());
+      last_dump = std::chrono::steady_clock::now();
       puts("Saved frame to disk.");
     }
 
@@ -345,24 +1439,31 @@ int main(void) {
     if (total_work_chunks == completed_work_chunks) {
       puts("Writing frame...");
       char fname[256];
+      if (hdr) {
+        ToneMap(&hdr_bitmap[0], W * H, tone_map, &bitmap[0]);
+        sprintf(fname, "anim/dump_%.5i.f32", frame);
+        WriteFrame(fname, &hdr_bitmap[0], hdr_bitmap.size() * sizeof(float));
+      }
+
       sprintf(fname, "anim/dump_%.5i.raw", frame);
+      WriteFrame(fname, &bitmap[0], bitmap.size());
 
-      FILE *f = fopen(fname, "wb");
-      fwrite(&bitmap[0], bitmap.size(), 1, f);
-      fclose(f);
+      // With uniform chunk times the max is close to the average.
+      const WorkQueue::CostStats stats = g_work_available.TakeCostStats();
+      if (stats.count != 0) {
+        printf("Chunk times: min %.1f ms, avg %.1f ms, max %.1f ms\n",
+               stats.min * 1000.0, stats.sum * 1000.0 / stats.count,
+               stats.max * 1000.0);
+      }
 
       // Reset stuff.
       memset(&bitmap[0], 0, bitmap.size());
+      std::fill(hdr_bitmap.begin(), hdr_bitmap.end(), 0.0f);
       total_work_chunks = 0;
 
       // TODO(gynvael): Iterate frame.
       frame++;
-
-      continue;  // Don't sleep.
     }
-
-    // Sleep.
-    std::this_thread::sleep_for(100ms);
   }
   
   puts("Done");
@@ -4,19 +4,375 @@
 #ifdef __unix__
 #  include <sys/stat.h>
 #  include <sys/types.h>
+#  include <sys/socket.h>
+#  include <unistd.h>
 #else
 #  include <direct.h>
 #endif
+#include <chrono>
+#include <filesystem>
 #include <thread>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <string>
 #include "mythtracer.h"
 #include "camera.h"
 #include "octtree.h"
+#include "primitive_triangle.h"
 #include "network.h"
 
 using math3d::V3D;
 using namespace raytracer;
 
+// A work chunk to render and how the master wants the result encoded.
+struct RenderOrder {
+  std::unique_ptr<WorkChunk> work;
+  uint32_t chunk_id = 0;  // Assigned by the master.
+  netproto::PixelEncoding result_encoding = netproto::PixelEncoding::kRaw;
+};
+
+// Work chunks received from the master, waiting to be rendered.
+class WorkQueue {
+ public:
+  void Push(RenderOrder order) {
+    std::lock_guard<std::mutex> lock(m);
+    orders.push_back(std::move(order));
+    cv.notify_one();
+  }
+
+  // Returns an order without work once the queue is closed and empty.
+  RenderOrder Pop() {
+    std::unique_lock<std::mutex> lock(m);
+    cv.wait(lock, [this] { return closed || !orders.empty(); });
+    if (orders.empty()) {
+      return RenderOrder{};
+    }
+
+    RenderOrder order = std::move(orders.front());
+    orders.pop_front();
+    return order;
+  }
+
+  // Removes the order, unless it's being rendered already (or it's done).
+  // Returns whether it was still queued.
+  bool Cancel(uint32_t chunk_id) {
+    std::lock_guard<std::mutex> lock(m);
+    for (auto it = orders.begin(); it != orders.end(); ++it) {
+      if (it->chunk_id == chunk_id) {
+        orders.erase(it);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(m);
+    closed = true;
+    cv.notify_one();
+  }
+
+ private:
+  std::mutex m;
+  std::condition_variable cv;
+  std::deque<RenderOrder> orders;
+  bool closed = false;
+};
+
+// Scenes received from the master, stored on disk by their hash (see
+// netproto::MasterScene) so that they aren't downloaded again after
+// reconnecting or restarting the worker.
+class SceneCache {
+ public:
+  explicit SceneCache(const std::string& directory) : directory(directory) {
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+  }
+
+  std::vector<uint64_t> List() const {
+    std::vector<uint64_t> hashes;
+    std::error_code ec;
+    for (const auto& entry :
+         std::filesystem::directory_iterator(directory, ec)) {
+      const std::string name = entry.path().filename().string();
+      unsigned long long hash;
+      if (sscanf(name.c_str(), "%16llx", &hash) == 1 &&
+          name == GetFileName(hash)) {
+        hashes.push_back(hash);
+      }
+    }
+    return hashes;
+  }
+
+  // Returns false if the scene isn't there or doesn't match the hash.
+  bool Load(uint64_t hash, std::vector<uint8_t> *scene) const {
+    FILE *f = fopen(GetPath(hash).c_str(), "rb");
+    if (f == nullptr) {
+      return false;
+    }
+
+    scene->clear();
+    uint8_t buffer[65536];
+    size_t sz;
+    while ((sz = fread(buffer, 1, sizeof(buffer), f)) != 0) {
+      scene->insert(scene->end(), buffer, buffer + sz);
+    }
+    fclose(f);
+
+    return netproto::MasterScene::Hash(*scene) == hash;
+  }
+
+  void Store(uint64_t hash, const std::vector<uint8_t>& scene) const {
+    // Written under a temporary name, so that a partially written file is
+    // never picked up.
+    const std::string path = GetPath(hash);
+    const std::string temp_path = path + ".tmp";
+    FILE *f = fopen(temp_path.c_str(), "wb");
+    if (f == nullptr) {
+      fprintf(stderr, "warning: cannot write \"%s\"\n", temp_path.c_str());
+      return;
+    }
+
+    const bool ok = fwrite(scene.data(), 1, scene.size(), f) == scene.size();
+    if (fclose(f) != 0 || !ok) {
+      fprintf(stderr, "warning: cannot write \"%s\"\n", temp_path.c_str());
+      remove(temp_path.c_str());
+      return;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp_path, path, ec);
+  }
+
+  void Remove(uint64_t hash) const {
+    remove(GetPath(hash).c_str());
+  }
+
+ private:
+  static std::string GetFileName(uint64_t hash) {
+    char name[32];
+    sprintf(name, "%016llx.scne", (unsigned long long)hash);
+    return name;
+  }
+
+  std::string GetPath(uint64_t hash) const {
+    return directory + "/" + GetFileName(hash);
+  }
+
+  std::string directory;
+};
+
+// Sets *mt up with the scene sent by the master, unless it's the scene which
+// is already loaded.
+bool LoadScene(const netproto::MasterScene& packet, SceneCache *cache,
+               std::unique_ptr<MythTracer> *mt, uint64_t *loaded_hash) {
+  const auto start = std::chrono::steady_clock::now();
+  uint64_t hash;
+  std::vector<uint8_t> scene;
+  if (!packet.Unpack(&hash, &scene)) {
+    printf("error: received a broken scene\n");
+    return false;
+  }
+
+  if (*mt != nullptr && *loaded_hash == hash) {
+    printf("Scene %016llx is already loaded.\n", (unsigned long long)hash);
+    return true;
+  }
+
+  if (scene.empty()) {
+    if (!cache->Load(hash, &scene)) {
+      // Next time the master will be told the scene isn't cached.
+      printf("error: cached scene %016llx is missing or broken\n",
+             (unsigned long long)hash);
+      cache->Remove(hash);
+      return false;
+    }
+    printf("Loading scene %016llx from the cache.\n",
+           (unsigned long long)hash);
+  } else {
+    printf("Received scene %016llx (%.1f MB).\n", (unsigned long long)hash,
+           (double)scene.size() / (1024.0 * 1024.0));
+    cache->Store(hash, scene);
+  }
+
+  // Textures are decoded only once they're needed, and the texture cache
+  // keeps the worker's memory use bounded.
+  auto fresh = std::make_unique<MythTracer>();
+  fresh->GetScene()->texture_options.lazy = true;
+  if (!fresh->GetScene()->Deserialize(scene)) {
+    printf("error: failed to deserialize scene %016llx\n",
+           (unsigned long long)hash);
+    cache->Remove(hash);
+    return false;
+  }
+
+  *mt = std::move(fresh);
+  *loaded_hash = hash;
+
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  printf("Scene loaded in %.2f s.\n", seconds);
+  return true;
+}
+
+// Casts rays at a small bumpy terrain on all cores. Returns millions of rays
+// per second, i.e. roughly how fast this machine renders compared to others.
+float RunBenchmark() {
+  OctTree tree;
+  const int kGrid = 32;
+  const auto vertex = [](int x, int z) {
+    return V3D{ (V3D::basetype)x, (V3D::basetype)((x * 7 + z * 13) % 5),
+                (V3D::basetype)z };
+  };
+
+  for (int z = 0; z < kGrid; z++) {
+    for (int x = 0; x < kGrid; x++) {
+      Triangle *a = new Triangle();
+      a->vertex[0] = vertex(x, z);
+      a->vertex[1] = vertex(x + 1, z);
+      a->vertex[2] = vertex(x, z + 1);
+      a->CacheAABB();
+      tree.AddPrimitive(a);
+
+      Triangle *b = new Triangle();
+      b->vertex[0] = vertex(x + 1, z);
+      b->vertex[1] = vertex(x + 1, z + 1);
+      b->vertex[2] = vertex(x, z + 1);
+      b->CacheAABB();
+      tree.AddPrimitive(b);
+    }
+  }
+  tree.Finalize();
+
+  // Batches are cast until enough time passes, so that the benchmark takes
+  // about as long on slow and fast machines.
+  const int kBatch = 4096;
+  const double kMinSeconds = 0.25;
+  const V3D origin{ kGrid / 2.0, 20.0, kGrid / 2.0 };
+  int rays = 0;
+  int hits = 0;
+  double seconds = 0.0;
+  const auto start = std::chrono::steady_clock::now();
+  do {
+    #pragma omp parallel for reduction(+:hits) schedule(static)
+    for (int i = rays; i < rays + kBatch; i++) {
+      const V3D target{ (i % 1021) * (kGrid / 1021.0), 0.0,
+                        (i % 1019) * (kGrid / 1019.0) };
+      Ray ray(origin, (target - origin).DupNorm());
+      V3D point;
+      V3D::basetype distance;
+      if (tree.IntersectRay(ray, &point, &distance) != nullptr) {
+        hits++;
+      }
+    }
+
+    rays += kBatch;
+    seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+  } while (seconds < kMinSeconds && rays < (1 << 30));
+
+  if (hits == 0) {
+    return 0.0f;  // Something is off, so better not to claim anything.
+  }
+  return (float)(rays / seconds / 1e6);
+}
+
+netproto::WorkerCapabilities GetCapabilities() {
+  netproto::WorkerCapabilities caps;
+  caps.cores = std::thread::hardware_concurrency();
+#ifdef __unix__
+  const long pages = sysconf(_SC_PHYS_PAGES);
+  const long page_size = sysconf(_SC_PAGE_SIZE);
+  if (pages > 0 && page_size > 0) {
+    caps.memory = (uint64_t)pages * (uint64_t)page_size;
+  }
+#elif defined(_WIN32)
+  // Note: windows.h comes with NetSock.h.
+  MEMORYSTATUSEX status;
+  status.dwLength = sizeof(status);
+  if (GlobalMemoryStatusEx(&status)) {
+    caps.memory = status.ullTotalPhys;
+  }
+#endif
+  caps.benchmark_score = RunBenchmark();
+  return caps;
+}
+
+void ShutdownSocket(NetSock *s) {
+#ifdef _WIN32
+  shutdown(s->GetDescriptor(), SD_BOTH);
+#else
+  shutdown(s->GetDescriptor(), SHUT_RDWR);
+#endif
+}
+
+// Receives packets until the master disconnects or sends something invalid.
+void ReceiveWork(NetSock *s, WorkQueue *queue) {
+  Camera cam;
+  for (;;) {
+    std::unique_ptr<netproto::NetworkProto> p(netproto::ReceivePacket(
+          s, netproto::kCommunicationSide::kWorker));
+    if (p == nullptr) {
+      printf("error: invalid proto or disconnected\n");
+      fflush(stdout);
+      break;
+    }
+
+    if (p->GetTag() == "CAMR") {
+      if (!cam.Deserialize(p->bytes)) {
+        printf("error: failed to deserialize camera\n");
+        fflush(stdout);
+        break;
+      }
+
+      printf("Received new camera settings:\n"
+             "Position      : %f %f %f\n"
+             "Pitch/yaw/roll: %f, %f, %f\n"
+             "Angle of view : %f deg\n",
+             cam.origin.v[0], cam.origin.v[1], cam.origin.v[2],
+             cam.pitch, cam.yaw, cam.roll,
+             cam.aov);
+      fflush(stdout);
+      continue;
+    }
+
+    if (p->GetTag() == "WORK") {
+      RenderOrder order;
+      order.work = std::make_unique<WorkChunk>();
+      if (!static_cast<netproto::MasterRenderOrder*>(p.get())->Parse(
+              order.work.get(), &order.chunk_id, &order.result_encoding)) {
+        printf("error: failed to deserialize work chunk\n");
+        fflush(stdout);
+        break;
+      }
+
+      order.work->camera = cam;
+      queue->Push(std::move(order));
+      continue;
+    }
+
+    if (p->GetTag() == "CNCL") {
+      uint32_t chunk_id;
+      if (!static_cast<netproto::MasterCancelOrder*>(p.get())->Parse(
+              &chunk_id)) {
+        printf("error: failed to deserialize cancel order\n");
+        fflush(stdout);
+        break;
+      }
+
+      // Chunks which are being rendered already are just finished, as the
+      // renderer can't be interrupted.
+      printf("Chunk %u cancelled by the master (%s).\n", chunk_id,
+             queue->Cancel(chunk_id) ? "dropped" : "already started");
+      fflush(stdout);
+    }
+  }
+
+  queue->Close();
+}
+
 
 int main(int argc, char **argv) {
   if (argc != 3) {
@@ -26,49 +382,23 @@ int main(int argc, char **argv) {
   }
 
 
-  MythTracer mt;
-  if (!mt.LoadObj("../Models/Living Room USSU Design.obj")) {
-    return 1;
-  }
-
-  mt.GetScene()->lights.clear();
-  mt.GetScene()->lights.push_back(
-      Light{
-          { 231.82174, 81.69966, -27.78259 },
-          { 0.3, 0.3, 0.3 },
-          { 1.0, 1.0, 1.0 },
-          { 1.0, 1.0, 1.0 }
-  });
-
-  mt.GetScene()->lights.push_back(
-      Light{
-          { 200, 80.0, 0 },
-          { 0.0, 0.0, 0.0 },
-          { 0.3, 0.3, 0.3 },
-          { 0.3, 0.3, 0.3 }
-  });
-
-  mt.GetScene()->lights.push_back(
-      Light{
-          { 200, 80.0, 80 },
-          { 0.0, 0.0, 0.0 },
-          { 0.3, 0.3, 0.3 },
-          { 0.3, 0.3, 0.3 }
-  });
-
-  mt.GetScene()->lights.push_back(
-      Light{
-          { 200, 80.0, 160 },
-          { 0.0, 0.0, 0.0 },
-          { 0.3, 0.3, 0.3 },
-          { 0.3, 0.3, 0.3 }
-  });
+  // The scene is sent by the master after connecting.
+  SceneCache scene_cache("scene_cache");
+  std::unique_ptr<MythTracer> mt;
+  uint64_t scene_hash = 0;
 
   NetSock::InitNetworking();
 
   std::string id(argv[1]);
   printf("Name of this worker: %s\n", id.c_str());
 
+  // Told to the master, so that it can queue up more work for faster
+  // workers right away.
+  const netproto::WorkerCapabilities caps = GetCapabilities();
+  printf("Cores: %u, memory: %.1f GB, benchmark score: %.2f\n",
+         caps.cores, (double)caps.memory / (1024.0 * 1024.0 * 1024.0),
+         caps.benchmark_score);
+
   for (;;) {
     puts("Connecting...");
 
@@ -82,10 +412,15 @@ int main(int argc, char **argv) {
     }
 
     puts("Connected!");
+
+    // Each packet is sent with a single system call anyway, and delaying the
+    // results only makes the master wait.
+    s->SetNoDelay(true);
     std::unique_ptr<netproto::NetworkProto> p;
 
     // Introduce to the server.
-    p.reset(netproto::WorkerReady::Make(id));
+    p.reset(netproto::WorkerReady::Make(
+        id, netproto::kFeatureCompressedPixels, caps, scene_cache.List()));
     if (!netproto::SendPacket(s.get(), p.get())) {
       printf("error: disconnected when sending RDY!\n");
       fflush(stdout);
@@ -93,78 +428,93 @@ int main(int argc, char **argv) {
       continue;
     }
 
-    // Wait for work.
-    Camera cam;
+    // The master always starts with the scene.
+    p.reset(netproto::ReceivePacket(
+        s.get(), netproto::kCommunicationSide::kWorker));
+    if (p == nullptr || p->GetTag() != "SCNE" ||
+        !LoadScene(*static_cast<netproto::MasterScene*>(p.get()),
+                   &scene_cache, &mt, &scene_hash)) {
+      printf("error: failed to receive the scene\n");
+      fflush(stdout);
+      std::this_thread::sleep_for(2s);
+      continue;
+    }
+    p.reset();
+
+    // Packets are received on a separate thread, so that the master can
+    // queue up the next work chunks while the current one is rendered.
+    WorkQueue queue;
+    std::thread receiver(ReceiveWork, s.get(), &queue);
+
     for (;;) {
-      p.reset(netproto::ReceivePacket(
-            s.get(), netproto::kCommunicationSide::kWorker));
+      RenderOrder order = queue.Pop();
+      std::unique_ptr<WorkChunk> work = std::move(order.work);
+      if (work == nullptr) {
+        break;
+      }
+
+      size_t sz = work->chunk_width * work->chunk_height;
+      printf("Received work:\n"
+             "Final resolution : %i x %i (%s)\n"
+             "Chunk position   : %i, %i\n"
+             "Chunk size       : %i x %i\n"
+             "Initial ray count: %i rays\n"
+             "Max recursion    : %u\n"
+             "Ray budget/sample: %llu\n",
+             work->image_width, work->image_height,
+             work->settings.output_format == PixelFormat::kRGB8 ?
+                 "24bpp" : "float",
+             work->chunk_x, work->chunk_y,
+             work->chunk_width, work->chunk_height,
+             (int)sz,
+             work->settings.max_recursion_level,
+             (unsigned long long)work->settings.ray_budget_per_sample);
+
+      printf("Rendering"); fflush(stdout);
+      const auto render_start = std::chrono::steady_clock::now();
+      if (!mt->RayTrace(work.get())) {
+        printf("error: failed while raytracing (weird); exiting\n");
+        fflush(stdout);
+        exit(1);
+      }
+
+      puts("Done! Sending chunk to master.");
+      const auto encode_start = std::chrono::steady_clock::now();
+      const float render_time =
+          std::chrono::duration<float>(encode_start - render_start).count();
+      size_t raw_size = 0;
+      p.reset(netproto::WorkerRenderResult::Make(
+          id, work.get(), order.chunk_id, render_time, order.result_encoding,
+          &raw_size));
       if (p == nullptr) {
-        printf("error: invalid proto or disconnected\n");
+        printf("error: failed to encode the result\n");
         fflush(stdout);
-        std::this_thread::sleep_for(2s);      
         break;
       }
 
-      if (p->GetTag() == "CAMR") {
-        if (!cam.Deserialize(p->bytes)) {
-          printf("error: failed to deserialize camera\n");
-          fflush(stdout);
-          std::this_thread::sleep_for(2s);      
-          break;
-        }
-
-        printf("Received new camera settings:\n"
-               "Position      : %f %f %f\n"
-               "Pitch/yaw/roll: %f, %f, %f\n"
-               "Angle of view : %f deg\n",
-               cam.origin.v[0], cam.origin.v[1], cam.origin.v[2],
-               cam.pitch, cam.yaw, cam.roll,
-               cam.aov);
-        fflush(stdout);
-        continue;
+      if (order.result_encoding != netproto::PixelEncoding::kRaw) {
+        const double encode_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - encode_start).count();
+        printf("Compressed PXLS: %zu -> %zu bytes (%.1f%%) in %.2f ms\n",
+               raw_size, p->bytes.size(),
+               raw_size != 0 ? 100.0 * p->bytes.size() / raw_size : 0.0,
+               encode_ms);
       }
 
-      if (p->GetTag() == "WORK") {
-        WorkChunk work;
-        if (!work.DeserializeInput(p->bytes)) {
-          printf("error: failed to deserialize work chunk\n");
-          fflush(stdout);
-          std::this_thread::sleep_for(2s);
-          break;
-        }
-
-        size_t sz = work.chunk_width * work.chunk_height;
-        printf("Received work:\n"
-               "Final resolution : %i x %i (24bpp)\n"
-               "Chunk position   : %i, %i\n"
-               "Chunk size       : %i x %i\n"
-               "Initial ray count: %i rays\n",
-               work.image_width, work.image_height,
-               work.chunk_x, work.chunk_y,
-               work.chunk_width, work.chunk_height,
-               (int)sz);
-
-        printf("Rendering"); fflush(stdout);
-        work.output_bitmap.resize(sz * 3);
-        work.camera = cam;
-        if (!mt.RayTrace(&work)) {
-          printf("error: failed while raytracing (weird); exiting\n");
-          fflush(stdout);
-          exit(1);
-        }
-
-        puts("Done! Sending chunk to master.");
-        p.reset(netproto::WorkerRenderResult::Make(id, &work));
-        if (!netproto::SendPacket(s.get(), p.get())) {
-          printf("error: disconnected when sending PXLS\n");
-          fflush(stdout);
-          std::this_thread::sleep_for(2s);      
-          break;
-        }
-
-        printf("Sent! %i points to %s!\n", (int)sz, id.c_str());
+      if (!netproto::SendPacket(s.get(), p.get())) {
+        printf("error: disconnected when sending PXLS\n");
+        fflush(stdout);
+        break;
       }
+
+      printf("Sent! %i points to %s!\n", (int)sz, id.c_str());
     }
+
+    // Either the master disconnected, or sending failed and the receiver
+    // needs to be woken up.
+    ShutdownSocket(s.get());
+    receiver.join();
+    std::this_thread::sleep_for(2s);
   }
 
   return 0;
@@ -0,0 +1,227 @@
+// Interactive preview. Renders progressively into an SDL window and restarts
+// the render whenever the camera is moved.
+//
+// Controls:
+//   W/S/A/D - move forward/back/left/right
+//   Q/E     - move down/up
+//   Arrows  - rotate the camera
+//   Esc     - quit
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <SDL2/SDL.h>
+#include "mythtracer.h"
+#include "camera.h"
+
+using math3d::V3D;
+using math3d::M4D;
+using raytracer::MythTracer;
+using raytracer::Camera;
+using raytracer::Light;
+using raytracer::RenderSettings;
+const int W = 1920/4;  // 960 480
+const int H = 1080/4;  // 540 270
+
+const V3D::basetype kMoveStep = 10.0;
+const V3D::basetype kRotateStep = 5.0;
+
+// Shared between the UI thread and the render thread.
+struct PreviewState {
+  std::mutex m;
+  std::condition_variable cv;
+
+  Camera camera;
+  uint64_t camera_version = 0;  // Incremented on each camera change.
+  bool quit = false;
+
+  // Latest finished pass (copied from the render thread).
+  std::vector<uint8_t> frame;
+  bool frame_updated = false;
+  int frame_pass = 0;
+
+  std::atomic<bool> cancel{false};
+};
+
+static void RenderThread(MythTracer *mt, PreviewState *state) {
+  std::vector<uint8_t> bitmap;
+
+  // Consecutive frames differ only by the camera position, so the lighting of
+  // most pixels can be carried over from the previous frame.
+  RenderSettings settings;
+  settings.temporal_reprojection = true;
+  uint64_t rendered_version = (uint64_t)-1;
+
+  for (;;) {
+    Camera cam;
+    {
+      std::unique_lock<std::mutex> lock(state->m);
+      state->cv.wait(lock, [&] {
+          return state->quit || state->camera_version != rendered_version;
+      });
+
+      if (state->quit) {
+        return;
+      }
+
+      cam = state->camera;
+      rendered_version = state->camera_version;
+
+      // Note: The UI thread sets the cancel flag while holding the lock, so
+      // a camera change can't be missed.
+      state->cancel = false;
+    }
+
+    mt->RayTraceProgressive(
+        W, H, &cam, &bitmap,
+        [&](int pass) {
+          std::lock_guard<std::mutex> lock(state->m);
+          state->frame = bitmap;
+          state->frame_updated = true;
+          state->frame_pass = pass;
+        },
+        &state->cancel, settings);
+  }
+}
+
+// Returns true if the camera was changed.
+static bool HandleKey(SDL_Keycode key, Camera *cam) {
+  V3D forward = cam->GetDirection();
+  V3D right = M4D::RotationYDeg(cam->yaw + 90.0) * V3D{0.0, 0.0, 1.0};
+
+  switch (key) {
+    case SDLK_w: cam->origin = cam->origin + forward * kMoveStep; break;
+    case SDLK_s: cam->origin = cam->origin - forward * kMoveStep; break;
+    case SDLK_d: cam->origin = cam->origin + right * kMoveStep; break;
+    case SDLK_a: cam->origin = cam->origin - right * kMoveStep; break;
+    case SDLK_e: cam->origin.v[1] += kMoveStep; break;
+    case SDLK_q: cam->origin.v[1] -= kMoveStep; break;
+    case SDLK_LEFT: cam->yaw -= kRotateStep; break;
+    case SDLK_RIGHT: cam->yaw += kRotateStep; break;
+    case SDLK_UP: cam->pitch -= kRotateStep; break;
+    case SDLK_DOWN: cam->pitch += kRotateStep; break;
+    default:
+      return false;
+  }
+
+  return true;
+}
+
+int main(int argc, char **argv) {
+  (void)argc;
+  (void)argv;
+
+  printf("Resolution: %u %u\n", W, H);
+
+  MythTracer mt;
+  if (!mt.LoadObj("../Models/Living Room USSU Design.obj")) {
+    return 1;
+  }
+
+  // Same lights as in main_local.cc.
+  auto& lights = mt.GetScene()->lights;
+  lights.push_back(
+      Light{
+          { 231.82174, 81.69966, -27.78259 },
+          { 0.3, 0.3, 0.3 },
+          { 1.0, 1.0, 1.0 },
+          { 1.0, 1.0, 1.0 }
+  });
+
+  for (V3D::basetype z = 0.0; z <= 160.0; z += 80.0) {
+    lights.push_back(
+        Light{
+            { 200, 80.0, z },
+            { 0.0, 0.0, 0.0 },
+            { 0.3, 0.3, 0.3 },
+            { 0.3, 0.3, 0.3 }
+    });
+  }
+
+  if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+    fprintf(stderr, "error: SDL_Init failed: %s\n", SDL_GetError());
+    return 1;
+  }
+
+  SDL_Window *window = SDL_CreateWindow(
+      "MythTracer preview",
+      SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, W, H,
+      SDL_WINDOW_SHOWN);
+  SDL_Renderer *renderer = window != nullptr ?
+      SDL_CreateRenderer(window, -1, 0) : nullptr;
+  SDL_Texture *texture = renderer != nullptr ?
+      SDL_CreateTexture(
+          renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING,
+          W, H) : nullptr;
+  if (texture == nullptr) {
+    fprintf(stderr, "error: failed to create window: %s\n", SDL_GetError());
+    SDL_Quit();
+    return 1;
+  }
+
+  PreviewState state;
+  state.camera = Camera{
+    { 300.0, 107.0, 40.0 },
+     30.0, 170.0 + 90.0, 0.0,
+     110.0
+  };
+
+  std::thread render_thread(RenderThread, &mt, &state);
+
+  bool quit = false;
+  while (!quit) {
+    SDL_Event ev;
+    while (SDL_PollEvent(&ev)) {
+      if (ev.type == SDL_QUIT ||
+          (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_ESCAPE)) {
+        quit = true;
+        break;
+      }
+
+      if (ev.type == SDL_KEYDOWN) {
+        std::lock_guard<std::mutex> lock(state.m);
+        if (HandleKey(ev.key.keysym.sym, &state.camera)) {
+          state.camera_version++;
+          state.cancel = true;
+          state.cv.notify_one();
+        }
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(state.m);
+      if (state.frame_updated) {
+        SDL_UpdateTexture(texture, nullptr, &state.frame[0], W * 3);
+        state.frame_updated = false;
+
+        char title[256];
+        sprintf(title, "MythTracer preview (pass %i/%i)",
+                state.frame_pass + 1, MythTracer::kProgressivePassCount);
+        SDL_SetWindowTitle(window, title);
+      }
+    }
+
+    SDL_RenderCopy(renderer, texture, nullptr, nullptr);
+    SDL_RenderPresent(renderer);
+    SDL_Delay(16);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(state.m);
+    state.quit = true;
+    state.cancel = true;
+    state.cv.notify_one();
+  }
+  render_thread.join();
+
+  SDL_DestroyTexture(texture);
+  SDL_DestroyRenderer(renderer);
+  SDL_DestroyWindow(window);
+  SDL_Quit();
+
+  puts("Done");
+  return 0;
+}
@@ -1,9 +1,11 @@
 #include <stdint.h>
 #include <time.h>
+#include <algorithm>
 #include <memory>
 #include <limits>
 #include <cstring>
 
+#include "half.h"
 #include "mythtracer.h"
 
 using namespace raytracer;
@@ -14,12 +16,19 @@ V3D MythTracer::TraceRayWorker(
     const Ray& ray, int level,
     bool in_object,  // Used in transparency.
     V3D::basetype current_reflection_coef,
+    V3D::basetype cone_width,
+    TraceContext *ctx,
     PerPixelDebugInfo *debug) {
   V3D intersection_point;
   V3D::basetype intersection_distance;
   auto primitive = scene.tree.IntersectRay(
       ray, &intersection_point, &intersection_distance);
 
+  if (level == 0) {
+    ctx->primary_primitive = primitive;
+    ctx->primary_distance = intersection_distance;
+  }
+
   if (primitive == nullptr) {
     if (debug != nullptr) {
       debug->line_no = -1;
@@ -35,6 +44,25 @@ V3D MythTracer::TraceRayWorker(
     debug->point = intersection_point;
   }
 
+  SurfaceHit hit;
+  ResolveHit(
+      ray, primitive, intersection_point, intersection_distance, cone_width,
+      ctx, &hit);
+
+  if (level == 0 && ctx->record_primary_hit != nullptr) {
+    *ctx->record_primary_hit = hit;
+  }
+
+  return ShadeHit(ray, hit, level, in_object, current_reflection_coef, ctx);
+}
+
+void MythTracer::ResolveHit(
+    const Ray& ray, const Primitive *primitive,
+    const V3D& intersection_point, V3D::basetype intersection_distance,
+    V3D::basetype cone_width, TraceContext *ctx, SurfaceHit *hit) {
+  hit->primitive = primitive;
+  hit->point = intersection_point;
+
   V3D normal = primitive->GetNormal(intersection_point);
 
   V3D towards_camera = -ray.direction;
@@ -44,25 +72,57 @@ V3D MythTracer::TraceRayWorker(
     normal_ray_dot = normal.Dot(towards_camera);
   }
 
-  // If no other material information is available, use only the normal-ray dot
-  // product.
-  if (primitive->mtl == nullptr) {
-    normal_ray_dot = (normal_ray_dot + 1.0) * 0.5;    
-    return { normal_ray_dot, normal_ray_dot, normal_ray_dot };
-  }
+  hit->normal = normal;
+  hit->normal_ray_dot = normal_ray_dot;
+
+  // The cone is treated as if reflection/refraction didn't change its spread
+  // (i.e. as if all surfaces were flat).
+  hit->cone_width =
+      cone_width + ctx->pixel_spread_angle * intersection_distance;
 
-  // Calculate the actual color.
-  // Based on https://en.wikipedia.org/wiki/Phong_reflection_model
   auto mtl = primitive->mtl;
+  if (mtl == nullptr) {
+    return;
+  }
 
   V3D surface_color = mtl->ambient;
   if (mtl->tex) {
     V3D uvw = primitive->GetUVW(intersection_point);
-    V3D tex_color = mtl->tex->GetColorAt(
-        uvw.v[0], uvw.v[1], intersection_distance);
+
+    // Footprint of the pixel on the surface, stretched at grazing angles
+    // (within reason, as the filtering is isotropic).
+    const V3D::basetype footprint =
+        hit->cone_width / std::max(normal_ray_dot, (V3D::basetype)0.1) *
+        primitive->GetUVDensity();
+    V3D tex_color = mtl->tex->GetColorAt(uvw.v[0], uvw.v[1], footprint);
     surface_color *= tex_color;   
   }
 
+  hit->surface_color = surface_color;
+}
+
+V3D MythTracer::ShadeHit(
+    const Ray& ray, const SurfaceHit& hit, int level,
+    bool in_object,
+    V3D::basetype current_reflection_coef,
+    TraceContext *ctx) {
+  const V3D& intersection_point = hit.point;
+  const V3D& normal = hit.normal;
+  const V3D::basetype normal_ray_dot = hit.normal_ray_dot;
+  const V3D towards_camera = -ray.direction;
+
+  // If no other material information is available, use only the normal-ray dot
+  // product.
+  if (hit.primitive->mtl == nullptr) {
+    const V3D::basetype shade = (normal_ray_dot + 1.0) * 0.5;
+    return { shade, shade, shade };
+  }
+
+  // Calculate the actual color.
+  // Based on https://en.wikipedia.org/wiki/Phong_reflection_model
+  auto mtl = hit.primitive->mtl;
+  const V3D& surface_color = hit.surface_color;
+
   // Ray reflection.
   // http://paulbourke.net/geometry/reflected/
   V3D reflected_direction =
@@ -73,86 +133,79 @@ V3D MythTracer::TraceRayWorker(
       reflected_direction
   };
 
-  V3D color{};
-
-  for (const auto& light : scene.lights) {
-    V3D light_direction = light.position - intersection_point;
-    light_direction.Norm();
-
-    // Ambient light is always effective.
-    color += light.ambient *
-             surface_color;    
+  // Note: The specular highlight depends only on the view.
+  const V3D::basetype refl_dot = reflected_direction.Dot(towards_camera);
 
-    // Cast a ray between the intersection point and the light to determine
-    // whether the light affects the given point (or whether the point is in
-    // the shadow).
-    // Traverse through all transparent or translucent surfaces.
-    V3D light_power{1.0, 1.0, 1.0};
-    bool in_shadow = false;
+  // Ambient light is always effective.
+  V3D color = light_tree.GetTotalAmbient() * surface_color;
 
-    bool traversing_through_object = false;
-    for (V3D start_point = intersection_point;;) {
-      Ray shadow_ray{
-        // TODO(gynvael): Pick a better epsilon.  
-        start_point + (light_direction * 0.00001),
-        light_direction
-      };
-
-      V3D::basetype light_distance = 
-        start_point.Distance(light.position);
-
-      V3D shadow_intersection_point;
-      V3D::basetype shadow_distance;
-      auto shadow_primitive = scene.tree.IntersectRay(
-          shadow_ray, &shadow_intersection_point, &shadow_distance);
-
-      if (shadow_primitive == nullptr) {
-        // Nothing found. Done.
-        break;
-      }
+  V3D specular_weight{};
+  if (refl_dot > 0) {
+    specular_weight = mtl->specular *
+                      surface_color *
+                      pow(refl_dot, mtl->specular_exp);
+  }
 
-      // Perhaps the light was closer.
-      if (shadow_distance > light_distance) {
-        // Primitive was behind the light source.
-        break;
-      }
+  // Light selection. Start by narrowing down the set of lights which might
+  // affect the point at all.
+  const std::vector<size_t> *lights = &all_lights;
+  if (ctx->settings->use_light_tree) {
+    light_tree.SelectLights(
+        intersection_point, normal,
+        mtl->diffuse * surface_color * current_reflection_coef,
+        specular_weight * current_reflection_coef,
+        ctx->settings->light_error_budget,
+        &ctx->selected_lights);
+    ctx->stats.lights_culled_facing += ctx->selected_lights.culled_facing;
+    ctx->stats.lights_dropped += ctx->selected_lights.dropped;
+    ctx->selected_lights.culled_facing = 0;
+    ctx->selected_lights.dropped = 0;
+    lights = &ctx->selected_lights.lights;
+  }
 
-      // If the primitive is not transparent, then we are in a shadow.
-      if (shadow_primitive->mtl->transparency == 0.0) {
-        light_power = { 0.0, 0.0, 0.0 };
-        in_shadow = true;        
-        break;
-      }
+  for (size_t light_idx : *lights) {
+    const Light& light = scene.lights[light_idx];
+    V3D light_direction = light.position - intersection_point;
+    light_direction.Norm();
 
+    // If the light is behind the surface, the surface itself is shadowing the
+    // point.
+    const V3D::basetype light_normal_dot = light_direction.Dot(normal);
+    if (light_normal_dot <= 0.0) {
+      ctx->stats.lights_culled_facing++;
+      continue;
+    }
 
-      // Some light passes through.
-      if (!traversing_through_object) {
-        light_power *= shadow_primitive->mtl->transmission_filter *
-                       shadow_primitive->mtl->transparency;
-      }
+    const V3D diffuse_color = mtl->diffuse *
+                              surface_color *
+                              light_normal_dot *
+                              light.diffuse;
 
-      traversing_through_object = !traversing_through_object;
+    const V3D specular_color = specular_weight * light.specular;
 
-      // Change the starting point and continue.
-      start_point = shadow_intersection_point + (light_direction * 0.0000001);
+    // Being in a shadow can at most take away the non-ambient part of the
+    // diffuse light and the specular highlight. If that would not be visible
+    // anyway, don't bother casting the shadow rays.
+    const V3D shadow_range{
+        std::max(0.0, 1.0 - light.ambient.v[0]),
+        std::max(0.0, 1.0 - light.ambient.v[1]),
+        std::max(0.0, 1.0 - light.ambient.v[2])
+    };
+    const V3D max_shadow_effect =
+        (diffuse_color * shadow_range + specular_color) *
+        current_reflection_coef;
 
-      // There is an unlikely event that the new starting point is actually
-      // behind the light. In such case, break.
-      if (intersection_point.SqrDistance(start_point) >
-          intersection_point.SqrDistance(light.position)) {
-        // Already behind the light. No more shadow opportunities.
-        break;
-      }
+    V3D light_power{1.0, 1.0, 1.0};
+    bool in_shadow = false;
 
-      // If the light power is below the ambient threashold, just stop here and
-      // mark as shadow.
-      if (light_power.v[0] <= 0.001 &&
-          light_power.v[1] <= 0.001 &&
-          light_power.v[2] <= 0.001) {
-        light_power = { 0.0, 0.0, 0.0 };
-        in_shadow = true;
-        break;
-      }
+    const V3D::basetype threshold = ctx->settings->light_cull_threshold;
+    if (max_shadow_effect.v[0] < threshold &&
+        max_shadow_effect.v[1] < threshold &&
+        max_shadow_effect.v[2] < threshold) {
+      ctx->stats.lights_culled_contribution++;
+    } else {
+      light_power = GetLightPower(
+          intersection_point, light_direction, light_idx, ctx, &in_shadow);
     }
 
     // Actually do use ambient for light power.
@@ -160,36 +213,39 @@ V3D MythTracer::TraceRayWorker(
     light_power.v[1] = std::max(light_power.v[1], light.ambient.v[1]);
     light_power.v[2] = std::max(light_power.v[2], light.ambient.v[2]);
 
-    color += mtl->diffuse *
-             surface_color *
-             light_direction.Dot(normal) *
-             light.diffuse * 
-             light_power;
+    color += diffuse_color * light_power;
 
     if (!in_shadow) {
-      auto refl_dot = reflected_direction.Dot(towards_camera);
-      if (refl_dot > 0) {
-        color += mtl->specular *
-                 surface_color *
-                 pow(refl_dot, mtl->specular_exp) *
-                 light.specular;
-      }
+      color += specular_color;
     }
   }
 
+  const bool can_recurse = level < (int)ctx->settings->max_recursion_level;
+
   // Reflection.
-  if (level < MAX_RECURSION_LEVEL && 
+  if (can_recurse &&
       mtl->reflectance > 0.0 &&
-      current_reflection_coef > 0.01 &&
       !in_object) {
-    color += TraceRayWorker(
-        reflected_ray,
-        level + 1, in_object, current_reflection_coef * mtl->reflectance,
-        nullptr) * mtl->reflectance;
+    const V3D::basetype weight = current_reflection_coef * mtl->reflectance;
+    const V3D::basetype survival = ContinuePath(weight, ctx);
+    if (survival > 0.0) {
+      color += TraceRayWorker(
+          reflected_ray,
+          level + 1, in_object, weight / survival, hit.cone_width,
+          ctx, nullptr) * (mtl->reflectance / survival);
+    }
   }
 
   // Refration.
-  if (level < MAX_RECURSION_LEVEL && mtl->transparency > 0.0) {
+  const V3D::basetype transmission_weight =
+      current_reflection_coef * mtl->transparency *
+      std::max({ mtl->transmission_filter.v[0],
+                 mtl->transmission_filter.v[1],
+                 mtl->transmission_filter.v[2] });
+  V3D::basetype transmission_survival = 0.0;
+  if (can_recurse &&
+      mtl->transparency > 0.0 &&
+      (transmission_survival = ContinuePath(transmission_weight, ctx)) > 0.0) {
     V3D::basetype refraction_index = mtl->refraction_index;
     if (in_object) {
       //refraction_index = 1.0 / refraction_index;
@@ -220,16 +276,171 @@ V3D MythTracer::TraceRayWorker(
     color += TraceRayWorker(
         refracted_ray,
         level + 1, !in_object,
-        current_reflection_coef,
-        nullptr) * mtl->transmission_filter * mtl->transparency;
+        transmission_weight / transmission_survival, hit.cone_width,
+        ctx, nullptr) * mtl->transmission_filter *
+                        (mtl->transparency / transmission_survival);
   }
 
   return color;
 }
 
+V3D::basetype MythTracer::ContinuePath(
+    V3D::basetype weight, TraceContext *ctx) {
+  const RenderSettings& settings = *ctx->settings;
+
+  if (weight < settings.min_throughput) {
+    ctx->stats.paths_terminated_throughput++;
+    return 0.0;
+  }
+
+  V3D::basetype survival = 1.0;
+  if (weight < settings.roulette_threshold) {
+    survival = weight / settings.roulette_threshold;
+    if (ctx->Random() >= survival) {
+      ctx->stats.paths_terminated_roulette++;
+      return 0.0;
+    }
+  }
+
+  if (settings.ray_budget_per_sample != 0 &&
+      ctx->sample_secondary_rays >= settings.ray_budget_per_sample) {
+    ctx->stats.paths_terminated_budget++;
+    return 0.0;
+  }
+
+  ctx->sample_secondary_rays++;
+  ctx->stats.secondary_rays++;
+  return survival;
+}
+
+V3D MythTracer::GetLightPower(
+    const V3D& point, const V3D& light_direction, size_t light_idx,
+    TraceContext *ctx, bool *in_shadow) {
+  const Light& light = scene.lights[light_idx];
+  const Primitive *&last_occluder = ctx->last_occluder[light_idx];
+
+  // Cast a ray between the intersection point and the light to determine
+  // whether the light affects the given point (or whether the point is in
+  // the shadow).
+  // Traverse through all transparent or translucent surfaces.
+  V3D light_power{1.0, 1.0, 1.0};
+  *in_shadow = false;
+
+  // Only the first segment of the shadow ray is checked against the cache.
+  bool check_occluder_cache = last_occluder != nullptr;
+
+  bool traversing_through_object = false;
+  for (V3D start_point = point;;) {
+    Ray shadow_ray{
+      // TODO(gynvael): Pick a better epsilon.  
+      start_point + (light_direction * 0.00001),
+      light_direction
+    };
+
+    V3D::basetype light_distance = 
+      start_point.Distance(light.position);
+
+    V3D shadow_intersection_point;
+    V3D::basetype shadow_distance;
+
+    // Before doing the full traversal check if the primitive that shadowed
+    // this light last time is blocking the light here as well.
+    if (check_occluder_cache) {
+      check_occluder_cache = false;
+
+      if (OctTree::IntersectRayWithPrimitive(
+              shadow_ray, last_occluder,
+              &shadow_intersection_point, &shadow_distance) &&
+          shadow_distance <= light_distance) {
+        ctx->stats.occluder_cache_hits++;
+        *in_shadow = true;
+        return { 0.0, 0.0, 0.0 };
+      }
+
+      ctx->stats.occluder_cache_misses++;
+    }
+
+    ctx->stats.shadow_rays++;
+    auto shadow_primitive = scene.tree.IntersectRay(
+        shadow_ray, &shadow_intersection_point, &shadow_distance);
+
+    if (shadow_primitive == nullptr) {
+      // Nothing found. Done.
+      break;
+    }
+
+    // Perhaps the light was closer.
+    if (shadow_distance > light_distance) {
+      // Primitive was behind the light source.
+      break;
+    }
+
+    // If the primitive is not transparent, then we are in a shadow.
+    if (shadow_primitive->mtl->transparency == 0.0) {
+      light_power = { 0.0, 0.0, 0.0 };
+      *in_shadow = true;        
+      last_occluder = shadow_primitive;
+      break;
+    }
+
+
+    // Some light passes through.
+    if (!traversing_through_object) {
+      light_power *= shadow_primitive->mtl->transmission_filter *
+                     shadow_primitive->mtl->transparency;
+    }
+
+    traversing_through_object = !traversing_through_object;
+
+    // Change the starting point and continue.
+    start_point = shadow_intersection_point + (light_direction * 0.0000001);
+
+    // There is an unlikely event that the new starting point is actually
+    // behind the light. In such case, break.
+    if (point.SqrDistance(start_point) >
+        point.SqrDistance(light.position)) {
+      // Already behind the light. No more shadow opportunities.
+      break;
+    }
+
+    // If the light power is below the ambient threashold, just stop here and
+    // mark as shadow.
+    if (light_power.v[0] <= 0.001 &&
+        light_power.v[1] <= 0.001 &&
+        light_power.v[2] <= 0.001) {
+      light_power = { 0.0, 0.0, 0.0 };
+      *in_shadow = true;
+      break;
+    }
+  }
+
+  return light_power;
+}
+
 V3D MythTracer::TraceRay(
-    const Ray& ray, PerPixelDebugInfo *debug) {
-  return TraceRayWorker(ray, 0, false, 1.0, debug);
+    const Ray& ray, TraceContext *ctx, PerPixelDebugInfo *debug) {
+  return TraceRayWorker(ray, 0, false, 1.0, 0.0, ctx, debug);
+}
+
+V3D MythTracer::ShadeStoredHit(
+    const Ray& ray, const SurfaceHit& hit, TraceContext *ctx,
+    PerPixelDebugInfo *debug) {
+  if (hit.primitive == nullptr) {
+    if (debug != nullptr) {
+      debug->line_no = -1;
+      debug->point = { NAN, NAN, NAN };
+    }
+
+    // Background color.
+    return { 0.0, 0.0, 0.0 };
+  }
+
+  if (debug != nullptr) {
+    debug->line_no = hit.primitive->debug_line_no;
+    debug->point = hit.point;
+  }
+
+  return ShadeHit(ray, hit, 0, false, 1.0, ctx);
 }
 
 void MythTracer::V3DtoRGB(const V3D& v, uint8_t rgb[3]) {
@@ -240,6 +451,17 @@ void MythTracer::V3DtoRGB(const V3D& v, uint8_t rgb[3]) {
   }
 }
 
+void MythTracer::StorePixel(WorkChunk *chunk, size_t idx, const V3D& color) {
+  if (chunk->settings.output_format == PixelFormat::kRGB8) {
+    V3DtoRGB(color, &chunk->output_bitmap[idx * 3]);
+    return;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    chunk->output_hdr[idx * 3 + i] = (float)color.v[i];
+  }
+}
+
 Scene *MythTracer::GetScene() {
   return &scene;
 }
@@ -252,63 +474,663 @@ bool MythTracer::LoadObj(const char *fname) {
   }
 
   was_scene_finalized = false;
+  InvalidatePrimaryHits();
   return true;
 }
 
+void MythTracer::InvalidatePrimaryHits() {
+  gbuffer = GBuffer{};
+  history = FrameHistory{};
+}
+
+bool GBuffer::Matches(const WorkChunk& chunk) const {
+  return !hits.empty() &&
+         image_width == chunk.image_width &&
+         image_height == chunk.image_height &&
+         chunk_x == chunk.chunk_x &&
+         chunk_y == chunk.chunk_y &&
+         chunk_width == chunk.chunk_width &&
+         chunk_height == chunk.chunk_height &&
+         camera.origin.v[0] == chunk.camera.origin.v[0] &&
+         camera.origin.v[1] == chunk.camera.origin.v[1] &&
+         camera.origin.v[2] == chunk.camera.origin.v[2] &&
+         camera.pitch == chunk.camera.pitch &&
+         camera.yaw == chunk.camera.yaw &&
+         camera.roll == chunk.camera.roll &&
+         camera.aov == chunk.camera.aov;
+}
+
 bool MythTracer::RayTrace(
     int image_width, int image_height, 
     Camera *camera,
-    std::vector<uint8_t> *output_bitmap) {
+    std::vector<uint8_t> *output_bitmap,
+    const RenderSettings& settings) {
   WorkChunk chunk{
       image_width, image_height,
       0, 0, image_width, image_height,
-      *camera, {}, {}
+      *camera, settings, {}, {}, {}, {}, {}
   };
-  chunk.output_bitmap.resize(image_width * image_height * 3);
 
   bool res = RayTrace(&chunk);
   if (!res) {
     return false;
   }
 
+  if (settings.output_format != PixelFormat::kRGB8) {
+    output_bitmap->resize(image_width * image_height * 3);
+    ToneMap(&chunk.output_hdr[0], image_width * image_height,
+            ToneMapSettings{}, &(*output_bitmap)[0]);
+    return true;
+  }
+
   *output_bitmap = std::move(chunk.output_bitmap);
 
   return true;
 }
 
 
-bool MythTracer::RayTrace(WorkChunk *chunk) {
+void MythTracer::PrepareRender() {
   if (!was_scene_finalized) {
     puts("Finalizing tree.");    
     scene.tree.Finalize();
     was_scene_finalized = true;
   }
-  
+
+  light_tree.Build(scene.lights);
+  all_lights.resize(scene.lights.size());
+  for (size_t i = 0; i < all_lights.size(); i++) {
+    all_lights[i] = i;
+  }
+
+  scene.texture_cache.Trim();
+}
+
+bool MythTracer::RayTrace(WorkChunk *chunk) {
+  PrepareRender();
+
   puts("Rendering.");
   const clock_t tm_start = clock();  
   Camera::Sensor sensor = chunk->camera.GetSensor(
       chunk->image_width, chunk->image_height);  
 
+  const size_t pixel_count = chunk->chunk_width * chunk->chunk_height;
+  if (chunk->settings.output_format == PixelFormat::kRGB8) {
+    chunk->output_bitmap.resize(pixel_count * 3);
+  } else {
+    chunk->output_hdr.resize(pixel_count * 3);
+  }
+
+  chunk->output_stats = RenderStats{};
+  if (chunk->settings.aa_grid >= 2) {
+    RenderChunkAdaptive(chunk, sensor);
+  } else if (chunk->settings.temporal_reprojection) {
+    RenderChunkReprojected(chunk, sensor);
+  } else {
+    RenderChunk(chunk, sensor);
+  }
+
+  const clock_t tm_end = clock();
+  const float tm = (float)(tm_end - tm_start) / (float)CLOCKS_PER_SEC;
+  printf("%.3fs\n", tm);
+  chunk->output_stats.Print();
+  scene.texture_cache.PrintStats();
+
+  return true;
+}
+
+namespace {
+
+// Pixels traced in a pass of the progressive mode, and the block each of them
+// is drawn as (until the remaining pixels of the block are traced by the
+// following passes). This is basically Adam7 interlacing reduced to 4x4.
+struct ProgressivePass {
+  int x_offset, y_offset;
+  int x_step, y_step;
+  int block_width, block_height;
+};
+
+const ProgressivePass kProgressivePasses[
+    MythTracer::kProgressivePassCount] = {
+  { 0, 0, 4, 4, 4, 4 },  // 1/16 of the pixels.
+  { 2, 0, 4, 4, 2, 4 },  // 1/16.
+  { 0, 2, 2, 4, 2, 2 },  // 1/8.
+  { 1, 0, 2, 2, 1, 2 },  // 1/4.
+  { 0, 1, 1, 2, 1, 1 }   // 1/2.
+};
+
+}  // namespace
+
+bool MythTracer::RayTraceProgressive(
+    int image_width, int image_height,
+    Camera *camera,
+    std::vector<uint8_t> *output_bitmap,
+    const std::function<void(int pass)>& on_pass,
+    const std::atomic<bool> *cancel,
+    const RenderSettings& settings) {
+  PrepareRender();
+
+  // Only used for the settings and the stats.
+  WorkChunk chunk{
+      image_width, image_height,
+      0, 0, image_width, image_height,
+      *camera, settings, {}, {}, {}, {}, {}
+  };
+
+  Camera::Sensor sensor = camera->GetSensor(image_width, image_height);
+  output_bitmap->resize(image_width * image_height * 3);
+
+  const bool reproject = settings.temporal_reprojection;
+  Reprojection reprojection;
+  if (reproject) {
+    StartReprojectedFrame(chunk, &reprojection);
+  }
+
+  for (int pass_no = 0; pass_no < kProgressivePassCount; pass_no++) {
+    const ProgressivePass& pass = kProgressivePasses[pass_no];
+
+    #pragma omp parallel
+    {
+    TraceContext ctx;
+    InitTraceContext(&ctx, &chunk);
+
+    #pragma omp for schedule(dynamic)
+    for (int y = pass.y_offset; y < image_height; y += pass.y_step) {
+      // OpenMP doesn't allow breaking out of the loop, so just skip the
+      // remaining rows.
+      if (cancel->load(std::memory_order_relaxed)) {
+        continue;
+      }
+
+      const int block_height = std::min(pass.block_height, image_height - y);
+      for (int x = pass.x_offset; x < image_width; x += pass.x_step) {
+        V3D color;
+        if (reproject) {
+          color = TracePixelReprojected(
+              reprojection, sensor.GetRay(x, y), x, y, y * image_width + x,
+              &ctx, nullptr);
+        } else {
+          ctx.StartSample(x, y);
+          color = TraceRay(sensor.GetRay(x, y), &ctx, nullptr);
+        }
+        ctx.stats.pixels++;
+        ctx.stats.camera_rays++;
+
+        uint8_t rgb[3];
+        V3DtoRGB(color, rgb);
+
+        const int block_width = std::min(pass.block_width, image_width - x);
+        for (int by = 0; by < block_height; by++) {
+          for (int bx = 0; bx < block_width; bx++) {
+            memcpy(&(*output_bitmap)[((y + by) * image_width + x + bx) * 3],
+                   rgb, 3);
+          }
+        }
+      }
+    }
+
+    #pragma omp critical
+    chunk.output_stats.Add(ctx.stats);
+    }
+
+    if (cancel->load()) {
+      return false;
+    }
+
+    on_pass(pass_no);
+  }
+
+  chunk.output_stats.Print();
+  scene.texture_cache.PrintStats();
+  return true;
+}
+
+void MythTracer::InitTraceContext(
+    TraceContext *ctx, WorkChunk *chunk) {
+  ctx->settings = &chunk->settings;
+  ctx->last_occluder.resize(scene.lights.size());
+  ctx->pixel_spread_angle =
+      math3d::Deg2Rad(chunk->camera.aov) / chunk->image_width;
+}
+
+void MythTracer::RenderChunk(
+    WorkChunk *chunk, const Camera::Sensor& sensor) {
+  const bool use_gbuffer = chunk->settings.reuse_primary_hits;
+  const bool reuse_gbuffer = use_gbuffer && gbuffer.Matches(*chunk);
+  if (use_gbuffer && !reuse_gbuffer) {
+    gbuffer = GBuffer{
+        chunk->image_width, chunk->image_height,
+        chunk->chunk_x, chunk->chunk_y,
+        chunk->chunk_width, chunk->chunk_height,
+        chunk->camera, {}
+    };
+    gbuffer.hits.resize(chunk->chunk_width * chunk->chunk_height);
+  }
+
   #pragma omp parallel
   {
+  TraceContext ctx;
+  InitTraceContext(&ctx, chunk);
+
   #pragma omp for
   for (int j = 0; j < chunk->chunk_height; j++) {
     for (int i = 0; i < chunk->chunk_width; i++) {
-      V3D color = TraceRay(
-          sensor.GetRay(chunk->chunk_x + i, chunk->chunk_y + j),
-          !chunk->output_debug.empty() ? 
-            &chunk->output_debug[j * chunk->chunk_width + i] : nullptr);
-      V3DtoRGB(color, &chunk->output_bitmap[(j * chunk->chunk_width + i) * 3]);
+      const size_t idx = j * chunk->chunk_width + i;
+      const Ray ray = sensor.GetRay(chunk->chunk_x + i, chunk->chunk_y + j);
+      PerPixelDebugInfo *debug =
+          !chunk->output_debug.empty() ? &chunk->output_debug[idx] : nullptr;
+
+      ctx.StartSample(chunk->chunk_x + i, chunk->chunk_y + j);
+      V3D color;
+      if (reuse_gbuffer) {
+        color = ShadeStoredHit(ray, gbuffer.hits[idx], &ctx, debug);
+        ctx.stats.pixels_reused++;
+      } else {
+        // Note: Misses leave the default SurfaceHit in the G-buffer.
+        ctx.record_primary_hit = use_gbuffer ? &gbuffer.hits[idx] : nullptr;
+        color = TraceRay(ray, &ctx, debug);
+        ctx.stats.camera_rays++;
+      }
+      StorePixel(chunk, idx, color);
+      ctx.stats.pixels++;
+
+      if (!chunk->output_sample_count.empty()) {
+        chunk->output_sample_count[j * chunk->chunk_width + i] = 1;
+      }
     }
     putchar('.'); fflush(stdout);
   }
+
+  #pragma omp critical
+  chunk->output_stats.Add(ctx.stats);
   }
+}
 
-  const clock_t tm_end = clock();
-  const float tm = (float)(tm_end - tm_start) / (float)CLOCKS_PER_SEC;
-  printf("%.3fs\n", tm);
+namespace {
+
+// Whether the shaded color depends only on the surface color and the lights,
+// i.e. can be reused when looking at the same spot from a different angle.
+bool IsViewIndependent(const Material *mtl) {
+  return mtl != nullptr &&
+         mtl->specular.v[0] == 0.0 &&
+         mtl->specular.v[1] == 0.0 &&
+         mtl->specular.v[2] == 0.0 &&
+         mtl->reflectance == 0.0 &&
+         mtl->transparency == 0.0;
+}
 
-  return true;
+}  // namespace
+
+const FrameHistory::Sample *FrameHistory::Find(
+    const Camera::Sensor& sensor, const Primitive *primitive,
+    const V3D& point, V3D::basetype tolerance) const {
+  V3D::basetype x, y;
+  if (samples.empty() || !sensor.Project(point, &x, &y)) {
+    return nullptr;
+  }
+
+  // Samples were taken at the pixel corners (see Camera::Sensor::GetRay).
+  const V3D::basetype i = floor(x + 0.5) - chunk_x;
+  const V3D::basetype j = floor(y + 0.5) - chunk_y;
+  if (!(i >= 0.0 && i < chunk_width && j >= 0.0 && j < chunk_height)) {
+    return nullptr;
+  }
+
+  const Sample& sample = samples[(size_t)j * chunk_width + (size_t)i];
+  if (sample.primitive != primitive ||
+      sample.point.SqrDistance(point) > tolerance * tolerance) {
+    return nullptr;
+  }
+
+  return &sample;
+}
+
+void MythTracer::StartReprojectedFrame(
+    const WorkChunk& chunk, Reprojection *reprojection) {
+  // The previous frame is read while the new one is being written.
+  FrameHistory& prev = reprojection->prev;
+  prev = std::move(history);
+  if (prev.image_width != chunk.image_width ||
+      prev.image_height != chunk.image_height) {
+    prev.samples.clear();
+  }
+  reprojection->prev_sensor =
+      prev.camera.GetSensor(chunk.image_width, chunk.image_height);
+
+  history = FrameHistory{
+      chunk.image_width, chunk.image_height,
+      chunk.chunk_x, chunk.chunk_y,
+      chunk.chunk_width, chunk.chunk_height,
+      chunk.camera, prev.frame + 1, {}
+  };
+  history.samples.resize(chunk.chunk_width * chunk.chunk_height);
+
+  reprojection->refresh_period =
+      std::max(chunk.settings.reprojection_refresh_period, 1u);
+  reprojection->max_age = reprojection->refresh_period * 2;
+}
+
+V3D MythTracer::TracePixelReprojected(
+    const Reprojection& reprojection, const Ray& ray, int x, int y,
+    size_t idx, TraceContext *ctx, PerPixelDebugInfo *debug) {
+  V3D point;
+  V3D::basetype distance;
+  const Primitive *primitive =
+      scene.tree.IntersectRay(ray, &point, &distance);
+
+  SurfaceHit hit;
+  if (primitive != nullptr) {
+    ResolveHit(ray, primitive, point, distance, 0.0, ctx, &hit);
+  }
+
+  // Note: Neighboring pixels are refreshed in different frames.
+  const uint32_t refresh_period = reprojection.refresh_period;
+  const bool refresh =
+      (uint32_t)(x * 7 + y * 3) % refresh_period ==
+      history.frame % refresh_period;
+
+  const FrameHistory::Sample *prev_sample = nullptr;
+  if (primitive != nullptr && !refresh &&
+      IsViewIndependent(primitive->mtl)) {
+    // Up to half a pixel away on either axis, with some margin for
+    // surfaces seen at an angle.
+    const V3D::basetype tolerance =
+        2.0 * ctx->pixel_spread_angle * distance;
+    prev_sample = reprojection.prev.Find(
+        reprojection.prev_sensor, primitive, point, tolerance);
+    if (prev_sample != nullptr && prev_sample->age >= reprojection.max_age) {
+      prev_sample = nullptr;
+    }
+  }
+
+  V3D color;
+  FrameHistory::Sample& sample = history.samples[idx];
+  if (prev_sample != nullptr) {
+    if (debug != nullptr) {
+      debug->line_no = primitive->debug_line_no;
+      debug->point = point;
+    }
+
+    color = hit.surface_color * prev_sample->lighting;
+    sample = *prev_sample;
+    sample.point = point;
+    sample.age++;
+    ctx->stats.pixels_reprojected++;
+  } else {
+    ctx->StartSample(x, y);
+    color = ShadeStoredHit(ray, hit, ctx, debug);
+
+    if (primitive != nullptr && IsViewIndependent(primitive->mtl)) {
+      sample.primitive = primitive;
+      sample.point = point;
+      for (int k = 0; k < 3; k++) {
+        sample.lighting.v[k] =
+            hit.surface_color.v[k] > 0.0 ?
+                color.v[k] / hit.surface_color.v[k] : 0.0;
+      }
+    }
+  }
+
+  return color;
+}
+
+void MythTracer::RenderChunkReprojected(
+    WorkChunk *chunk, const Camera::Sensor& sensor) {
+  Reprojection reprojection;
+  StartReprojectedFrame(*chunk, &reprojection);
+
+  #pragma omp parallel
+  {
+  TraceContext ctx;
+  InitTraceContext(&ctx, chunk);
+
+  #pragma omp for
+  for (int j = 0; j < chunk->chunk_height; j++) {
+    for (int i = 0; i < chunk->chunk_width; i++) {
+      const int x = chunk->chunk_x + i;
+      const int y = chunk->chunk_y + j;
+      const size_t idx = j * chunk->chunk_width + i;
+      PerPixelDebugInfo *debug =
+          !chunk->output_debug.empty() ? &chunk->output_debug[idx] : nullptr;
+      ctx.stats.pixels++;
+      ctx.stats.camera_rays++;
+
+      const V3D color = TracePixelReprojected(
+          reprojection, sensor.GetRay(x, y), x, y, idx, &ctx, debug);
+      StorePixel(chunk, idx, color);
+      if (!chunk->output_sample_count.empty()) {
+        chunk->output_sample_count[idx] = 1;
+      }
+    }
+    putchar('.'); fflush(stdout);
+  }
+
+  #pragma omp critical
+  chunk->output_stats.Add(ctx.stats);
+  }
+}
+
+namespace {
+
+// Result of the first (one sample per pixel) pass of adaptive anti-aliasing.
+struct PixelSample {
+  V3D color;
+  const Primitive *primitive;
+  V3D::basetype distance;
+};
+
+bool SamplesDiffer(
+    const PixelSample& a, const PixelSample& b,
+    const RenderSettings& settings) {
+  // Different materials are compared instead of different primitives, as
+  // otherwise every edge inside of a smooth mesh would get refined. Object
+  // silhouettes are still caught by the depth test below.
+  const Material *mtl_a = a.primitive != nullptr ? a.primitive->mtl : nullptr;
+  const Material *mtl_b = b.primitive != nullptr ? b.primitive->mtl : nullptr;
+  if ((a.primitive == nullptr) != (b.primitive == nullptr) || mtl_a != mtl_b) {
+    return true;
+  }
+
+  for (int k = 0; k < 3; k++) {
+    if (fabs(a.color.v[k] - b.color.v[k]) > settings.aa_color_threshold) {
+      return true;
+    }
+  }
+
+  if (a.primitive != nullptr &&
+      fabs(a.distance - b.distance) >
+          settings.aa_depth_threshold * std::min(a.distance, b.distance)) {
+    return true;
+  }
+
+  return false;
+}
+
+}  // namespace
+
+void MythTracer::RenderChunkAdaptive(
+    WorkChunk *chunk, const Camera::Sensor& sensor) {
+  const RenderSettings& settings = chunk->settings;
+  const int grid = (int)settings.aa_grid;
+
+  // The first pass covers also a one pixel border around the chunk (as far as
+  // the image goes), so that pixels on the edge of the chunk can be compared
+  // with all their neighbors. This way the result doesn't depend on how the
+  // image was split into chunks.
+  const int x0 = std::max(chunk->chunk_x - 1, 0);
+  const int y0 = std::max(chunk->chunk_y - 1, 0);
+  const int x1 = std::min(
+      chunk->chunk_x + chunk->chunk_width + 1, chunk->image_width);
+  const int y1 = std::min(
+      chunk->chunk_y + chunk->chunk_height + 1, chunk->image_height);
+  const int samples_width = x1 - x0;
+  const int samples_height = y1 - y0;
+  std::vector<PixelSample> samples(samples_width * samples_height);
+
+  #pragma omp parallel
+  {
+  TraceContext ctx;
+  InitTraceContext(&ctx, chunk);
+
+  #pragma omp for
+  for (int j = 0; j < samples_height; j++) {
+    for (int i = 0; i < samples_width; i++) {
+      const int x = x0 + i;
+      const int y = y0 + j;
+      const int chunk_i = x - chunk->chunk_x;
+      const int chunk_j = y - chunk->chunk_y;
+      const bool in_chunk =
+          chunk_i >= 0 && chunk_i < chunk->chunk_width &&
+          chunk_j >= 0 && chunk_j < chunk->chunk_height;
+
+      ctx.StartSample(x, y);
+      PixelSample& sample = samples[j * samples_width + i];
+      sample.color = TraceRay(
+          sensor.GetSubpixelRay(x + 0.5, y + 0.5),
+          &ctx,
+          in_chunk && !chunk->output_debug.empty() ?
+            &chunk->output_debug[chunk_j * chunk->chunk_width + chunk_i] :
+            nullptr);
+      sample.primitive = ctx.primary_primitive;
+      sample.distance = ctx.primary_distance;
+    }
+    ctx.stats.camera_rays += samples_width;
+  }
+
+  // Note: There is an implicit barrier at the end of the loop above, so all
+  // the samples are ready at this point.
+  #pragma omp for
+  for (int j = 0; j < chunk->chunk_height; j++) {
+    for (int i = 0; i < chunk->chunk_width; i++) {
+      const int x = chunk->chunk_x + i;
+      const int y = chunk->chunk_y + j;
+      const int si = x - x0;
+      const int sj = y - y0;
+      const PixelSample& sample = samples[sj * samples_width + si];
+
+      bool refine = false;
+      if (si > 0) {
+        refine |= SamplesDiffer(
+            sample, samples[sj * samples_width + si - 1], settings);
+      }
+      if (si < samples_width - 1) {
+        refine |= SamplesDiffer(
+            sample, samples[sj * samples_width + si + 1], settings);
+      }
+      if (sj > 0) {
+        refine |= SamplesDiffer(
+            sample, samples[(sj - 1) * samples_width + si], settings);
+      }
+      if (sj < samples_height - 1) {
+        refine |= SamplesDiffer(
+            sample, samples[(sj + 1) * samples_width + si], settings);
+      }
+
+      V3D color = sample.color;
+      int sample_count = 1;
+      if (refine) {
+        // One jittered sample in each cell of a grid x grid subpixel grid.
+        // The middle sample from the first pass is kept as well.
+        ctx.StartSample(x, y, 1);
+        for (int sy = 0; sy < grid; sy++) {
+          for (int sx = 0; sx < grid; sx++) {
+            const V3D::basetype dx = (sx + ctx.Random()) / grid;
+            const V3D::basetype dy = (sy + ctx.Random()) / grid;
+            color += TraceRay(
+                sensor.GetSubpixelRay(x + dx, y + dy), &ctx, nullptr);
+          }
+        }
+
+        sample_count += grid * grid;
+        color = color / (V3D::basetype)sample_count;
+        ctx.stats.pixels_refined++;
+        ctx.stats.camera_rays += grid * grid;
+      }
+
+      StorePixel(chunk, j * chunk->chunk_width + i, color);
+      ctx.stats.pixels++;
+
+      if (!chunk->output_sample_count.empty()) {
+        chunk->output_sample_count[j * chunk->chunk_width + i] = sample_count;
+      }
+    }
+    putchar('.'); fflush(stdout);
+  }
+
+  #pragma omp critical
+  chunk->output_stats.Add(ctx.stats);
+  }
+}
+
+void TraceContext::StartSample(int x, int y, int pass) {
+  sample_secondary_rays = 0;
+
+  // Any hash will do as long as neighboring pixels get unrelated sequences.
+  uint32_t h = (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u ^
+               (uint32_t)pass * 0xcb1ab31fu;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  random_state = h != 0 ? h : 1;
+}
+
+V3D::basetype TraceContext::Random() {
+  // Xorshift32.
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return (V3D::basetype)random_state / 4294967296.0;
+}
+
+void RenderStats::Add(const RenderStats& other) {
+  shadow_rays += other.shadow_rays;
+  lights_culled_facing += other.lights_culled_facing;
+  lights_culled_contribution += other.lights_culled_contribution;
+  lights_dropped += other.lights_dropped;
+  occluder_cache_hits += other.occluder_cache_hits;
+  occluder_cache_misses += other.occluder_cache_misses;
+  secondary_rays += other.secondary_rays;
+  paths_terminated_throughput += other.paths_terminated_throughput;
+  paths_terminated_roulette += other.paths_terminated_roulette;
+  paths_terminated_budget += other.paths_terminated_budget;
+  pixels += other.pixels;
+  pixels_refined += other.pixels_refined;
+  camera_rays += other.camera_rays;
+  pixels_reused += other.pixels_reused;
+  pixels_reprojected += other.pixels_reprojected;
+}
+
+void RenderStats::Print() const {
+  printf("Shadow rays: %llu cast, lights skipped: %llu facing away, "
+         "%llu below threshold, %llu dropped\n",
+         (unsigned long long)shadow_rays,
+         (unsigned long long)lights_culled_facing,
+         (unsigned long long)lights_culled_contribution,
+         (unsigned long long)lights_dropped);
+
+  const uint64_t lookups = occluder_cache_hits + occluder_cache_misses;
+  printf("Occluder cache: %llu hits, %llu misses (%.1f%% hit rate)\n",
+         (unsigned long long)occluder_cache_hits,
+         (unsigned long long)occluder_cache_misses,
+         lookups != 0 ? 100.0 * occluder_cache_hits / lookups : 0.0);
+
+  printf("Secondary rays: %llu traced, paths terminated: %llu throughput, "
+         "%llu roulette, %llu budget\n",
+         (unsigned long long)secondary_rays,
+         (unsigned long long)paths_terminated_throughput,
+         (unsigned long long)paths_terminated_roulette,
+         (unsigned long long)paths_terminated_budget);
+
+  printf("Camera rays: %llu (%.2f per pixel), %llu of %llu pixels refined, "
+         "%llu reused from the G-buffer\n",
+         (unsigned long long)camera_rays,
+         pixels != 0 ? (double)camera_rays / pixels : 0.0,
+         (unsigned long long)pixels_refined,
+         (unsigned long long)pixels,
+         (unsigned long long)pixels_reused);
+
+  printf("Temporal reprojection: %llu pixels reused, %.1f%% shaded\n",
+         (unsigned long long)pixels_reprojected,
+         pixels != 0 ? 100.0 * (pixels - pixels_reprojected) / pixels : 0.0);
 }
 
 void WorkChunk::SerializeInput(std::vector<uint8_t> *bytes) {
@@ -329,7 +1151,30 @@ void WorkChunk::SerializeInput(std::vector<uint8_t> *bytes) {
   memcpy(ptr, &u_chunk_x, sizeof(uint32_t)); ptr += sizeof(uint32_t);
   memcpy(ptr, &u_chunk_y, sizeof(uint32_t)); ptr += sizeof(uint32_t);
   memcpy(ptr, &u_chunk_width, sizeof(uint32_t)); ptr += sizeof(uint32_t);
-  memcpy(ptr, &u_chunk_height, sizeof(uint32_t)); 
+  memcpy(ptr, &u_chunk_height, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+
+  uint32_t u_use_light_tree = settings.use_light_tree ? 1 : 0;
+  memcpy(ptr, &u_use_light_tree, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(ptr, &settings.light_cull_threshold, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  memcpy(ptr, &settings.light_error_budget, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  memcpy(ptr, &settings.max_recursion_level, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+  memcpy(ptr, &settings.min_throughput, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  memcpy(ptr, &settings.roulette_threshold, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  memcpy(ptr, &settings.ray_budget_per_sample, sizeof(uint64_t));
+  ptr += sizeof(uint64_t);
+  memcpy(ptr, &settings.aa_grid, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+  memcpy(ptr, &settings.aa_color_threshold, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  memcpy(ptr, &settings.aa_depth_threshold, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  uint32_t u_output_format = (uint32_t)settings.output_format;
+  memcpy(ptr, &u_output_format, sizeof(uint32_t));
 }
 
 bool WorkChunk::DeserializeInput(const std::vector<uint8_t>& bytes) {
@@ -351,7 +1196,33 @@ bool WorkChunk::DeserializeInput(const std::vector<uint8_t>& bytes) {
   memcpy(&u_chunk_x, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
   memcpy(&u_chunk_y, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
   memcpy(&u_chunk_width, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
-  memcpy(&u_chunk_height, ptr, sizeof(uint32_t));
+  memcpy(&u_chunk_height, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+
+  uint32_t u_use_light_tree;
+  RenderSettings new_settings;
+  memcpy(&u_use_light_tree, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(&new_settings.light_cull_threshold, ptr, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  memcpy(&new_settings.light_error_budget, ptr, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  memcpy(&new_settings.max_recursion_level, ptr, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+  memcpy(&new_settings.min_throughput, ptr, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  memcpy(&new_settings.roulette_threshold, ptr, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  memcpy(&new_settings.ray_budget_per_sample, ptr, sizeof(uint64_t));
+  ptr += sizeof(uint64_t);
+  memcpy(&new_settings.aa_grid, ptr, sizeof(uint32_t));
+  ptr += sizeof(uint32_t);
+  memcpy(&new_settings.aa_color_threshold, ptr, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  memcpy(&new_settings.aa_depth_threshold, ptr, sizeof(V3D::basetype));
+  ptr += sizeof(V3D::basetype);
+  uint32_t u_output_format;
+  memcpy(&u_output_format, ptr, sizeof(uint32_t));
+  new_settings.use_light_tree = u_use_light_tree != 0;
+  new_settings.output_format = (PixelFormat)u_output_format;
 
   // A set of constraints.
   // TODO(gynvael): Break this up, add error messages. Here and everywhere else.
@@ -370,49 +1241,119 @@ bool WorkChunk::DeserializeInput(const std::vector<uint8_t>& bytes) {
     return false;
   }
 
+  // Note: The negated form also rejects NaNs.
+  if (!(new_settings.light_cull_threshold >= 0.0) ||
+      !(new_settings.light_error_budget >= 0.0) ||
+      !(new_settings.min_throughput >= 0.0) ||
+      !(new_settings.roulette_threshold >= 0.0) ||
+      !(new_settings.aa_color_threshold >= 0.0) ||
+      !(new_settings.aa_depth_threshold >= 0.0) ||
+      new_settings.max_recursion_level > 64 ||
+      new_settings.aa_grid > 8 ||
+      u_output_format > (uint32_t)PixelFormat::kRGBF16) {
+    return false;
+  }
+
   image_width = u_image_width;
   image_height = u_image_height;
   chunk_x = u_chunk_x;
   chunk_y = u_chunk_y;
   chunk_width = u_chunk_width;
   chunk_height = u_chunk_height;
+  settings = new_settings;
 
   return true;
 }
 
+static size_t GetSerializedPixelSize(PixelFormat format) {
+  switch (format) {
+    case PixelFormat::kRGB8: return 3;
+    case PixelFormat::kRGBF32: return 3 * sizeof(float);
+    case PixelFormat::kRGBF16: return 3 * sizeof(uint16_t);
+  }
+  return 0;
+}
+
 bool WorkChunk::SerializeOutput(std::vector<uint8_t> *bytes) {
-  if (output_bitmap.size() > std::numeric_limits<uint32_t>::max()) {
+  const std::vector<uint8_t> *bitmap = &output_bitmap;
+  std::vector<uint8_t> converted;
+
+  if (settings.output_format == PixelFormat::kRGBF32) {
+    converted.resize(output_hdr.size() * sizeof(float));
+    if (!output_hdr.empty()) {
+      memcpy(&converted[0], &output_hdr[0], converted.size());
+    }
+    bitmap = &converted;
+  } else if (settings.output_format == PixelFormat::kRGBF16) {
+    converted.resize(output_hdr.size() * sizeof(uint16_t));
+    for (size_t i = 0; i < output_hdr.size(); i++) {
+      const uint16_t h = FloatToHalf(output_hdr[i]);
+      memcpy(&converted[i * sizeof(uint16_t)], &h, sizeof(uint16_t));
+    }
+    bitmap = &converted;
+  }
+
+  if (bitmap->size() > std::numeric_limits<uint32_t>::max()) {
     fprintf(stderr, "error: too large WorkerChunk, cannot serialize\n");
     return false;
   }
 
-  uint32_t sz = output_bitmap.size();
+  uint32_t sz = bitmap->size();
 
   // TODO(gynvael): Make this sane.
   bytes->resize(sizeof(uint32_t) + sz);
   uint8_t *ptr = &(*bytes)[0];
   memcpy(ptr, &sz, sizeof(uint32_t)); ptr += sizeof(uint32_t);
-  memcpy(ptr, &output_bitmap[0], output_bitmap.size());
+  if (sz != 0) {
+    memcpy(ptr, &(*bitmap)[0], sz);
+  }
   return true;
 }
 
+const uint8_t *WorkChunk::GetSerializedOutputPixels(size_t *size) const {
+  if (settings.output_format == PixelFormat::kRGB8) {
+    *size = output_bitmap.size();
+    return output_bitmap.data();
+  }
+
+  if (settings.output_format == PixelFormat::kRGBF32) {
+    *size = output_hdr.size() * sizeof(float);
+    return (const uint8_t*)output_hdr.data();
+  }
+
+  return nullptr;
+}
+
 bool WorkChunk::DeserializeOutput(const std::vector<uint8_t>& bytes) {
-  if (bytes.size() < kSerializedOutputMinimumSize) {
+  return DeserializeOutput(bytes.data(), bytes.size());
+}
+
+bool WorkChunk::DeserializeOutput(const uint8_t *bytes, size_t size) {
+  if (size < kSerializedOutputMinimumSize) {
     return false;
   }
 
   // TODO(gynvael): Make this sane.
-  const uint8_t *ptr = &bytes[0];
+  const uint8_t *ptr = bytes;
 
   uint32_t sz;
   memcpy(&sz, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
 
+  if (size - kSerializedOutputMinimumSize != sz) {
+    return false;
+  }
+
+  const size_t pixel_sz = GetSerializedPixelSize(settings.output_format);
+  if (pixel_sz == 0) {
+    return false;
+  }
+
   uint64_t partial_chunk_sz = (uint64_t)chunk_width * (uint64_t)chunk_height;
-  if (sz / 3 != partial_chunk_sz || sz % 3 != 0) {
+  if (sz / pixel_sz != partial_chunk_sz || sz % pixel_sz != 0) {
     return false;
   }
 
-  uint64_t chunk_sz = partial_chunk_sz * 3;
+  uint64_t chunk_sz = partial_chunk_sz * pixel_sz;
   // TODO(gynvael): This check is probably redundant. Remove if so.
   if (chunk_sz != sz) {
     return false;
@@ -422,8 +1363,27 @@ bool WorkChunk::DeserializeOutput(const std::vector<uint8_t>& bytes) {
     return false;
   }
 
-  output_bitmap.resize(chunk_sz);
-  memcpy(&output_bitmap[0], ptr, chunk_sz);
+  const size_t value_count = partial_chunk_sz * 3;
+  switch (settings.output_format) {
+    case PixelFormat::kRGB8:
+      output_bitmap.resize(chunk_sz);
+      memcpy(&output_bitmap[0], ptr, chunk_sz);
+      break;
+
+    case PixelFormat::kRGBF32:
+      output_hdr.resize(value_count);
+      memcpy(&output_hdr[0], ptr, chunk_sz);
+      break;
+
+    case PixelFormat::kRGBF16:
+      output_hdr.resize(value_count);
+      for (size_t i = 0; i < value_count; i++) {
+        uint16_t h;
+        memcpy(&h, ptr + i * sizeof(uint16_t), sizeof(uint16_t));
+        output_hdr[i] = HalfToFloat(h);
+      }
+      break;
+  }
 
   return true;
 }
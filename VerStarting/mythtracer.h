@@ -1,20 +1,172 @@
 #pragma once
+#include <atomic>
+#include <functional>
 #include <vector>
 #include <stdint.h>
 #include "camera.h"
+#include "light_tree.h"
 #include "objreader.h"
 #include "octtree.h"
+#include "tonemap.h"
 
 namespace raytracer {
 using math3d::V3D;
 
 const int MAX_RECURSION_LEVEL = 5;
 
+// Formats in which WorkChunk output is produced and transferred.
+enum class PixelFormat : uint32_t {
+  kRGB8 = 0,    // Clamped to 0-1 and quantized, in WorkChunk::output_bitmap.
+  kRGBF32 = 1,  // Linear floats, in WorkChunk::output_hdr.
+  kRGBF16 = 2,  // Like kRGBF32, but sent over the network as half-floats.
+};
+
+// Quality vs performance knobs of a render.
+struct RenderSettings {
+  // Use the light hierarchy to select the lights for each shaded point instead
+  // of going through all of them.
+  bool use_light_tree = true;
+
+  // Lights which (even in the best case) would change the color of the pixel
+  // by less than this are considered without casting any shadow rays. The
+  // default is half of the 8-bit color quantization step.
+  V3D::basetype light_cull_threshold = 1.0 / 512.0;
+
+  // How much light in total may be dropped at a single shaded point by
+  // skipping dim lights altogether (only with the light tree). Zero means
+  // exact lighting; higher values trade quality for speed in scenes with many
+  // lights.
+  V3D::basetype light_error_budget = 0.0;
+
+  // Reflected and refracted rays are not traced deeper than this.
+  uint32_t max_recursion_level = MAX_RECURSION_LEVEL;
+
+  // Reflected and refracted rays are not traced if their contribution to the
+  // pixel (i.e. the product of reflectance/transparency coefficients along the
+  // path) would be below this.
+  V3D::basetype min_throughput = 0.01;
+
+  // Russian roulette. Paths with contribution below this threshold are
+  // randomly terminated, and the surviving ones are boosted so that on
+  // average the result stays the same. Zero disables the roulette.
+  V3D::basetype roulette_threshold = 0.0;
+
+  // Maximum number of reflected/refracted rays traced for a single camera
+  // sample. Once used up, only shadow rays are traced for the sample. It's
+  // counted per sample, so the image doesn't depend on thread timing or on
+  // how the frame is split. Zero means no limit.
+  uint64_t ray_budget_per_sample = 0;
+
+  // Adaptive anti-aliasing. Each pixel first gets a single sample in its
+  // middle; pixels which differ from any of their neighbors (in color,
+  // material or depth) then get aa_grid x aa_grid additional stratified
+  // samples. 0 or 1 disables anti-aliasing (one sample at the pixel corner).
+  uint32_t aa_grid = 0;
+  V3D::basetype aa_color_threshold = 0.1;  // Per color channel.
+  V3D::basetype aa_depth_threshold = 0.05;  // Relative to the distance.
+
+  // Float formats keep the unclamped pixel values, so that the output can be
+  // accumulated, blended or re-exposed before tone mapping (see tonemap.h).
+  PixelFormat output_format = PixelFormat::kRGB8;
+
+  // Keep the camera ray hits of the rendered chunk in a G-buffer, and if the
+  // next chunk has the same camera, resolution and position, only shade them
+  // again instead of tracing the camera rays. This is meant for iterating on
+  // lighting: anything in the scene apart from the lights changing requires
+  // calling MythTracer::InvalidatePrimaryHits. Not used with adaptive
+  // anti-aliasing. Note: Not serialized, as it's local to the MythTracer.
+  bool reuse_primary_hits = false;
+
+  // Temporal reprojection, for animations in which only the camera moves.
+  // Camera rays are still traced, but a pixel hitting the same primitive at
+  // (nearly) the same point as a pixel of the previous frame reuses its
+  // lighting instead of being shaded again. Pixels with view-dependent
+  // materials (specular, reflective or transparent) are always shaded. To
+  // bound the error, a rotating 1/reprojection_refresh_period of the pixels
+  // is shaded anyway in each frame, and no lighting is reused for more than
+  // twice that many frames. Like reuse_primary_hits it requires calling
+  // MythTracer::InvalidatePrimaryHits when the scene changes, it's not used
+  // with adaptive anti-aliasing and not serialized. Off by default, as it's
+  // lossy (e.g. moving shadow edges lag behind); meant for previews.
+  bool temporal_reprojection = false;
+  uint32_t reprojection_refresh_period = 16;
+};
+
 struct PerPixelDebugInfo { 
   int line_no;
   V3D point;
 };
 
+// The part of shading a ray-surface intersection which doesn't depend on the
+// lights.
+struct SurfaceHit {
+  const Primitive *primitive = nullptr;  // nullptr if the ray hit nothing.
+  V3D point;
+  V3D normal;  // Facing the ray origin.
+  V3D::basetype normal_ray_dot = 0.0;
+  V3D surface_color;  // Material's ambient color with the texture applied.
+  V3D::basetype cone_width = 0.0;  // Pixel footprint at the point.
+};
+
+// Counters gathered while rendering.
+struct RenderStats {
+  uint64_t shadow_rays = 0;  // Number of shadow rays actually cast.
+  uint64_t lights_culled_facing = 0;  // Light was behind the surface.
+  uint64_t lights_culled_contribution = 0;  // Shadow would be invisible.
+  uint64_t lights_dropped = 0;  // Light tree error budget.
+  uint64_t occluder_cache_hits = 0;  // Shadow found without tree traversal.
+  uint64_t occluder_cache_misses = 0;
+  uint64_t secondary_rays = 0;  // Reflected and refracted rays.
+  uint64_t paths_terminated_throughput = 0;
+  uint64_t paths_terminated_roulette = 0;
+  uint64_t paths_terminated_budget = 0;
+  uint64_t pixels = 0;
+  uint64_t pixels_refined = 0;  // Adaptive anti-aliasing.
+  uint64_t camera_rays = 0;
+  uint64_t pixels_reused = 0;  // Shaded from the G-buffer.
+  uint64_t pixels_reprojected = 0;  // Lighting taken from the last frame.
+
+  void Add(const RenderStats& other);
+  void Print() const;
+};
+
+// State private to a single rendering thread.
+struct TraceContext {
+  const RenderSettings *settings;
+  RenderStats stats;
+  LightSelection selected_lights;  // Scratch space for light selection.
+
+  // The last opaque primitive found to shadow a given light (indexed the same
+  // way as scene lights). Neighboring pixels are usually shadowed by the same
+  // primitive, so it's worth testing it before doing a full tree traversal.
+  std::vector<const Primitive*> last_occluder;
+
+  // Secondary rays traced for the current camera sample (see
+  // RenderSettings::ray_budget_per_sample).
+  uint64_t sample_secondary_rays = 0;
+
+  // Random numbers for Russian roulette. The generator is re-seeded for each
+  // pixel, so the image doesn't depend on how the work was split.
+  uint32_t random_state = 0;
+
+  // Called before tracing each camera sample. Seeds the generator and resets
+  // the ray budget.
+  void StartSample(int x, int y, int pass = 0);
+  V3D::basetype Random();  // Returns a number in the [0, 1) range.
+
+  // What the last traced camera ray hit (nullptr if nothing).
+  const Primitive *primary_primitive = nullptr;
+  V3D::basetype primary_distance = 0.0;
+
+  // If set, the surface hit by the next camera ray is stored there.
+  SurfaceHit *record_primary_hit = nullptr;
+
+  // Angle (in radians) covered by a single pixel. The width of a ray cone
+  // (i.e. how big is the pixel at the given distance) grows by this much per
+  // unit of distance travelled; this is used to select texture mip levels.
+  V3D::basetype pixel_spread_angle = 0.0;
+};
+
 class WorkChunk {
  public:
   // Input.
@@ -22,6 +174,7 @@ class WorkChunk {
   int chunk_x, chunk_y;
   int chunk_width, chunk_height;
   Camera camera;
+  RenderSettings settings;
 
   // Note: Camera is not being serialized/deserialized.
   // TODO(gynvael): Mabe change this? It's somewhat weird.
@@ -31,51 +184,226 @@ class WorkChunk {
     /* chunk_x */      sizeof(uint32_t) +
     /* chunk_y */      sizeof(uint32_t) +    
     /* chunk_width */  sizeof(uint32_t) +
-    /* chunk_height */ sizeof(uint32_t);
+    /* chunk_height */ sizeof(uint32_t) +
+    /* settings.use_light_tree */       sizeof(uint32_t) +
+    /* settings.light_cull_threshold */ sizeof(V3D::basetype) +
+    /* settings.light_error_budget */   sizeof(V3D::basetype) +
+    /* settings.max_recursion_level */  sizeof(uint32_t) +
+    /* settings.min_throughput */       sizeof(V3D::basetype) +
+    /* settings.roulette_threshold */   sizeof(V3D::basetype) +
+    /* settings.ray_budget_per_sample */ sizeof(uint64_t) +
+    /* settings.aa_grid */              sizeof(uint32_t) +
+    /* settings.aa_color_threshold */   sizeof(V3D::basetype) +
+    /* settings.aa_depth_threshold */   sizeof(V3D::basetype) +
+    /* settings.output_format */        sizeof(uint32_t);
 
   void SerializeInput(std::vector<uint8_t> *bytes);
   bool DeserializeInput(const std::vector<uint8_t>& bytes);
 
-  // Output.
+  // Output. Depending on settings.output_format either output_bitmap (3 bytes
+  // per pixel) or output_hdr (3 floats per pixel) is filled in.
   std::vector<uint8_t> output_bitmap;
+  std::vector<float> output_hdr;
   std::vector<PerPixelDebugInfo> output_debug;
+  RenderStats output_stats;  // Note: Not serialized.
+
+  // Number of samples taken for each pixel. Like output_debug, this is
+  // filled in only if it was resized to chunk_width * chunk_height before
+  // rendering, and it's not serialized.
+  std::vector<uint8_t> output_sample_count;
 
   // TODO(gynvael): Add PerPixelDebugInfo serialization.
   static const size_t kSerializedOutputMinimumSize = 
     /* number of bytes */ sizeof(uint32_t);
-    /* followed by said amount of bytes */
+    /* followed by said amount of bytes, in settings.output_format */
 
   // Note: To deserialize WorkChunk output please be sure to fill in the
-  // chunk_width and chunk_height fields.
+  // chunk_width, chunk_height and settings.output_format fields.
   bool SerializeOutput(std::vector<uint8_t> *bytes);
   bool DeserializeOutput(const std::vector<uint8_t>& bytes);  
+  bool DeserializeOutput(const uint8_t *bytes, size_t size);
 
+  // Returns the pixel bytes exactly as SerializeOutput would put them after
+  // the byte count, if the output format needs no conversion (8-bit and
+  // 32-bit floats), or nullptr otherwise. Lets the output be sent without
+  // copying it first.
+  const uint8_t *GetSerializedOutputPixels(size_t *size) const;
+
+};
+
+// Camera ray hits of a chunk (see RenderSettings::reuse_primary_hits).
+struct GBuffer {
+  // What the hits were traced for.
+  int image_width = 0, image_height = 0;
+  int chunk_x = 0, chunk_y = 0;
+  int chunk_width = 0, chunk_height = 0;
+  Camera camera{};
+
+  std::vector<SurfaceHit> hits;  // Empty if there is nothing to reuse.
+
+  bool Matches(const WorkChunk& chunk) const;
+};
+
+// Shaded camera ray hits of the previous frame (see
+// RenderSettings::temporal_reprojection).
+struct FrameHistory {
+  int image_width = 0, image_height = 0;
+  int chunk_x = 0, chunk_y = 0;
+  int chunk_width = 0, chunk_height = 0;
+  Camera camera{};
+  uint32_t frame = 0;  // Selects the pixels which are always shaded.
+
+  struct Sample {
+    const Primitive *primitive = nullptr;  // nullptr if not reusable.
+    V3D point;
+    V3D lighting;  // Shaded color divided by the surface color.
+    uint32_t age = 0;  // Frames since the lighting was calculated.
+  };
+  std::vector<Sample> samples;  // Empty if there is nothing to reuse.
+
+  // Returns the sample of the pixel closest to where the point was seen in
+  // the previous frame, provided it's a reusable sample of the same spot.
+  const Sample *Find(
+      const Camera::Sensor& sensor, const Primitive *primitive,
+      const V3D& point, V3D::basetype tolerance) const;
 };
 
 class MythTracer {
  public:
   Scene *GetScene();
 
+  // Drops the G-buffer and the previous frame kept for reprojection (see
+  // RenderSettings::reuse_primary_hits and temporal_reprojection). Needs to
+  // be called after changing the geometry, materials or textures of the
+  // scene (and the lights, in case of reprojection).
+  void InvalidatePrimaryHits();
+
   bool LoadObj(const char *fname);
 
+  // Float output formats are tone mapped with the default ToneMapSettings.
   bool RayTrace(
       int image_width, int image_height, 
       Camera *camera,
-      std::vector<uint8_t> *output_bitmap);
+      std::vector<uint8_t> *output_bitmap,
+      const RenderSettings& settings = RenderSettings{});
   
   bool RayTrace(WorkChunk *chunk);
 
+  // Renders the image in a few interleaved passes, the first one tracing only
+  // every 16th pixel (drawn as 4x4 blocks), so that a coarse preview is
+  // available early and gets refined as rendering goes. on_pass is called
+  // from the calling thread after each pass, with output_bitmap containing
+  // the whole image at the current quality. Rendering stops as soon as
+  // *cancel becomes true (e.g. when the camera moved), in which case false
+  // is returned.
+  // Note: Adaptive anti-aliasing is not used in this mode and the output is
+  // always 8-bit, regardless of settings.output_format. With temporal
+  // reprojection, a cancelled frame keeps only the pixels traced so far as
+  // the previous frame.
+  static const int kProgressivePassCount = 5;
+  bool RayTraceProgressive(
+      int image_width, int image_height,
+      Camera *camera,
+      std::vector<uint8_t> *output_bitmap,
+      const std::function<void(int pass)>& on_pass,
+      const std::atomic<bool> *cancel,
+      const RenderSettings& settings = RenderSettings{});
+
  private:
   Scene scene;
   bool was_scene_finalized = false;
 
+  // Rebuilt at the beginning of each render, as lights might have changed.
+  LightTree light_tree;
+  std::vector<size_t> all_lights;
+
+  GBuffer gbuffer;
+  FrameHistory history;
+
+  // Finalizes the scene and rebuilds the light data.
+  void PrepareRender();
+
   V3D TraceRayWorker(
       const Ray& ray, int level,
       bool in_object,  // Used in transparency.
+      V3D::basetype current_reflection_coef,  // Contribution to the pixel.
+      V3D::basetype cone_width,  // Pixel footprint at the ray origin.
+      TraceContext *ctx,
+      PerPixelDebugInfo *debug);
+
+  // The two halves of TraceRayWorker. The first one finds everything about the
+  // intersection that doesn't depend on the lights, the second one does the
+  // lighting and traces the secondary rays.
+  void ResolveHit(
+      const Ray& ray, const Primitive *primitive,
+      const V3D& intersection_point, V3D::basetype intersection_distance,
+      V3D::basetype cone_width, TraceContext *ctx, SurfaceHit *hit);
+  V3D ShadeHit(
+      const Ray& ray, const SurfaceHit& hit, int level,
+      bool in_object,
       V3D::basetype current_reflection_coef,
+      TraceContext *ctx);
+
+  V3D TraceRay(const Ray& ray, TraceContext *ctx, PerPixelDebugInfo *debug);
+
+  // Same as TraceRay, but for a camera ray which hit was already resolved.
+  V3D ShadeStoredHit(
+      const Ray& ray, const SurfaceHit& hit, TraceContext *ctx,
       PerPixelDebugInfo *debug);
-  V3D TraceRay(const Ray& ray, PerPixelDebugInfo *debug);
+
+  void InitTraceContext(
+      TraceContext *ctx, WorkChunk *chunk);
+
+  // One sample per pixel.
+  void RenderChunk(
+      WorkChunk *chunk, const Camera::Sensor& sensor);
+
+  // One sample per pixel, with temporal reprojection (see
+  // RenderSettings::temporal_reprojection).
+  void RenderChunkReprojected(
+      WorkChunk *chunk, const Camera::Sensor& sensor);
+
+  // The previous frame while a new one is rendered with temporal
+  // reprojection.
+  struct Reprojection {
+    FrameHistory prev;
+    Camera::Sensor prev_sensor;
+    uint32_t refresh_period;
+    uint32_t max_age;
+  };
+
+  // Moves the frame history to reprojection and starts a new frame for the
+  // chunk.
+  void StartReprojectedFrame(
+      const WorkChunk& chunk, Reprojection *reprojection);
+
+  // Traces the camera ray of the pixel (idx within the chunk) and shades it,
+  // or reuses the lighting of the previous frame. The sample is stored in
+  // the history of the new frame.
+  V3D TracePixelReprojected(
+      const Reprojection& reprojection, const Ray& ray, int x, int y,
+      size_t idx, TraceContext *ctx, PerPixelDebugInfo *debug);
+
+  // Adaptive anti-aliasing (see RenderSettings::aa_grid).
+  void RenderChunkAdaptive(
+      WorkChunk *chunk, const Camera::Sensor& sensor);
+
+  // Casts shadow ray(s) between the point and the light, passing through any
+  // transparent surfaces on the way. Returns the power of the light reaching
+  // the point and sets in_shadow if the light was fully blocked.
+  // Decides whether a reflected or refracted ray, which would contribute to
+  // the pixel with the given weight, should be traced. Returns the
+  // probability with which the path survived (its contribution needs to be
+  // divided by it), or 0 if it was terminated.
+  V3D::basetype ContinuePath(V3D::basetype weight, TraceContext *ctx);
+
+  V3D GetLightPower(
+      const V3D& point, const V3D& light_direction, size_t light_idx,
+      TraceContext *ctx, bool *in_shadow);
   void V3DtoRGB(const V3D& v, uint8_t rgb[3]);
+
+  // Writes the pixel (index within the chunk) in the chunk's output format.
+  void StorePixel(WorkChunk *chunk, size_t idx, const V3D& color);
 };
 
 }  // namespace raytracer
@@ -1,3 +1,8 @@
+#include <errno.h>
+#include <string.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cmath>
 #include <limits>
 #include <memory>
 #include "network.h"
@@ -5,20 +10,157 @@
 namespace raytracer {
 namespace netproto {
 
-WorkerReady* WorkerReady::Make(const std::string &sender_id) {
+// Payload: uint32_t features, uint32_t cores, uint64_t memory, float
+// benchmark score, uint32_t count, followed by the uint64_t hashes.
+static const size_t kReadyHeaderSize =
+    sizeof(uint32_t) * 2 + sizeof(uint64_t) + sizeof(float) +
+    sizeof(uint32_t);
+
+WorkerReady* WorkerReady::Make(const std::string &sender_id, uint32_t features,
+                               const WorkerCapabilities& capabilities,
+                               const std::vector<uint64_t>& cached_scenes) {
   auto packet = std::make_unique<WorkerReady>();
   packet->id = sender_id;
+
+  const uint32_t count = cached_scenes.size();
+  packet->bytes.resize(kReadyHeaderSize + count * sizeof(uint64_t));
+  uint8_t *ptr = &packet->bytes[0];
+  memcpy(ptr, &features, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(ptr, &capabilities.cores, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(ptr, &capabilities.memory, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+  memcpy(ptr, &capabilities.benchmark_score, sizeof(float));
+  ptr += sizeof(float);
+  memcpy(ptr, &count, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  if (count != 0) {
+    memcpy(ptr, &cached_scenes[0], count * sizeof(uint64_t));
+  }
   return packet.release();
 }
 
-MasterScene* MasterScene::Make(
-    const std::string &destination_id, Scene *) {
-  // TODO(gynvael): Add proper scene support.
+bool WorkerReady::Parse(
+    uint32_t *features, WorkerCapabilities *capabilities,
+    std::vector<uint64_t> *cached_scenes) const {
+  if (bytes.size() < kReadyHeaderSize) {
+    return false;
+  }
+
+  uint32_t count;
+  const uint8_t *ptr = &bytes[0];
+  memcpy(features, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(&capabilities->cores, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(&capabilities->memory, ptr, sizeof(uint64_t));
+  ptr += sizeof(uint64_t);
+  memcpy(&capabilities->benchmark_score, ptr, sizeof(float));
+  ptr += sizeof(float);
+  memcpy(&count, ptr, sizeof(uint32_t));
+  const float score = capabilities->benchmark_score;
+  if (!(score >= 0.0f && score <= std::numeric_limits<float>::max())) {
+    capabilities->benchmark_score = 0.0f;  // NaN, infinite or negative.
+  }
+
+  if (bytes.size() != kReadyHeaderSize + (size_t)count * sizeof(uint64_t)) {
+    return false;
+  }
+
+  cached_scenes->resize(count);
+  if (count != 0) {
+    memcpy(&(*cached_scenes)[0], &bytes[kReadyHeaderSize],
+           count * sizeof(uint64_t));
+  }
+  return true;
+}
+
+// Scenes bigger than this are refused, so that a broken packet doesn't make
+// the worker allocate whatever the size field says.
+static const uint64_t kMaxSceneSize = 1ULL << 31;
+
+// FNV-1a.
+uint64_t MasterScene::Hash(const std::vector<uint8_t>& scene) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (uint8_t b : scene) {
+    h ^= b;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+bool MasterScene::Pack(
+    const std::vector<uint8_t>& scene, PackedScene *packed) {
+  if (scene.size() > kMaxSceneSize) {
+    return false;
+  }
+
+  uLongf compressed_size = compressBound(scene.size());
+  packed->data.resize(compressed_size);
+  if (compress2(&packed->data[0], &compressed_size,
+                scene.data(), scene.size(), Z_DEFAULT_COMPRESSION) != Z_OK) {
+    return false;
+  }
+
+  packed->data.resize(compressed_size);
+  packed->hash = Hash(scene);
+  packed->size = scene.size();
+  return true;
+}
+
+// Payload: uint64_t hash, uint64_t uncompressed size, uint32_t whether the
+// data is included, followed by the compressed data (if included).
+static const size_t kSceneHeaderSize =
+    sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint32_t);
+
+MasterScene* MasterScene::Make(const std::string &destination_id,
+                               const PackedScene& scene, bool include_data) {
   auto packet = std::make_unique<MasterScene>();
   packet->id = destination_id;
+
+  const uint32_t included = include_data ? 1 : 0;
+  packet->bytes.resize(kSceneHeaderSize);
+  uint8_t *ptr = &packet->bytes[0];
+  memcpy(ptr, &scene.hash, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+  memcpy(ptr, &scene.size, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+  memcpy(ptr, &included, sizeof(uint32_t));
+
+  // All the workers are sent the same data.
+  if (include_data) {
+    packet->tail = scene.data.data();
+    packet->tail_size = scene.data.size();
+  }
   return packet.release();
 }
 
+bool MasterScene::Unpack(uint64_t *hash, std::vector<uint8_t> *scene) const {
+  if (bytes.size() < kSceneHeaderSize) {
+    return false;
+  }
+
+  uint64_t size;
+  uint32_t included;
+  const uint8_t *ptr = &bytes[0];
+  memcpy(hash, ptr, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+  memcpy(&size, ptr, sizeof(uint64_t)); ptr += sizeof(uint64_t);
+  memcpy(&included, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+
+  scene->clear();
+  if (!included) {
+    return bytes.size() == kSceneHeaderSize;
+  }
+
+  if (size == 0 || size > kMaxSceneSize) {
+    return false;
+  }
+
+  scene->resize(size);
+  uLongf uncompressed_size = size;
+  if (uncompress(&(*scene)[0], &uncompressed_size,
+                 ptr, bytes.size() - kSceneHeaderSize) != Z_OK ||
+      uncompressed_size != size || Hash(*scene) != *hash) {
+    scene->clear();
+    return false;
+  }
+
+  return true;
+}
+
 MasterSetCamera* MasterSetCamera::Make(
     const std::string &destination_id, Camera *camera) {
   auto packet = std::make_unique<MasterSetCamera>();
@@ -27,59 +169,283 @@ MasterSetCamera* MasterSetCamera::Make(
   return packet.release();
 }
 
+// Payload: serialized WorkChunk input, followed by uint32_t result encoding
+// and uint32_t chunk ID.
 MasterRenderOrder* MasterRenderOrder::Make(
-    const std::string &destination_id, WorkChunk *chunk) {
+    const std::string &destination_id, WorkChunk *chunk, uint32_t chunk_id,
+    PixelEncoding result_encoding) {
   auto packet = std::make_unique<MasterRenderOrder>();
   packet->id = destination_id;
   chunk->SerializeInput(&packet->bytes);
+
+  const uint32_t encoding = (uint32_t)result_encoding;
+  const uint8_t *ptr = (const uint8_t*)&encoding;
+  packet->bytes.insert(packet->bytes.end(), ptr, ptr + sizeof(uint32_t));
+  ptr = (const uint8_t*)&chunk_id;
+  packet->bytes.insert(packet->bytes.end(), ptr, ptr + sizeof(uint32_t));
   return packet.release();
 }
 
+bool MasterRenderOrder::Parse(
+    WorkChunk *chunk, uint32_t *chunk_id,
+    PixelEncoding *result_encoding) const {
+  if (bytes.size() != WorkChunk::kSerializedInputSize + sizeof(uint32_t) * 2) {
+    return false;
+  }
+
+  const std::vector<uint8_t> input(
+      bytes.begin(), bytes.begin() + WorkChunk::kSerializedInputSize);
+  if (!chunk->DeserializeInput(input)) {
+    return false;
+  }
+
+  uint32_t encoding;
+  memcpy(&encoding, &bytes[WorkChunk::kSerializedInputSize], sizeof(uint32_t));
+  if (encoding > (uint32_t)PixelEncoding::kDeltaDeflate) {
+    return false;
+  }
+
+  *result_encoding = (PixelEncoding)encoding;
+  memcpy(chunk_id, &bytes[WorkChunk::kSerializedInputSize + sizeof(uint32_t)],
+         sizeof(uint32_t));
+  return true;
+}
+
+// Payload: uint32_t chunk ID.
+MasterCancelOrder* MasterCancelOrder::Make(
+    const std::string &destination_id, uint32_t chunk_id) {
+  auto packet = std::make_unique<MasterCancelOrder>();
+  packet->id = destination_id;
+  packet->bytes.resize(sizeof(uint32_t));
+  memcpy(&packet->bytes[0], &chunk_id, sizeof(uint32_t));
+  return packet.release();
+}
+
+bool MasterCancelOrder::Parse(uint32_t *chunk_id) const {
+  if (bytes.size() != sizeof(uint32_t)) {
+    return false;
+  }
+
+  memcpy(chunk_id, &bytes[0], sizeof(uint32_t));
+  return true;
+}
+
+// Payload: uint32_t chunk ID, float render time, uint32_t encoding, uint32_t
+// raw size, uint32_t delta stride (i.e. bytes per pixel), followed by
+// WorkChunk::SerializeOutput data in the given encoding.
+static const size_t kResultHeaderSize = sizeof(uint32_t) * 4 + sizeof(float);
+
+// Like kMaxSceneSize, but for decoded results.
+static const uint32_t kMaxResultSize = 16 * 1024 * 1024;
+
 WorkerRenderResult* WorkerRenderResult::Make(
-    const std::string &sender_id, WorkChunk *chunk) {
+    const std::string &sender_id, WorkChunk *chunk, uint32_t chunk_id,
+    float render_time, PixelEncoding encoding, size_t *raw_size) {
   auto packet = std::make_unique<WorkerRenderResult>();
   packet->id = sender_id;
-  if (!chunk->SerializeOutput(&packet->bytes)) {
+
+  // If possible, raw output is sent straight from the chunk, i.e. only the
+  // byte count which precedes it is put in the packet's bytes.
+  std::vector<uint8_t> raw;
+  size_t pixels_size = 0;
+  const uint8_t *pixels = encoding == PixelEncoding::kRaw ?
+      chunk->GetSerializedOutputPixels(&pixels_size) : nullptr;
+  if (pixels != nullptr) {
+    if (pixels_size > std::numeric_limits<uint32_t>::max()) {
+      return nullptr;
+    }
+
+    const uint32_t sz = pixels_size;
+    raw.resize(sizeof(uint32_t));
+    memcpy(&raw[0], &sz, sizeof(uint32_t));
+  } else if (!chunk->SerializeOutput(&raw)) {
     return nullptr;
   }
+
+  const size_t total_raw_size = raw.size() + pixels_size;
+  if (raw_size != nullptr) {
+    *raw_size = total_raw_size;
+  }
+
+  const size_t pixel_count = (size_t)chunk->chunk_width * chunk->chunk_height;
+  uint32_t stride = 1;
+  if (pixel_count != 0) {
+    stride = std::max<size_t>(
+        (total_raw_size - WorkChunk::kSerializedOutputMinimumSize) /
+            pixel_count,
+        1);
+  }
+
+  if (encoding == PixelEncoding::kDeltaDeflate) {
+    // Going backwards, so that the previous pixel is still unchanged.
+    for (size_t i = raw.size(); i-- > stride; ) {
+      raw[i] -= raw[i - stride];
+    }
+
+    uLongf compressed_size = compressBound(raw.size());
+    packet->bytes.resize(kResultHeaderSize + compressed_size);
+    if (compress2(&packet->bytes[kResultHeaderSize], &compressed_size,
+                  raw.data(), raw.size(), Z_BEST_SPEED) != Z_OK) {
+      return nullptr;
+    }
+    packet->bytes.resize(kResultHeaderSize + compressed_size);
+  } else {
+    packet->bytes.resize(kResultHeaderSize + raw.size());
+    memcpy(&packet->bytes[kResultHeaderSize], raw.data(), raw.size());
+    packet->tail = pixels;
+    packet->tail_size = pixels_size;
+  }
+
+  const uint32_t u_encoding = (uint32_t)encoding;
+  const uint32_t u_raw_size = total_raw_size;
+  uint8_t *ptr = &packet->bytes[0];
+  memcpy(ptr, &chunk_id, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(ptr, &render_time, sizeof(float)); ptr += sizeof(float);
+  memcpy(ptr, &u_encoding, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(ptr, &u_raw_size, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(ptr, &stride, sizeof(uint32_t));
   return packet.release();
 }
 
-// Helper functions.
+bool WorkerRenderResult::GetChunkId(uint32_t *chunk_id) const {
+  if (bytes.size() < kResultHeaderSize) {
+    return false;
+  }
 
-// TODO(gynvael): Neither serialization nor network helper functions respect the
-// LE setting. Add this everywhere.
+  memcpy(chunk_id, &bytes[0], sizeof(uint32_t));
+  return true;
+}
 
-bool SendPacket(NetSock *s, NetworkProto *packet) {
-  // Prepare packet.
-  packet->id.resize(8);
+bool WorkerRenderResult::GetRenderTime(float *render_time) const {
+  if (bytes.size() < kResultHeaderSize) {
+    return false;
+  }
+
+  memcpy(render_time, &bytes[sizeof(uint32_t)], sizeof(float));
+  return std::isfinite(*render_time) && *render_time >= 0.0f;
+}
 
-  // Send the wire format details.
-  if (s->WriteAll(packet->GetTag().c_str(), 4) != 4) {
+bool WorkerRenderResult::GetOutput(WorkChunk *chunk) const {
+  if (bytes.size() < kResultHeaderSize) {
     return false;
   }
 
-  if (s->WriteAll(packet->id.data(), 8) != 8) {
+  // Skip the chunk ID and the render time.
+  uint32_t encoding, raw_size, stride;
+  const uint8_t *ptr = &bytes[sizeof(uint32_t) + sizeof(float)];
+  memcpy(&encoding, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(&raw_size, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+  memcpy(&stride, ptr, sizeof(uint32_t)); ptr += sizeof(uint32_t);
+
+  if (encoding == (uint32_t)PixelEncoding::kRaw) {
+    return chunk->DeserializeOutput(ptr, bytes.size() - kResultHeaderSize);
+  }
+
+  if (encoding != (uint32_t)PixelEncoding::kDeltaDeflate ||
+      raw_size > kMaxResultSize || stride == 0) {
     return false;
   }
 
-  if (packet->bytes.size() > std::numeric_limits<uint32_t>::max()) {
-    // TODO(gynvael): Error message.
+  // Reused between calls, so that decoding doesn't allocate each time.
+  static thread_local std::vector<uint8_t> raw;
+  raw.resize(raw_size);
+  uLongf uncompressed_size = raw_size;
+  if (uncompress(raw.data(), &uncompressed_size,
+                 ptr, bytes.size() - kResultHeaderSize) != Z_OK ||
+      uncompressed_size != raw_size) {
     return false;
   }
 
-  uint32_t sz = packet->bytes.size();
+  for (size_t i = stride; i < raw.size(); i++) {
+    raw[i] += raw[i - stride];
+  }
 
-  if (s->WriteAll(&sz, 4) != 4) {
-    return false;
+  return chunk->DeserializeOutput(raw);
+}
+
+// Helper functions.
+
+namespace {
+
+const size_t kHeaderSize = 4 + 8 + 4;  // Tag, ID, length.
+
+// TODO(gynvael): Actually make a better check for PXLS later on.
+const uint32_t kMaxPayloadSize = 1024 * 1024;
+
+// Scenes are sent whole, so they get a much higher limit.
+const uint32_t kMaxScenePayloadSize = 512 * 1024 * 1024;
+
+uint32_t GetMaxPayloadSize(const std::string& tag) {
+  return tag == "SCNE" ? kMaxScenePayloadSize : kMaxPayloadSize;
+}
+
+NetworkProto* MakePacket(
+    kCommunicationSide side, const std::string& tag, std::string id,
+    std::vector<uint8_t> payload) {
+  NetworkProto *packet = nullptr;
+
+  if (side == kCommunicationSide::kMaster && tag == "RDY!") {
+    packet = new WorkerReady;
+  } else if (side == kCommunicationSide::kWorker && tag == "SCNE") {
+    packet = new MasterScene;
+  } else if (side == kCommunicationSide::kWorker && tag == "CAMR") {
+    packet = new MasterSetCamera;
+  } else if (side == kCommunicationSide::kWorker && tag == "WORK") {
+    packet = new MasterRenderOrder;
+  } else if (side == kCommunicationSide::kWorker && tag == "CNCL") {
+    packet = new MasterCancelOrder;
+  } else if (side == kCommunicationSide::kMaster && tag == "PXLS") {
+    packet = new WorkerRenderResult;
+  } else {
+    return nullptr;
   }
 
+  packet->id = std::move(id);
+  packet->bytes = std::move(payload);
+  return packet;
+}
+
+// Fills in the header of the wire format.
+void WriteHeader(NetworkProto *packet, uint8_t header[kHeaderSize]) {
+  packet->id.resize(8);
+  const uint32_t sz = packet->GetPayloadSize();
+  memcpy(header, packet->GetTag().c_str(), 4);
+  memcpy(header + 4, packet->id.data(), 8);
+  memcpy(header + 4 + 8, &sz, sizeof(uint32_t));
+}
+
+bool WouldBlock() {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+}  // namespace
+
+// TODO(gynvael): Neither serialization nor network helper functions respect the
+// LE setting. Add this everywhere.
+
+bool SendPacket(NetSock *s, NetworkProto *packet) {
   // TODO(gynvael): Change netsock to use sane types plz.
-  if ((uint32_t)s->WriteAll(&packet->bytes[0], sz) != sz) {
+  if (packet->GetPayloadSize() >
+      (size_t)std::numeric_limits<int>::max() - kHeaderSize) {
+    // TODO(gynvael): Error message.
     return false;
   }
 
-  return true;
+  // The header, the bytes and the tail all go out in a single system call
+  // (as long as the socket buffer has space for it).
+  uint8_t header[kHeaderSize];
+  WriteHeader(packet, header);
+
+  const void *buffers[] = { header, packet->bytes.data(), packet->tail };
+  const int sizes[] = {
+    (int)kHeaderSize, (int)packet->bytes.size(), (int)packet->tail_size
+  };
+  const int total = sizes[0] + sizes[1] + sizes[2];
+  return s->WriteAllV(buffers, sizes, 3) == total;
 }
 
 NetworkProto* ReceivePacket(NetSock *s, kCommunicationSide side) {
@@ -94,11 +460,8 @@ NetworkProto* ReceivePacket(NetSock *s, kCommunicationSide side) {
   uint32_t length;
   memcpy(&length, bytes + 4 + 8, sizeof(uint32_t));
 
-  // TODO(gynvael): Some early per-packed max size checks would be useful.
-
   // Sanity check.
-  // TODO(gynvael): Actually make a better check for SCNE and PXLS later on.
-  if (length > 1024 * 1024) {
+  if (length > GetMaxPayloadSize(tag)) {
     return nullptr;
   }
 
@@ -109,29 +472,137 @@ NetworkProto* ReceivePacket(NetSock *s, kCommunicationSide side) {
     return nullptr;
   }
 
-  NetworkProto *packet = nullptr;
+  // TODO(gynvael): Think about deserializing here.
+  return MakePacket(side, tag, std::move(id), std::move(payload));
+}
 
-  if (side == kCommunicationSide::kMaster && tag == "RDY!") {
-    packet = new WorkerReady;
-  } else if (side == kCommunicationSide::kWorker && tag == "SCNE") {
-    packet = new MasterScene;
-  } else if (side == kCommunicationSide::kWorker && tag == "CAMR") {
-    packet = new MasterSetCamera;
-  } else if (side == kCommunicationSide::kWorker && tag == "WORK") {
-    packet = new MasterRenderOrder;
-  } else if (side == kCommunicationSide::kMaster && tag == "PXLS") {
-    packet = new WorkerRenderResult;
-  } else {
-    return nullptr;
+bool PacketReader::ReadAvailable(NetSock *s) {
+  // The header is read separately, so that the payload can be read right
+  // into a buffer of the proper size.
+  while (!invalid) {
+    int ret;
+    if (header_received < kHeaderSize) {
+      ret = s->Read(header + header_received, kHeaderSize - header_received);
+      if (ret > 0) {
+        header_received += ret;
+        if (header_received == kHeaderSize && !StartPayload()) {
+          invalid = true;
+        }
+      }
+    } else {
+      ret = s->Read(&payload[payload_received],
+                    payload.size() - payload_received);
+      if (ret > 0) {
+        payload_received += ret;
+        if (payload_received == payload.size() && !FinishPacket()) {
+          invalid = true;
+        }
+      }
+    }
+
+    if (ret == 0) {
+      return false;  // Disconnected.
+    }
+
+    if (ret < 0) {
+      return WouldBlock();
+    }
   }
 
-  packet->id = std::move(id);
-  packet->bytes = std::move(payload);
+  return true;  // The error is reported by Next.
+}
 
-  // TODO(gynvael): Think about deserializing here.
+bool PacketReader::StartPayload() {
+  const std::string tag((const char*)header, 4);
+  uint32_t length;
+  memcpy(&length, header + 4 + 8, sizeof(uint32_t));
+  if (length > GetMaxPayloadSize(tag)) {
+    return false;
+  }
+
+  if (!free_buffers.empty()) {
+    payload = std::move(free_buffers.back());
+    free_buffers.pop_back();
+  }
+  payload.resize(length);
+  payload_received = 0;
+
+  return length != 0 || FinishPacket();
+}
+
+bool PacketReader::FinishPacket() {
+  NetworkProto *packet = MakePacket(
+      side, std::string((const char*)header, 4),
+      std::string((const char*)header + 4, 8), std::move(payload));
+  header_received = 0;
+  payload = std::vector<uint8_t>();
+  if (packet == nullptr) {
+    return false;
+  }
+
+  packets.emplace_back(packet);
+  return true;
+}
+
+NetworkProto* PacketReader::Next(bool *error) {
+  // Packets which arrived before any garbage are still returned.
+  *error = false;
+  if (packets.empty()) {
+    *error = invalid;
+    return nullptr;
+  }
+
+  NetworkProto *packet = packets.front().release();
+  packets.pop_front();
   return packet;
 }
 
+void PacketReader::Recycle(std::vector<uint8_t> *bytes) {
+  // A few are enough, as there are at most a few packets in flight.
+  const size_t kMaxFreeBuffers = 4;
+  if (free_buffers.size() < kMaxFreeBuffers && bytes->capacity() != 0) {
+    free_buffers.push_back(std::move(*bytes));
+  }
+  bytes->clear();
+}
+
+void PacketWriter::Queue(NetworkProto *packet) {
+  segments.emplace_back();
+  Segment& segment = segments.back();
+  segment.owned.resize(kHeaderSize + packet->bytes.size());
+  WriteHeader(packet, &segment.owned[0]);
+  if (!packet->bytes.empty()) {
+    memcpy(&segment.owned[kHeaderSize], &packet->bytes[0],
+           packet->bytes.size());
+  }
+  segment.data = segment.owned.data();
+  segment.size = segment.owned.size();
+
+  if (packet->tail_size != 0) {
+    segments.push_back({ {}, packet->tail, packet->tail_size });
+  }
+}
+
+bool PacketWriter::Flush(NetSock *s) {
+  while (!segments.empty()) {
+    const Segment& segment = segments.front();
+    const size_t left = std::min(
+        segment.size - sent, (size_t)std::numeric_limits<int>::max());
+    const int ret = s->Write(segment.data + sent, (int)left);
+    if (ret <= 0) {
+      return ret < 0 && WouldBlock();
+    }
+
+    sent += ret;
+    if (sent == segment.size) {
+      segments.pop_front();
+      sent = 0;
+    }
+  }
+
+  return true;
+}
+
 }  // namespace netproto
 }  // namespace raytracer
 
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdint.h>
+#include <deque>
 #include <memory>
 #include <vector>
 #include "NetSock/NetSock.h"
@@ -36,21 +37,84 @@ class NetworkProto {
   virtual std::string GetTag() const = 0;
   std::vector<uint8_t> bytes;
   std::string id;  // Sender/Destination ID.
+
+  // Sent right after bytes, without copying it into the packet first. The
+  // packet is not the owner of this data, so it must stay valid until the
+  // packet is sent. Received packets always have the whole payload in bytes.
+  const uint8_t *tail = nullptr;
+  size_t tail_size = 0;
+
+  size_t GetPayloadSize() const { return bytes.size() + tail_size; }
+};
+
+// Optional protocol features, announced by the worker in RDY!.
+enum WorkerFeatures : uint32_t {
+  kFeatureCompressedPixels = 1 << 0,  // Supports PixelEncoding::kDeltaDeflate.
 };
 
-// Worker->Master: Worker ready to receive the scene.
+// Encodings of the PXLS payload, requested by the master in WORK.
+enum class PixelEncoding : uint32_t {
+  kRaw = 0,
+
+  // Each byte has the same byte of the previous pixel subtracted (like PNG's
+  // Sub filter), which turns flat areas (e.g. the black background) into runs
+  // of zeros, and then it's deflated at the fastest level.
+  kDeltaDeflate = 1,
+};
+
+// What the worker's machine has to offer. The master uses it to decide how
+// much work to queue up for the worker until it measures the worker's actual
+// speed.
+struct WorkerCapabilities {
+  uint32_t cores = 0;  // Hardware threads.
+  uint64_t memory = 0;  // Physical memory in bytes, 0 if unknown.
+
+  // Millions of rays per second cast at a small test scene on all cores, 0
+  // if unknown. Only meaningful compared to the scores of other workers.
+  float benchmark_score = 0.0f;
+};
+
+// Worker->Master: Worker ready to receive the scene. Lists the features the
+// worker supports, its capabilities and the hashes of the scenes it has
+// cached (see MasterScene).
 class WorkerReady : public NetworkProto {
  public:
-  static WorkerReady* Make(const std::string &sender_id);
+  static WorkerReady* Make(const std::string &sender_id, uint32_t features,
+                           const WorkerCapabilities& capabilities,
+                           const std::vector<uint64_t>& cached_scenes);
+  bool Parse(uint32_t *features, WorkerCapabilities *capabilities,
+             std::vector<uint64_t> *cached_scenes) const;
+
   std::string GetTag() const override {
     return "RDY!";
   };
 };
 
-// Master->Worker: Serialized scene (primitives, textures, lights).
+// Master->Worker: Serialized scene (see Scene::Serialize), zlib compressed.
+// The scene data itself is left out if the worker has the scene cached.
 class MasterScene : public NetworkProto {
  public:
-  static MasterScene* Make(const std::string &destination_id, Scene *scene);
+  // Compressing the scene takes a while, so it's done once and the result is
+  // used for all the workers.
+  struct PackedScene {
+    uint64_t hash = 0;  // Of the uncompressed data, see Hash.
+    uint64_t size = 0;  // Uncompressed.
+    std::vector<uint8_t> data;  // Compressed.
+  };
+
+  static uint64_t Hash(const std::vector<uint8_t>& scene);
+  static bool Pack(const std::vector<uint8_t>& scene, PackedScene *packed);
+
+  // Note: The compressed data is not copied (see NetworkProto::tail), so the
+  // packed scene must outlive the packet.
+  static MasterScene* Make(const std::string &destination_id,
+                           const PackedScene& scene, bool include_data);
+
+  // Gets the scene hash and, if it was included, the uncompressed scene
+  // (otherwise *scene is left empty). Returns false if the data is broken,
+  // e.g. it doesn't match the hash.
+  bool Unpack(uint64_t *hash, std::vector<uint8_t> *scene) const;
+
   std::string GetTag() const override {
     return "SCNE";
   };
@@ -67,22 +131,58 @@ class MasterSetCamera : public NetworkProto {
   };
 };
 
-// Master->Worker: Serialized WorkChunk.
+// Master->Worker: Serialized WorkChunk, how to encode the result and the
+// chunk ID, which the master picks and the worker puts in the result. The same
+// chunk can be sent to several workers under the same ID (see
+// MasterCancelOrder).
 class MasterRenderOrder : public NetworkProto {
  public:
   static MasterRenderOrder* Make(
-      const std::string &destination_id, WorkChunk *chunk);
+      const std::string &destination_id, WorkChunk *chunk, uint32_t chunk_id,
+      PixelEncoding result_encoding = PixelEncoding::kRaw);
+  bool Parse(WorkChunk *chunk, uint32_t *chunk_id,
+             PixelEncoding *result_encoding) const;
   std::string GetTag() const override {
     return "WORK";
   };
 };
 
+// Master->Worker: The chunk with the given ID isn't needed anymore, as another
+// worker has sent it in first. If the worker has already started rendering
+// it, the results can still be sent (the master ignores them).
+class MasterCancelOrder : public NetworkProto {
+ public:
+  static MasterCancelOrder* Make(
+      const std::string &destination_id, uint32_t chunk_id);
+  bool Parse(uint32_t *chunk_id) const;
+  std::string GetTag() const override {
+    return "CNCL";
+  };
+};
+
 // Worker->Master: Bitmap and logs/stats.
 class WorkerRenderResult : public NetworkProto {
  public:
-  // Uses only the output_* part of WorkChunk.
+  // Uses only the output_* part of WorkChunk. The render time is how long
+  // the worker took to render the chunk, in seconds. If raw_size isn't
+  // nullptr, it receives the size of the output before encoding.
+  // Note: Raw 8-bit and 32-bit float output is not copied (see
+  // NetworkProto::tail), so the chunk must outlive the packet.
   static WorkerRenderResult* Make(
-      const std::string &sender_id, WorkChunk *chunk);
+      const std::string &sender_id, WorkChunk *chunk, uint32_t chunk_id,
+      float render_time, PixelEncoding encoding = PixelEncoding::kRaw,
+      size_t *raw_size = nullptr);
+
+  // The ID from MasterRenderOrder.
+  bool GetChunkId(uint32_t *chunk_id) const;
+
+  // The render time measured by the worker. Returns false if it's missing or
+  // not a valid time.
+  bool GetRenderTime(float *render_time) const;
+
+  // Decodes the payload into the output_* part of the chunk (see
+  // WorkChunk::DeserializeOutput for what needs to be filled in first).
+  bool GetOutput(WorkChunk *chunk) const;
 
   std::string GetTag() const override {
     return "PXLS";
@@ -92,6 +192,69 @@ class WorkerRenderResult : public NetworkProto {
 bool SendPacket(NetSock *s, NetworkProto *packet);
 NetworkProto* ReceivePacket(NetSock *s, kCommunicationSide side);
 
+// Counterparts of the above for non-blocking sockets (see
+// NetSock::ASYNCHRONIC), e.g. ones handled by an event loop.
+
+// Assembles packets out of whatever data arrives on the socket. Payloads are
+// received straight into the packets' bytes, i.e. they are never copied.
+class PacketReader {
+ public:
+  explicit PacketReader(kCommunicationSide side) : side(side) { }
+
+  // Reads all the data which is available without blocking. Returns false if
+  // the connection was closed or broken.
+  bool ReadAvailable(NetSock *s);
+
+  // Returns the next fully received packet (owned by the caller) or nullptr
+  // if there isn't one yet. Sets *error if the data isn't a valid packet, in
+  // which case the connection should be dropped.
+  NetworkProto* Next(bool *error);
+
+  // Takes the bytes of a handled packet back, so that the memory can be used
+  // for the next payloads instead of being allocated again.
+  void Recycle(std::vector<uint8_t> *bytes);
+
+ private:
+  // Called once the header, or the whole payload, is received.
+  bool StartPayload();
+  bool FinishPacket();
+
+  kCommunicationSide side;
+  uint8_t header[4 + 8 + 4];
+  size_t header_received = 0;
+  std::vector<uint8_t> payload;  // Sized according to the header.
+  size_t payload_received = 0;
+  bool invalid = false;  // Reading stops once garbage is received.
+
+  std::deque<std::unique_ptr<NetworkProto>> packets;  // Received in full.
+  std::vector<std::vector<uint8_t>> free_buffers;
+};
+
+// Buffers packets until they can be sent without blocking.
+class PacketWriter {
+ public:
+  // Copies the header and the bytes of the packet, but not its tail, which
+  // must stay valid until it's sent (see IsEmpty).
+  void Queue(NetworkProto *packet);
+
+  // Sends as much of the queued data as possible. Returns false if the
+  // connection was closed or broken.
+  bool Flush(NetSock *s);
+
+  bool IsEmpty() const { return segments.empty(); }
+
+ private:
+  // The queued data is a list of segments, so that queuing a packet doesn't
+  // move the data which is still waiting to be sent (e.g. a scene).
+  struct Segment {
+    std::vector<uint8_t> owned;  // Header and bytes of a packet.
+    const uint8_t *data;  // Either owned or a packet's tail.
+    size_t size;
+  };
+  std::deque<Segment> segments;
+  size_t sent = 0;  // Of the first segment.
+};
+
 }  // namespace netproto
 
 }  // namespace raytracer
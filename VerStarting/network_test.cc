@@ -0,0 +1,421 @@
+#include <stdint.h>
+#include <string.h>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "network.h"
+#include "test_helper.h"
+
+using namespace test;
+using namespace raytracer;
+using namespace raytracer::netproto;
+
+// Returns the packet the way the other side receives it, i.e. with the tail
+// (if any) as part of the bytes.
+template<typename T>
+static std::unique_ptr<T> Receive(const NetworkProto& sent) {
+  auto received = std::make_unique<T>();
+  received->id = sent.id;
+  received->bytes = sent.bytes;
+  if (sent.tail_size != 0) {
+    received->bytes.insert(received->bytes.end(),
+                           sent.tail, sent.tail + sent.tail_size);
+  }
+  return received;
+}
+
+// Where the encoding, raw size and delta stride fields of a PXLS payload
+// start (they follow the chunk ID and the render time).
+static const size_t kResultFieldsOffset = sizeof(uint32_t) + sizeof(float);
+
+static void PutU32(std::vector<uint8_t> *bytes, size_t offset, uint32_t v) {
+  memcpy(&(*bytes)[offset], &v, sizeof(uint32_t));
+}
+
+static void PutU64(std::vector<uint8_t> *bytes, size_t offset, uint64_t v) {
+  memcpy(&(*bytes)[offset], &v, sizeof(uint64_t));
+}
+
+// The receiving side fills in the size and format of the sent chunk before
+// decoding a result.
+static bool DecodeResult(const WorkerRenderResult& received,
+                         const WorkChunk& sent, WorkChunk *out) {
+  out->chunk_width = sent.chunk_width;
+  out->chunk_height = sent.chunk_height;
+  out->settings.output_format = sent.settings.output_format;
+  return received.GetOutput(out);
+}
+
+static void TestResultRoundTrip(PixelFormat format, PixelEncoding encoding,
+                                size_t pixel_size, int width, int height) {
+  WorkChunk chunk{};
+  chunk.chunk_width = width;
+  chunk.chunk_height = height;
+  chunk.settings.output_format = format;
+  const size_t value_count = (size_t)width * height * 3;
+
+  // Flat runs (which the delta filter turns into zeros) mixed with noise.
+  for (size_t i = 0; i < value_count; i++) {
+    const bool flat = (i / 17) % 3 == 1;
+    if (format == PixelFormat::kRGB8) {
+      chunk.output_bitmap.push_back(flat ? 0 : (uint8_t)(i * 37 + 11));
+    } else {
+      // Exactly representable as half-floats, so that kRGBF16 round trips.
+      chunk.output_hdr.push_back(
+          flat ? 0.0f : (float)((i * 37) % 64) / 8.0f - 4.0f);
+    }
+  }
+
+  size_t raw_size = 0;
+  std::unique_ptr<WorkerRenderResult> sent(
+      WorkerRenderResult::Make("worker01", &chunk, 7, 1.5f, encoding,
+                               &raw_size));
+  TESTEQ(sent != nullptr, true);
+  if (sent == nullptr) {
+    return;
+  }
+  TESTEQ(raw_size, WorkChunk::kSerializedOutputMinimumSize +
+                   (size_t)width * height * pixel_size);
+
+  // Payload header: encoding, raw size, delta stride (bytes per pixel).
+  auto received = Receive<WorkerRenderResult>(*sent);
+  uint32_t header[3];
+  const size_t header_end = kResultFieldsOffset + sizeof(header);
+  TESTEQ(received->bytes.size() >= header_end, true);
+  memcpy(header, &received->bytes[kResultFieldsOffset], sizeof(header));
+  TESTEQ(header[0], (uint32_t)encoding);
+  TESTEQ((size_t)header[1], raw_size);
+  TESTEQ((size_t)header[2], pixel_size);
+
+  uint32_t chunk_id = 0;
+  TESTEQ(received->GetChunkId(&chunk_id), true);
+  TESTEQ(chunk_id, 7u);
+
+  float render_time = 0.0f;
+  TESTEQ(received->GetRenderTime(&render_time), true);
+  TESTEQ(render_time, 1.5f);
+
+  WorkChunk out{};
+  TESTEQ(DecodeResult(*received, chunk, &out), true);
+  TESTEQ(out.output_bitmap == chunk.output_bitmap, true);
+  TESTEQ(out.output_hdr == chunk.output_hdr, true);
+
+  // Truncated payloads.
+  for (size_t size : { (size_t)0, header_end - 1, header_end,
+                       received->bytes.size() - 1 }) {
+    auto truncated = Receive<WorkerRenderResult>(*received);
+    truncated->bytes.resize(size);
+    WorkChunk o{};
+    TESTEQ(DecodeResult(*truncated, chunk, &o), false);
+  }
+
+  // A chunk of a different size than expected.
+  {
+    WorkChunk o{};
+    o.chunk_width = width;
+    o.chunk_height = height + 1;
+    o.settings.output_format = format;
+    TESTEQ(received->GetOutput(&o), false);
+  }
+
+  // Unknown encoding.
+  {
+    auto bad = Receive<WorkerRenderResult>(*received);
+    PutU32(&bad->bytes, kResultFieldsOffset, 2);
+    WorkChunk o{};
+    TESTEQ(DecodeResult(*bad, chunk, &o), false);
+  }
+
+  if (encoding != PixelEncoding::kDeltaDeflate) {
+    return;
+  }
+
+  // Raw size not matching the compressed data, or too big to be allocated.
+  for (uint32_t size : { (uint32_t)raw_size - 1, (uint32_t)raw_size + 1,
+                         0xffffffffu }) {
+    auto bad = Receive<WorkerRenderResult>(*received);
+    PutU32(&bad->bytes, kResultFieldsOffset + 4, size);
+    WorkChunk o{};
+    TESTEQ(DecodeResult(*bad, chunk, &o), false);
+  }
+
+  // Zero stride.
+  {
+    auto bad = Receive<WorkerRenderResult>(*received);
+    PutU32(&bad->bytes, kResultFieldsOffset + 8, 0);
+    WorkChunk o{};
+    TESTEQ(DecodeResult(*bad, chunk, &o), false);
+  }
+
+  // Broken deflate stream.
+  {
+    auto bad = Receive<WorkerRenderResult>(*received);
+    bad->bytes[header_end] ^= 0xff;
+    WorkChunk o{};
+    TESTEQ(DecodeResult(*bad, chunk, &o), false);
+  }
+}
+
+static void TestFlatResultCompresses() {
+  WorkChunk chunk{};
+  chunk.chunk_width = 13;
+  chunk.chunk_height = 7;
+  chunk.output_bitmap.resize(13 * 7 * 3);
+
+  size_t raw_size = 0;
+  std::unique_ptr<WorkerRenderResult> sent(WorkerRenderResult::Make(
+      "worker01", &chunk, 0, 0.0f, PixelEncoding::kDeltaDeflate, &raw_size));
+  TESTEQ(sent != nullptr, true);
+  if (sent != nullptr) {
+    TESTEQ(sent->GetPayloadSize() < raw_size / 4, true);
+  }
+}
+
+static void TestResultRenderTime() {
+  WorkChunk chunk{};
+  chunk.chunk_width = 2;
+  chunk.chunk_height = 2;
+  chunk.output_bitmap.resize(2 * 2 * 3);
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const float inf = std::numeric_limits<float>::infinity();
+  for (float t : { 0.0f, 0.25f, 1e6f, -0.5f, nan, inf }) {
+    std::unique_ptr<WorkerRenderResult> sent(
+        WorkerRenderResult::Make("worker01", &chunk, 0, t));
+    auto received = Receive<WorkerRenderResult>(*sent);
+    float render_time = -1.0f;
+    const bool valid = t >= 0.0f && t != inf;
+    TESTEQ(received->GetRenderTime(&render_time), valid);
+    if (valid) {
+      TESTEQ(render_time, t);
+    }
+
+    received->bytes.resize(kResultFieldsOffset);
+    TESTEQ(received->GetRenderTime(&render_time), false);
+  }
+}
+
+static void TestWorkerReady() {
+  const std::vector<uint64_t> hashes = {
+    1, 0x0123456789abcdefULL, 0xffffffffffffffffULL
+  };
+  WorkerCapabilities caps;
+  caps.cores = 12;
+  caps.memory = 0x400000000ULL;
+  caps.benchmark_score = 3.25f;
+  std::unique_ptr<WorkerReady> sent(
+      WorkerReady::Make("worker01", kFeatureCompressedPixels, caps, hashes));
+  auto received = Receive<WorkerReady>(*sent);
+
+  uint32_t features = 0;
+  WorkerCapabilities parsed_caps;
+  std::vector<uint64_t> parsed;
+  TESTEQ(received->Parse(&features, &parsed_caps, &parsed), true);
+  TESTEQ(features, (uint32_t)kFeatureCompressedPixels);
+  TESTEQ(parsed_caps.cores, 12u);
+  TESTEQ(parsed_caps.memory, (uint64_t)0x400000000ULL);
+  TESTEQ(parsed_caps.benchmark_score, 3.25f);
+  TESTEQ(parsed == hashes, true);
+
+  // Benchmark scores which can't be compared are treated as unknown.
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const float inf = std::numeric_limits<float>::infinity();
+  for (float score : { nan, inf, -1.0f }) {
+    caps.benchmark_score = score;
+    std::unique_ptr<WorkerReady> odd(
+        WorkerReady::Make("worker01", 0, caps, hashes));
+    TESTEQ(Receive<WorkerReady>(*odd)->Parse(
+        &features, &parsed_caps, &parsed), true);
+    TESTEQ(parsed_caps.benchmark_score, 0.0f);
+  }
+
+  // No cached scenes.
+  {
+    std::unique_ptr<WorkerReady> empty(
+        WorkerReady::Make("worker01", 0, WorkerCapabilities(), {}));
+    parsed = hashes;
+    TESTEQ(Receive<WorkerReady>(*empty)->Parse(
+        &features, &parsed_caps, &parsed), true);
+    TESTEQ(features, (uint32_t)0);
+    TESTEQ(parsed.size(), (size_t)0);
+  }
+
+  // Truncated header, count not matching the hashes.
+  for (size_t size : { (size_t)0, (size_t)23, (size_t)24,
+                       received->bytes.size() - 1,
+                       received->bytes.size() + 1 }) {
+    auto bad = Receive<WorkerReady>(*received);
+    bad->bytes.resize(size);
+    TESTEQ(bad->Parse(&features, &parsed_caps, &parsed), false);
+  }
+
+  // The count follows the features, cores, memory and benchmark score.
+  for (uint32_t count : { 2u, 4u, 0xffffffffu }) {
+    auto bad = Receive<WorkerReady>(*received);
+    PutU32(&bad->bytes, 20, count);
+    TESTEQ(bad->Parse(&features, &parsed_caps, &parsed), false);
+  }
+}
+
+static void TestMasterRenderOrder() {
+  WorkChunk chunk{};
+  chunk.image_width = 1920;
+  chunk.image_height = 1080;
+  chunk.chunk_x = 64;
+  chunk.chunk_y = 128;
+  chunk.chunk_width = 32;
+  chunk.chunk_height = 16;
+  chunk.settings.aa_grid = 3;
+  chunk.settings.output_format = PixelFormat::kRGBF16;
+
+  std::unique_ptr<MasterRenderOrder> sent(MasterRenderOrder::Make(
+      "worker01", &chunk, 0xdeadbeef, PixelEncoding::kDeltaDeflate));
+  auto received = Receive<MasterRenderOrder>(*sent);
+
+  WorkChunk parsed{};
+  uint32_t chunk_id = 0;
+  PixelEncoding encoding = PixelEncoding::kRaw;
+  TESTEQ(received->Parse(&parsed, &chunk_id, &encoding), true);
+  TESTEQ(chunk_id, 0xdeadbeefu);
+  TESTEQ(encoding == PixelEncoding::kDeltaDeflate, true);
+  TESTEQ(parsed.image_width, 1920);
+  TESTEQ(parsed.image_height, 1080);
+  TESTEQ(parsed.chunk_x, 64);
+  TESTEQ(parsed.chunk_y, 128);
+  TESTEQ(parsed.chunk_width, 32);
+  TESTEQ(parsed.chunk_height, 16);
+  TESTEQ(parsed.settings.aa_grid, 3u);
+  TESTEQ(parsed.settings.output_format == PixelFormat::kRGBF16, true);
+
+  for (size_t size : { (size_t)0, received->bytes.size() - 1,
+                       received->bytes.size() + 1 }) {
+    auto bad = Receive<MasterRenderOrder>(*received);
+    bad->bytes.resize(size);
+    TESTEQ(bad->Parse(&parsed, &chunk_id, &encoding), false);
+  }
+
+  // Unknown result encoding (followed by the chunk ID).
+  {
+    auto bad = Receive<MasterRenderOrder>(*received);
+    PutU32(&bad->bytes, bad->bytes.size() - sizeof(uint32_t) * 2, 2);
+    TESTEQ(bad->Parse(&parsed, &chunk_id, &encoding), false);
+  }
+}
+
+static void TestMasterCancelOrder() {
+  std::unique_ptr<MasterCancelOrder> sent(
+      MasterCancelOrder::Make("worker01", 42));
+  auto received = Receive<MasterCancelOrder>(*sent);
+
+  uint32_t chunk_id = 0;
+  TESTEQ(received->Parse(&chunk_id), true);
+  TESTEQ(chunk_id, 42u);
+
+  received->bytes.push_back(0);
+  TESTEQ(received->Parse(&chunk_id), false);
+}
+
+static void TestMasterScene() {
+  // Something that compresses, but not into nothing.
+  std::vector<uint8_t> scene(100000);
+  for (size_t i = 0; i < scene.size(); i++) {
+    scene[i] = (uint8_t)((i * i) >> 7);
+  }
+
+  // FNV-1a offset basis.
+  TESTEQ(MasterScene::Hash({}), (uint64_t)0xcbf29ce484222325ULL);
+
+  MasterScene::PackedScene packed;
+  TESTEQ(MasterScene::Pack(scene, &packed), true);
+  TESTEQ(packed.hash, MasterScene::Hash(scene));
+  TESTEQ(packed.size, (uint64_t)scene.size());
+  TESTEQ(packed.data.size() < scene.size(), true);
+
+  // With the data.
+  std::unique_ptr<MasterScene> sent(
+      MasterScene::Make("worker01", packed, true));
+  auto received = Receive<MasterScene>(*sent);
+
+  uint64_t hash = 0;
+  std::vector<uint8_t> unpacked;
+  TESTEQ(received->Unpack(&hash, &unpacked), true);
+  TESTEQ(hash, packed.hash);
+  TESTEQ(unpacked == scene, true);
+
+  // Without the data (the worker has it cached).
+  std::unique_ptr<MasterScene> sent_cached(
+      MasterScene::Make("worker01", packed, false));
+  auto received_cached = Receive<MasterScene>(*sent_cached);
+  hash = 0;
+  TESTEQ(received_cached->Unpack(&hash, &unpacked), true);
+  TESTEQ(hash, packed.hash);
+  TESTEQ(unpacked.size(), (size_t)0);
+
+  // Header: uint64_t hash, uint64_t size, uint32_t included.
+  const size_t kHeaderSize = 8 + 8 + 4;
+  TESTEQ(received_cached->bytes.size(), kHeaderSize);
+
+  // Truncated header or data.
+  for (size_t size : { (size_t)0, kHeaderSize - 1, kHeaderSize,
+                       received->bytes.size() - 1 }) {
+    auto bad = Receive<MasterScene>(*received);
+    bad->bytes.resize(size);
+    TESTEQ(bad->Unpack(&hash, &unpacked), false);
+    TESTEQ(unpacked.size(), (size_t)0);
+  }
+
+  // Data in a packet which says it doesn't have any.
+  {
+    auto bad = Receive<MasterScene>(*received);
+    PutU32(&bad->bytes, 16, 0);
+    TESTEQ(bad->Unpack(&hash, &unpacked), false);
+  }
+
+  // Wrong hash.
+  {
+    auto bad = Receive<MasterScene>(*received);
+    PutU64(&bad->bytes, 0, packed.hash ^ 1);
+    TESTEQ(bad->Unpack(&hash, &unpacked), false);
+    TESTEQ(unpacked.size(), (size_t)0);
+  }
+
+  // Size not matching the data, zero or above the limit.
+  for (uint64_t size : { packed.size - 1, packed.size + 1, (uint64_t)0,
+                         (uint64_t)1 << 40 }) {
+    auto bad = Receive<MasterScene>(*received);
+    PutU64(&bad->bytes, 8, size);
+    TESTEQ(bad->Unpack(&hash, &unpacked), false);
+    TESTEQ(unpacked.size(), (size_t)0);
+  }
+}
+
+int main(void) {
+  const struct {
+    PixelFormat format;
+    size_t pixel_size;
+  } kFormats[] = {
+    { PixelFormat::kRGB8, 3 },
+    { PixelFormat::kRGBF32, 12 },
+    { PixelFormat::kRGBF16, 6 },
+  };
+
+  // Note: In a single pixel chunk the byte count (see WorkChunk::
+  // SerializeOutput) isn't negligible compared to the pixels.
+  for (const auto& f : kFormats) {
+    for (auto encoding : { PixelEncoding::kRaw,
+                           PixelEncoding::kDeltaDeflate }) {
+      TestResultRoundTrip(f.format, encoding, f.pixel_size, 13, 7);
+      TestResultRoundTrip(f.format, encoding, f.pixel_size, 1, 1);
+      TestResultRoundTrip(f.format, encoding, f.pixel_size, 2, 1);
+    }
+  }
+  TestFlatResultCompresses();
+  TestResultRenderTime();
+
+  TestWorkerReady();
+  TestMasterRenderOrder();
+  TestMasterCancelOrder();
+  TestMasterScene();
+
+  return 0;
+}
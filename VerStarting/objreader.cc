@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <filesystem>
 #include <memory>
 #include <vector>
 #include <cstring>
@@ -21,6 +22,85 @@ struct FileDeleter {
   }
 };
 
+// FNV-1a.
+static uint64_t HashBytes(const std::vector<uint8_t>& bytes) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (uint8_t b : bytes) {
+    h ^= b;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static bool ReadWholeFile(const char *fname, std::vector<uint8_t> *bytes) {
+  std::unique_ptr<FILE, FileDeleter> f(fopen(fname, "rb"));
+  if (f == nullptr) {
+    return false;
+  }
+
+  bytes->clear();
+  uint8_t buffer[65536];
+  size_t sz;
+  while ((sz = fread(buffer, 1, sizeof(buffer), f.get())) != 0) {
+    bytes->insert(bytes->end(), buffer, buffer + sz);
+  }
+
+  return ferror(f.get()) == 0;
+}
+
+// The hash only finds candidates; FNV-1a isn't collision resistant, so files
+// with matching hashes are still compared byte by byte (see FilesEqual).
+static bool HashFile(TextureLoadContext::LoadedFile *file) {
+  if (file->hashed) {
+    return true;
+  }
+
+  std::vector<uint8_t> contents;
+  if (!ReadWholeFile(file->path.c_str(), &contents)) {
+    return false;
+  }
+
+  file->hash = HashBytes(contents);
+  file->hashed = true;
+  return true;
+}
+
+static bool FilesEqual(const std::string& path_a, const std::string& path_b) {
+  std::vector<uint8_t> a, b;
+  if (!ReadWholeFile(path_a.c_str(), &a) ||
+      !ReadWholeFile(path_b.c_str(), &b)) {
+    return false;
+  }
+
+  return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+void TextureLoadContext::Finish() {
+  loader.Wait();
+
+  if (duplicates == 0) {
+    return;
+  }
+
+  fprintf(stderr,
+          "info: %zu duplicate texture files (%.1f MB) share already loaded "
+          "textures",
+          duplicates, (double)duplicate_file_bytes / (1024.0 * 1024.0));
+
+  // Lazily loaded textures are not decoded yet, so there's nothing to tell
+  // about them.
+  uint64_t texel_bytes = 0;
+  for (const Texture *tex : duplicated_textures) {
+    texel_bytes += tex->GetMemoryUsage();
+  }
+
+  if (texel_bytes != 0) {
+    fprintf(stderr, ", %.1f MB of decoded texels saved",
+            (double)texel_bytes / (1024.0 * 1024.0));
+  }
+  fputc('\n', stderr);
+}
+
 bool ObjFileReader::ReadNotImplemented(const char *) {
   return true;
 }
@@ -37,7 +117,7 @@ bool ObjFileReader::ReadMaterialLibrary(const char *line) {
       base_directory + "/" + fname;
 
   MtlFileReader mtlreader;
-  return mtlreader.ReadMtlFile(scene, path.c_str());
+  return mtlreader.ReadMtlFile(scene, path.c_str(), &texture_ctx);
 }
 
 bool ObjFileReader::ReadVertex(const char *line) {
@@ -270,6 +350,8 @@ bool ObjFileReader::ReadObjFile(Scene *scene, const char *fname) {
     }
   }
 
+  // Note: Textures which failed to load are left empty, i.e. untextured.
+  texture_ctx.Finish();
   return true;
 }
 
@@ -430,6 +512,32 @@ bool MtlFileReader::ReadTransmissionFilter(const char *line) {
   return true;
 }
 
+Texture *MtlFileReader::FindDuplicateTexture(
+    const char *fname, uint64_t size, TextureLoadContext::LoadedFile *file) {
+  // Files of a unique size can't be duplicates, so they aren't even read.
+  auto itr = texture_ctx->files_by_size.find(size);
+  if (itr == texture_ctx->files_by_size.end() || !HashFile(file)) {
+    return nullptr;
+  }
+
+  for (auto& other : itr->second) {
+    if (!HashFile(&other) || other.hash != file->hash ||
+        !FilesEqual(file->path, other.path)) {
+      continue;
+    }
+
+    fprintf(stderr, "info: texture \"%s\" is the same as \"%s\"\n",
+            file->path.c_str(), other.path.c_str());
+    texture_ctx->aliases[fname] = other.tex;
+    texture_ctx->duplicates++;
+    texture_ctx->duplicate_file_bytes += size;
+    texture_ctx->duplicated_textures.push_back(other.tex);
+    return other.tex;
+  }
+
+  return nullptr;
+}
+
 Texture *MtlFileReader::GetTexture(const char *fname) {
   // If the texture has already been loaded before, just fetch it.
   auto tex_itr = scene->textures.find(fname);
@@ -437,16 +545,56 @@ Texture *MtlFileReader::GetTexture(const char *fname) {
     return tex_itr->second.get();
   }
 
+  if (texture_ctx != nullptr) {
+    auto alias_itr = texture_ctx->aliases.find(fname);
+    if (alias_itr != texture_ctx->aliases.end()) {
+      return alias_itr->second;
+    }
+  }
+
   // Actually load the texture.
   std::string path = base_directory.empty() ? 
       fname :
       base_directory + "/" + fname;
 
-  Texture *tex = Texture::LoadFromFile(path.c_str());
+  std::error_code ec;
+  const uint64_t file_size = std::filesystem::file_size(path, ec);
+  const bool dedup =
+      texture_ctx != nullptr && scene->texture_options.dedup && !ec;
+  TextureLoadContext::LoadedFile file{ path, nullptr, false, 0 };
+  if (dedup) {
+    Texture *tex = FindDuplicateTexture(fname, file_size, &file);
+    if (tex != nullptr) {
+      return tex;
+    }
+  }
+
+  Texture *tex = nullptr;
+  if (scene->texture_options.lazy) {
+    // Only check if the file is there, it gets decoded when first needed.
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f != nullptr) {
+      fclose(f);
+      tex = Texture::CreateLazy(
+          path.c_str(), scene->texture_options, &scene->texture_cache);
+    }
+  } else if (texture_ctx != nullptr) {
+    tex = new Texture;
+    tex->options = scene->texture_options;
+    texture_ctx->loader.Enqueue(tex, path);
+  } else {
+    tex = Texture::LoadFromFile(path.c_str(), scene->texture_options);
+  }
+
   if (tex == nullptr) {
     fprintf(stderr, "error: cannot load texture \"%s\"\n", fname);
     return nullptr;
   }
+
+  if (dedup) {
+    file.tex = tex;
+    texture_ctx->files_by_size[file_size].push_back(std::move(file));
+  }
   
   scene->textures[fname].reset(tex);
   return tex;
@@ -469,12 +617,14 @@ bool MtlFileReader::ReadTexture(const char *line) {
   return mtl->tex != nullptr;
 }
 
-bool MtlFileReader::ReadMtlFile(Scene *scene, const char *fname) {
+bool MtlFileReader::ReadMtlFile(Scene *scene, const char *fname,
+                                TextureLoadContext *texture_ctx) {
   // Reset the temporary storage.
   mtl.reset();
   mtl_name.clear();
 
   this->scene = scene;
+  this->texture_ctx = texture_ctx;
   base_directory = GetDirectoryPart(fname);  
 
   // Parse the MTL file.
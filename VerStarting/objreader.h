@@ -2,14 +2,43 @@
 // Wavefront .obj 3D scene and .mtl material readers.
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include "scene.h"
 #include "math3d.h"
+#include "texture_loader.h"
 
 namespace raytracer {
 
 using math3d::V3D;
 
+// Texture loading state shared by all the material libraries of a scene.
+struct TextureLoadContext {
+  // Non-lazy textures are decoded in the background.
+  TextureLoader loader;
+
+  // Texture files are identified by their contents, so that the same image
+  // shipped under different names is loaded only once. Files are grouped by
+  // size, and read and hashed (once) only when another file has the same
+  // size, as reading the files would slow down loading the scene. Matching
+  // hashes are confirmed by comparing the files.
+  struct LoadedFile {
+    std::string path;
+    Texture *tex;
+    bool hashed;
+    uint64_t hash;
+  };
+  std::unordered_map<uint64_t, std::vector<LoadedFile>> files_by_size;
+  std::unordered_map<std::string, Texture*> aliases;  // Duplicate -> texture.
+
+  size_t duplicates = 0;
+  uint64_t duplicate_file_bytes = 0;
+  std::vector<const Texture*> duplicated_textures;  // One per duplicate.
+
+  // Waits for the background decoding and prints the dedup stats.
+  void Finish();
+};
+
 class ObjFileReader {
  public:
   bool ReadObjFile(Scene *scene, const char *fname);
@@ -26,6 +55,10 @@ class ObjFileReader {
   std::string base_directory;
   Scene *scene;
 
+  // Textures of all the material libraries are decoded in the background and
+  // waited for at the end of ReadObjFile.
+  TextureLoadContext texture_ctx;
+
   // Temporary storage used while processing.
   std::vector<V3D> vertices;
   std::vector<V3D> texcoords;  
@@ -36,7 +69,11 @@ class ObjFileReader {
 
 class MtlFileReader {
  public:
-  bool ReadMtlFile(Scene *scene, const char *fname);
+  // If texture_ctx is provided, non-lazy textures are decoded using its
+  // loader (i.e. they might be still empty when this returns), and duplicate
+  // texture files are detected.
+  bool ReadMtlFile(Scene *scene, const char *fname,
+                   TextureLoadContext *texture_ctx = nullptr);
  
  private:
   void CommitMaterial();
@@ -53,9 +90,14 @@ class MtlFileReader {
   bool ReadNotImplemented(const char *);
 
   Texture *GetTexture(const char *fname);
+  // Returns the already loaded texture with the same file contents, if any.
+  // The file might get hashed in the process.
+  Texture *FindDuplicateTexture(
+      const char *fname, uint64_t size, TextureLoadContext::LoadedFile *file);
 
   std::string base_directory;
   Scene *scene;
+  TextureLoadContext *texture_ctx;
 
   // Temporary storage used while processing.
   std::unique_ptr<Material> mtl;
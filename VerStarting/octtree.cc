@@ -39,6 +39,17 @@ const Primitive* OctTree::IntersectRay(
   return root.PrimitiveIntersectRay(working_ray, point, distance);
 }
 
+bool OctTree::IntersectRayWithPrimitive(
+    const Ray& ray, const Primitive *p,
+    V3D *point, V3D::basetype *distance) {
+  Ray working_ray(ray);
+  working_ray.inv_direction.v[0] = 1.0 / working_ray.direction.v[0];
+  working_ray.inv_direction.v[1] = 1.0 / working_ray.direction.v[1];
+  working_ray.inv_direction.v[2] = 1.0 / working_ray.direction.v[2];
+
+  return p->IntersectRay(working_ray, point, distance);
+}
+
 AABB OctTree::GetAABB() const {
   return root.aabb;
 }
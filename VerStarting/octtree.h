@@ -36,8 +36,19 @@ class OctTree {
       V3D::basetype *distance          // Distance to intersection.
   ) const;
 
+  // Checks the ray against a single primitive (which doesn't have to belong to
+  // any tree). Useful to quickly re-test a primitive found before.
+  static bool IntersectRayWithPrimitive(
+      const Ray& ray, const Primitive *p,
+      V3D *point, V3D::basetype *distance);
+
   AABB GetAABB() const;
 
+  // All the primitives, in the order they were added.
+  const std::list<std::unique_ptr<Primitive>>& GetPrimitives() const {
+    return primitives;
+  }
+
  private:
   // The minimum primitives required to make a split.
   static const int SPLIT_BOUNDARY = 16;
@@ -29,6 +29,10 @@ class Primitive {
   // Returns texture coords (UVW mapping) at the specified point.
   virtual V3D GetUVW(const V3D& point) const = 0;
 
+  // Returns how many UV units correspond to a unit of distance on the surface
+  // (on average). Used to estimate texture footprints.
+  virtual V3D::basetype GetUVDensity() const = 0;
+
   // Return serialized primitive.
   // TODO(gynvael): Actually provide an implementation of this to dump all the
   // common properties. Perhaps also add a deserialize method or function.
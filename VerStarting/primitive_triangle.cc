@@ -1,3 +1,5 @@
+#include <stdint.h>
+#include <string.h>
 #include <algorithm>
 #include <cmath>
 #include <string>
@@ -78,6 +80,22 @@ V3D Triangle::GetUVW(const V3D& point) const {
   return (uvw[0] * n0 + uvw[1] * n1 + uvw[2] * n2) / n;
 }
 
+V3D::basetype Triangle::GetUVDensity() const {
+  // Square root of the ratio of the triangle's area in UV space to its area
+  // in world space (the 2s cancel out).
+  const V3D::basetype area =
+      (vertex[1] - vertex[0]).Cross(vertex[2] - vertex[0]).Length();
+  const V3D::basetype uv_area = fabs(
+      (uvw[1].v[0] - uvw[0].v[0]) * (uvw[2].v[1] - uvw[0].v[1]) -
+      (uvw[2].v[0] - uvw[0].v[0]) * (uvw[1].v[1] - uvw[0].v[1]));
+
+  if (!(area > 0.0)) {
+    return 0.0;
+  }
+
+  return sqrt(uv_area / area);
+}
+
 bool Triangle::IntersectRay(const Ray& ray, V3D *point,
                             V3D::basetype *distance) const {
   // A quick ray-AABB(triangle) test that is faster than ray-triangle test 
@@ -142,16 +160,41 @@ bool Triangle::IntersectRay(const Ray& ray, V3D *point,
   return true;
 }
 
-std::string Triangle::Serialize() const{
-  return "nope"; // TODO
+// Note: The material isn't serialized, as it's only a pointer. It's up to
+// the caller to store a reference to it (see Scene::Serialize).
+std::string Triangle::Serialize() const {
+  std::string data(kSerializedSize, '\0');
+
+  char *ptr = &data[0];
+  memcpy(ptr, vertex, sizeof(vertex)); ptr += sizeof(vertex);
+  memcpy(ptr, normal, sizeof(normal)); ptr += sizeof(normal);
+  memcpy(ptr, uvw, sizeof(uvw)); ptr += sizeof(uvw);
+
+  const int32_t line_no = debug_line_no;
+  memcpy(ptr, &line_no, sizeof(int32_t));
+  return data;
 }
 
 bool Triangle::Deserialize(
     std::unique_ptr<Triangle> *primitive,
     const std::string& data) {
-  (void)primitive;
-  (void)data;
-  return false; // TODO
+  if (data.size() != kSerializedSize) {
+    return false;
+  }
+
+  auto tri = std::make_unique<Triangle>();
+  const char *ptr = data.data();
+  memcpy(tri->vertex, ptr, sizeof(tri->vertex)); ptr += sizeof(tri->vertex);
+  memcpy(tri->normal, ptr, sizeof(tri->normal)); ptr += sizeof(tri->normal);
+  memcpy(tri->uvw, ptr, sizeof(tri->uvw)); ptr += sizeof(tri->uvw);
+
+  int32_t line_no;
+  memcpy(&line_no, ptr, sizeof(int32_t));
+  tri->debug_line_no = line_no;
+
+  tri->CacheAABB();
+  *primitive = std::move(tri);
+  return true;
 }
 
 }  // namespace raytracer
@@ -1,4 +1,5 @@
 #pragma once
+#include <stdint.h>
 #include <memory>
 #include <string>
 #include <utility>
@@ -15,6 +16,13 @@ class Triangle : public Primitive {
                     V3D::basetype *distance) const override;
   V3D GetNormal(const V3D& point) const override;
   V3D GetUVW(const V3D& point) const override;
+  V3D::basetype GetUVDensity() const override;
+
+  static const size_t kSerializedSize =
+    /* vertex */        sizeof(V3D) * 3 +
+    /* normal */        sizeof(V3D) * 3 +
+    /* uvw */           sizeof(V3D) * 3 +
+    /* debug_line_no */ sizeof(int32_t);
 
   std::string Serialize() const override;
   static bool Deserialize(
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "primitive_triangle.h"
+#include "scene.h"
+#include "texture_loader.h"
+
+namespace raytracer {
+
+namespace {
+
+const char kMagic[4] = { 'M', 'T', 'S', 'C' };
+const uint32_t kVersion = 1;
+
+// Primitive types. Only triangles exist at the moment.
+const uint8_t kPrimitiveTriangle = 0;
+
+const uint32_t kNoIndex = 0xffffffff;  // E.g. a material without texture.
+
+class Writer {
+ public:
+  explicit Writer(std::vector<uint8_t> *bytes) : bytes(bytes) { }
+
+  template<typename T>
+  void Put(const T& value) {
+    Append(&value, sizeof(T));
+  }
+
+  void PutString(const std::string& s) {
+    Put<uint32_t>(s.size());
+    Append(s.data(), s.size());
+  }
+
+  void Append(const void *data, size_t size) {
+    const uint8_t *ptr = (const uint8_t*)data;
+    bytes->insert(bytes->end(), ptr, ptr + size);
+  }
+
+ private:
+  std::vector<uint8_t> *bytes;
+};
+
+class Reader {
+ public:
+  explicit Reader(const std::vector<uint8_t>& bytes) : bytes(bytes) { }
+
+  template<typename T>
+  bool Get(T *value) {
+    return Read(value, sizeof(T));
+  }
+
+  bool GetString(std::string *s) {
+    uint32_t size;
+    const uint8_t *data;
+    if (!Get(&size) || (data = Skip(size)) == nullptr) {
+      return false;
+    }
+    s->assign((const char*)data, size);
+    return true;
+  }
+
+  bool Read(void *data, size_t size) {
+    const uint8_t *ptr = Skip(size);
+    if (ptr == nullptr) {
+      return false;
+    }
+    memcpy(data, ptr, size);
+    return true;
+  }
+
+  // Returns the next size bytes (or nullptr if there isn't enough data) and
+  // moves past them.
+  const uint8_t *Skip(size_t size) {
+    if (bytes.size() - offset < size) {
+      return nullptr;
+    }
+    const uint8_t *ptr = bytes.data() + offset;
+    offset += size;
+    return ptr;
+  }
+
+  bool AtEnd() const { return offset == bytes.size(); }
+
+ private:
+  const std::vector<uint8_t>& bytes;
+  size_t offset = 0;
+};
+
+bool ReadWholeFile(const char *fname, std::vector<uint8_t> *bytes) {
+  FILE *f = fopen(fname, "rb");
+  if (f == nullptr) {
+    return false;
+  }
+
+  bytes->clear();
+  uint8_t buffer[65536];
+  size_t sz;
+  while ((sz = fread(buffer, 1, sizeof(buffer), f)) != 0) {
+    bytes->insert(bytes->end(), buffer, buffer + sz);
+  }
+
+  const bool ok = ferror(f) == 0;
+  fclose(f);
+  return ok;
+}
+
+}  // namespace
+
+// Format (all values LE, strings are prefixed with a uint32_t length):
+//   "MTSC", uint32_t version
+//   texture options: uint32_t format, srgb, tiled
+//   uint32_t texture count, then for each: name, uint32_t size, image file
+//   uint32_t material count, then for each: name, Material fields, uint32_t
+//       texture index
+//   uint32_t light count, then the Light structures
+//   uint32_t primitive count, then for each: uint8_t type, uint32_t material
+//       index, uint32_t size, Primitive::Serialize output
+bool Scene::Serialize(std::vector<uint8_t> *bytes) const {
+  bytes->clear();
+  Writer w(bytes);
+  w.Append(kMagic, sizeof(kMagic));
+  w.Put<uint32_t>(kVersion);
+
+  w.Put<uint32_t>((uint32_t)texture_options.format);
+  w.Put<uint32_t>(texture_options.srgb ? 1 : 0);
+  w.Put<uint32_t>(texture_options.tiled ? 1 : 0);
+
+  // Materials are sorted by name so that the same scene always serializes to
+  // the same bytes (which are hashed by the workers' cache).
+  std::vector<const std::pair<const std::string,
+                              std::unique_ptr<Material>>*> sorted_materials;
+  for (const auto& entry : materials) {
+    sorted_materials.push_back(&entry);
+  }
+  std::sort(sorted_materials.begin(), sorted_materials.end(),
+      [](const auto *a, const auto *b) { return a->first < b->first; });
+
+  // Only the textures which are actually used are stored. Note that
+  // deduplicated textures have more than one name, but are stored once.
+  std::vector<const Texture*> used_textures;
+  std::unordered_map<const Texture*, uint32_t> texture_index;
+  for (const auto *entry : sorted_materials) {
+    const Texture *tex = entry->second->tex;
+    if (tex != nullptr && texture_index.find(tex) == texture_index.end()) {
+      texture_index[tex] = used_textures.size();
+      used_textures.push_back(tex);
+    }
+  }
+
+  w.Put<uint32_t>(used_textures.size());
+  std::vector<uint8_t> file;
+  for (const Texture *tex : used_textures) {
+    // Textures of a deserialized scene might not exist as files.
+    const std::vector<uint8_t>& in_memory = tex->GetFileData();
+    if (in_memory.empty() &&
+        (tex->GetPath().empty() ||
+         !ReadWholeFile(tex->GetPath().c_str(), &file))) {
+      fprintf(stderr, "error: cannot read texture file \"%s\"\n",
+              tex->GetPath().c_str());
+      return false;
+    }
+
+    const std::vector<uint8_t>& data = in_memory.empty() ? file : in_memory;
+    w.PutString(tex->GetPath());
+    w.Put<uint32_t>(data.size());
+    w.Append(data.data(), data.size());
+  }
+
+  std::unordered_map<const Material*, uint32_t> material_index;
+  w.Put<uint32_t>(sorted_materials.size());
+  for (const auto *entry : sorted_materials) {
+    const Material *mtl = entry->second.get();
+    const uint32_t idx = material_index.size();
+    material_index[mtl] = idx;
+
+    w.PutString(entry->first);
+    w.Put(mtl->ambient);
+    w.Put(mtl->diffuse);
+    w.Put(mtl->specular);
+    w.Put(mtl->specular_exp);
+    w.Put(mtl->reflectance);
+    w.Put(mtl->transparency);
+    w.Put(mtl->transmission_filter);
+    w.Put(mtl->refraction_index);
+    w.Put<uint32_t>(
+        mtl->tex != nullptr ? texture_index[mtl->tex] : kNoIndex);
+  }
+
+  w.Put<uint32_t>(lights.size());
+  for (const Light& light : lights) {
+    w.Put(light.position);
+    w.Put(light.ambient);
+    w.Put(light.diffuse);
+    w.Put(light.specular);
+  }
+
+  const auto& primitives = tree.GetPrimitives();
+  w.Put<uint32_t>(primitives.size());
+  for (const auto& p : primitives) {
+    if (dynamic_cast<const Triangle*>(p.get()) == nullptr) {
+      fprintf(stderr, "error: cannot serialize an unknown primitive\n");
+      return false;
+    }
+
+    const auto mtl_itr = material_index.find(p->mtl);
+    const std::string data = p->Serialize();
+    w.Put<uint8_t>(kPrimitiveTriangle);
+    w.Put<uint32_t>(
+        mtl_itr != material_index.end() ? mtl_itr->second : kNoIndex);
+    w.Put<uint32_t>(data.size());
+    w.Append(data.data(), data.size());
+  }
+
+  return true;
+}
+
+bool Scene::Deserialize(const std::vector<uint8_t>& bytes) {
+  Reader r(bytes);
+  char magic[4];
+  uint32_t version;
+  if (!r.Read(magic, sizeof(magic)) || memcmp(magic, kMagic, 4) != 0 ||
+      !r.Get(&version) || version != kVersion) {
+    fprintf(stderr, "error: not a serialized scene (or wrong version)\n");
+    return false;
+  }
+
+  uint32_t format, srgb, tiled;
+  if (!r.Get(&format) || !r.Get(&srgb) || !r.Get(&tiled) ||
+      format > (uint32_t)TexelFormat::kRGBA16F) {
+    return false;
+  }
+  texture_options.format = (TexelFormat)format;
+  texture_options.srgb = srgb != 0;
+  texture_options.tiled = tiled != 0;
+
+  uint32_t texture_count;
+  if (!r.Get(&texture_count)) {
+    return false;
+  }
+
+  // Eagerly loaded textures are decoded in parallel, straight from bytes
+  // (which outlives the loader). Lazy ones keep a copy of their image file
+  // instead, as the bytes are usually freed right after loading the scene.
+  std::vector<Texture*> loaded_textures;
+  std::vector<std::string> texture_names;
+  {
+    TextureLoader loader;
+    for (uint32_t i = 0; i < texture_count; i++) {
+      std::string name;
+      uint32_t size;
+      const uint8_t *data;
+      if (!r.GetString(&name) || !r.Get(&size) ||
+          (data = r.Skip(size)) == nullptr) {
+        return false;
+      }
+
+      Texture *tex;
+      if (texture_options.lazy) {
+        tex = Texture::CreateLazyFromMemory(
+            std::vector<uint8_t>(data, data + size), name.c_str(),
+            texture_options, &texture_cache);
+      } else {
+        tex = new Texture;
+        tex->options = texture_options;
+        loader.Enqueue(tex, data, size, name);
+      }
+
+      // Different files might have had the same path, e.g. if the scene was
+      // made of a few OBJ files.
+      if (textures.find(name) != textures.end()) {
+        name += "#" + std::to_string(i);
+      }
+      textures[name].reset(tex);
+      loaded_textures.push_back(tex);
+      texture_names.push_back(std::move(name));
+    }
+    loader.Wait();
+  }
+
+  // Like in the MTL reader, a texture which fails to decode is left out (the
+  // loader has already complained about it). Lazy textures are only decoded
+  // once they're sampled.
+  for (uint32_t i = 0; i < texture_count; i++) {
+    if (!texture_options.lazy && loaded_textures[i]->mip_levels.empty()) {
+      textures.erase(texture_names[i]);
+      loaded_textures[i] = nullptr;
+    }
+  }
+
+  uint32_t material_count;
+  if (!r.Get(&material_count)) {
+    return false;
+  }
+
+  std::vector<Material*> loaded_materials;
+  for (uint32_t i = 0; i < material_count; i++) {
+    std::string name;
+    auto mtl = std::make_unique<Material>();
+    uint32_t tex_idx;
+    if (!r.GetString(&name) ||
+        !r.Get(&mtl->ambient) ||
+        !r.Get(&mtl->diffuse) ||
+        !r.Get(&mtl->specular) ||
+        !r.Get(&mtl->specular_exp) ||
+        !r.Get(&mtl->reflectance) ||
+        !r.Get(&mtl->transparency) ||
+        !r.Get(&mtl->transmission_filter) ||
+        !r.Get(&mtl->refraction_index) ||
+        !r.Get(&tex_idx)) {
+      return false;
+    }
+
+    // Replacing a material would leave the primitives using it dangling.
+    if (materials.find(name) != materials.end()) {
+      return false;
+    }
+
+    if (tex_idx != kNoIndex) {
+      if (tex_idx >= loaded_textures.size()) {
+        return false;
+      }
+      mtl->tex = loaded_textures[tex_idx];
+    }
+
+    loaded_materials.push_back(mtl.get());
+    materials[name] = std::move(mtl);
+  }
+
+  uint32_t light_count;
+  if (!r.Get(&light_count)) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < light_count; i++) {
+    Light light;
+    if (!r.Get(&light.position) || !r.Get(&light.ambient) ||
+        !r.Get(&light.diffuse) || !r.Get(&light.specular)) {
+      return false;
+    }
+    lights.push_back(light);
+  }
+
+  uint32_t primitive_count;
+  if (!r.Get(&primitive_count)) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < primitive_count; i++) {
+    uint8_t type;
+    uint32_t mtl_idx;
+    uint32_t size;
+    const uint8_t *data;
+    if (!r.Get(&type) || !r.Get(&mtl_idx) || !r.Get(&size) ||
+        (data = r.Skip(size)) == nullptr) {
+      return false;
+    }
+
+    std::unique_ptr<Triangle> tri;
+    if (type != kPrimitiveTriangle ||
+        !Triangle::Deserialize(
+            &tri, std::string((const char*)data, size))) {
+      return false;
+    }
+
+    if (mtl_idx != kNoIndex) {
+      if (mtl_idx >= loaded_materials.size()) {
+        return false;
+      }
+      tri->mtl = loaded_materials[mtl_idx];
+    }
+
+    tree.AddPrimitive(tri.release());
+  }
+
+  return r.AtEnd();
+}
+
+}  // namespace raytracer
+
@@ -1,8 +1,10 @@
 #pragma once
+#include <stdint.h>
 #include <vector>
 #include "octtree.h"
 #include "material.h"
 #include "light.h"
+#include "texture_cache.h"
 
 namespace raytracer {
 
@@ -11,7 +13,22 @@ class Scene {
   OctTree tree;
   MaterialMap materials;
   TextureMap textures;
+  TextureOptions texture_options;  // Used for textures loaded from now on.
+  TextureCache texture_cache;  // For lazily loaded textures.
   std::vector<Light> lights;
+
+  // Serializes the primitives, materials, textures and lights, e.g. to send
+  // the scene over the network. Textures are stored as the original image
+  // files, which are read again. Returns false if the scene can't be
+  // serialized (e.g. a texture file is gone or there is an unknown
+  // primitive).
+  bool Serialize(std::vector<uint8_t> *bytes) const;
+
+  // Loads a scene serialized with the above into this, empty, scene. The
+  // texture options are taken from the data, except for lazy: lazy textures
+  // keep their image files in memory, as they might not exist locally, and
+  // the others are decoded right away.
+  bool Deserialize(const std::vector<uint8_t>& bytes);
 };
 
 };
@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "primitive_triangle.h"
+#include "scene.h"
+#include "test_helper.h"
+
+using namespace test;
+using raytracer::Light;
+using raytracer::Material;
+using raytracer::Scene;
+using raytracer::Triangle;
+using math3d::V3D;
+
+static Triangle *MakeTriangle(double z, int line_no, Material *mtl) {
+  Triangle *tr = new Triangle();
+  tr->vertex[0] = { 1, 1, z };
+  tr->vertex[1] = { 1, 0, z };
+  tr->vertex[2] = { 0, 0, z };
+  tr->normal[0] = tr->normal[1] = tr->normal[2] = { 0, 0, 1 };
+  tr->uvw[0] = { 1, 1, 0 };
+  tr->uvw[1] = { 1, 0, 0 };
+  tr->uvw[2] = { 0, 0, 0 };
+  tr->debug_line_no = line_no;
+  tr->mtl = mtl;
+  tr->CacheAABB();
+  return tr;
+}
+
+int main(void) {
+  Scene scene;
+
+  // Note: Names of the same length, so that the offsets below don't depend
+  // on which material is stored first.
+  auto red = std::make_unique<Material>();
+  red->ambient = { 0.1, 0.0, 0.0 };
+  red->diffuse = { 1.0, 0.0, 0.0 };
+  red->specular = { 0.5, 0.5, 0.5 };
+  red->specular_exp = 10.0;
+  Material *red_ptr = red.get();
+  scene.materials["red_"] = std::move(red);
+
+  auto glass = std::make_unique<Material>();
+  glass->transparency = 0.75;
+  glass->reflectance = 0.25;
+  glass->transmission_filter = { 0.0, 1.0, 1.0 };
+  glass->refraction_index = 1.5;
+  Material *glass_ptr = glass.get();
+  scene.materials["glas"] = std::move(glass);
+
+  scene.lights.push_back(Light{
+      { 1.0, 2.0, 3.0 }, { 0.1, 0.1, 0.1 }, { 1.0, 0.5, 0.25 }, { 1, 1, 1 }
+  });
+  scene.lights.push_back(Light{
+      { -5.0, 0.0, 5.0 }, { 0, 0, 0 }, { 0.3, 0.3, 0.3 }, { 0.2, 0.2, 0.2 }
+  });
+
+  scene.tree.AddPrimitive(MakeTriangle(0.0, 10, red_ptr));
+  scene.tree.AddPrimitive(MakeTriangle(1.0, 20, glass_ptr));
+  scene.tree.AddPrimitive(MakeTriangle(2.0, 30, nullptr));
+
+  std::vector<uint8_t> bytes;
+  TESTEQ(scene.Serialize(&bytes), true);
+
+  // Round trip.
+  Scene loaded;
+  TESTEQ(loaded.Deserialize(bytes), true);
+
+  TESTEQ(loaded.materials.size(), (size_t)2);
+  TESTEQ(loaded.materials.count("red_"), (size_t)1);
+  TESTEQ(loaded.materials.count("glas"), (size_t)1);
+  const Material *loaded_red = loaded.materials["red_"].get();
+  const Material *loaded_glass = loaded.materials["glas"].get();
+  TESTEQ(loaded_red->ambient, (V3D{ 0.1, 0.0, 0.0 }));
+  TESTEQ(loaded_red->diffuse, (V3D{ 1.0, 0.0, 0.0 }));
+  TESTEQ(loaded_red->specular, (V3D{ 0.5, 0.5, 0.5 }));
+  TESTEQ(loaded_red->specular_exp, 10.0);
+  TESTEQ(loaded_red->tex == nullptr, true);
+  TESTEQ(loaded_glass->transparency, 0.75);
+  TESTEQ(loaded_glass->reflectance, 0.25);
+  TESTEQ(loaded_glass->transmission_filter, (V3D{ 0.0, 1.0, 1.0 }));
+  TESTEQ(loaded_glass->refraction_index, 1.5);
+
+  TESTEQ(loaded.lights.size(), (size_t)2);
+  TESTEQ(loaded.lights[0].position, (V3D{ 1.0, 2.0, 3.0 }));
+  TESTEQ(loaded.lights[0].diffuse, (V3D{ 1.0, 0.5, 0.25 }));
+  TESTEQ(loaded.lights[1].position, (V3D{ -5.0, 0.0, 5.0 }));
+  TESTEQ(loaded.lights[1].specular, (V3D{ 0.2, 0.2, 0.2 }));
+
+  const auto& primitives = loaded.tree.GetPrimitives();
+  TESTEQ(primitives.size(), (size_t)3);
+  const Material *expected_mtl[] = { loaded_red, loaded_glass, nullptr };
+  int i = 0;
+  for (const auto& p : primitives) {
+    const Triangle *tr = dynamic_cast<const Triangle*>(p.get());
+    TESTEQ(tr != nullptr, true);
+    if (tr == nullptr) {
+      break;
+    }
+
+    TESTEQ(tr->vertex[0], (V3D{ 1, 1, (double)i }));
+    TESTEQ(tr->vertex[2], (V3D{ 0, 0, (double)i }));
+    TESTEQ(tr->normal[1], (V3D{ 0, 0, 1 }));
+    TESTEQ(tr->uvw[1], (V3D{ 1, 0, 0 }));
+    TESTEQ(tr->debug_line_no, (i + 1) * 10);
+    TESTEQ(tr->mtl == expected_mtl[i], true);
+    i++;
+  }
+
+  // Serializing the loaded scene gives the same bytes.
+  std::vector<uint8_t> bytes_again;
+  TESTEQ(loaded.Serialize(&bytes_again), true);
+  TESTEQ(bytes_again == bytes, true);
+
+  // Truncated data, down to nothing.
+  for (size_t size = 0; size < bytes.size(); size++) {
+    Scene truncated;
+    std::vector<uint8_t> part(bytes.begin(), bytes.begin() + size);
+    TESTEQ(truncated.Deserialize(part), false);
+  }
+
+  // Trailing garbage.
+  {
+    Scene extended;
+    std::vector<uint8_t> longer = bytes;
+    longer.push_back(0);
+    TESTEQ(extended.Deserialize(longer), false);
+  }
+
+  // Material index of the last triangle (it's followed by the data size and
+  // the triangle data) pointing past the materials.
+  {
+    Scene broken;
+    std::vector<uint8_t> bad = bytes;
+    uint8_t *ptr = &bad[bad.size() - Triangle::kSerializedSize - 8];
+    uint32_t mtl_idx;
+    memcpy(&mtl_idx, ptr, sizeof(mtl_idx));
+    TESTEQ(mtl_idx, (uint32_t)0xffffffff);  // No material.
+    mtl_idx = 2;
+    memcpy(ptr, &mtl_idx, sizeof(mtl_idx));
+    TESTEQ(broken.Deserialize(bad), false);
+  }
+
+  // Texture index of the first material pointing past the (zero) textures.
+  // The header: magic, version, texture options, texture and material count.
+  {
+    Scene broken;
+    std::vector<uint8_t> bad = bytes;
+    const size_t offset =
+        4 * sizeof(uint32_t) + 3 * sizeof(uint32_t) +
+        sizeof(uint32_t) + 4 /* name */ +
+        4 * sizeof(V3D) + 4 * sizeof(V3D::basetype);
+    uint32_t tex_idx;
+    memcpy(&tex_idx, &bad[offset], sizeof(tex_idx));
+    TESTEQ(tex_idx, (uint32_t)0xffffffff);  // No texture.
+    tex_idx = 0;
+    memcpy(&bad[offset], &tex_idx, sizeof(tex_idx));
+    TESTEQ(broken.Deserialize(bad), false);
+  }
+
+  // Two materials with the same name (the first one, "glas", renamed).
+  {
+    Scene broken;
+    std::vector<uint8_t> bad = bytes;
+    const char kName[] = "glas";
+    auto name = std::search(bad.begin(), bad.end(), kName, kName + 4);
+    TESTEQ(name != bad.end(), true);
+    memcpy(&*name, "red_", 4);
+    TESTEQ(broken.Deserialize(bad), false);
+  }
+
+  return 0;
+}
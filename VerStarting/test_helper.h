@@ -1,5 +1,6 @@
 #pragma once
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
 #include <iostream>
 
@@ -58,4 +59,10 @@ inline void TestEq(V3D a, V3D b, const char *str_a, int line) {
 
 #define TESTEQ(a, b) TestEq((a), (b), #a, __LINE__)
 
+// Simple deterministic pseudo-random numbers in the [0, 1) range.
+inline double Rand(uint32_t *state) {
+  *state = *state * 1103515245 + 12345;
+  return (double)((*state >> 8) & 0xffff) / 65536.0;
+}
+
 }  // namespace test
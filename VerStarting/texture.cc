@@ -1,16 +1,56 @@
 #include <SDL2/SDL_image.h>
 #include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+#include "half.h"
 #include "math3d.h"
 #include "texture.h"
+#include "texture_cache.h"
 
 
 namespace raytracer {
 
 using math3d::V3D;
 
-V3D Texture::GetColorAt(double u, double v, double distance) const {
-  (void)distance; // TODO(gynvael): Add mipmaps.
+namespace {
 
+// 8-bit to linear value conversion tables.
+struct ByteDecodeTables {
+  float linear[256];
+  float srgb[256];
+
+  ByteDecodeTables() {
+    for (int i = 0; i < 256; i++) {
+      const float c = (float)i / 255.0f;
+      linear[i] = c;
+      srgb[i] = c <= 0.04045f ? c / 12.92f :
+                                powf((c + 0.055f) / 1.055f, 2.4f);
+    }
+  }
+};
+
+const ByteDecodeTables kByteDecode;
+
+uint8_t EncodeByte(float c, bool srgb) {
+  c = std::min(std::max(c, 0.0f), 1.0f);
+  if (srgb) {
+    c = c <= 0.0031308f ? c * 12.92f :
+                          1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+  }
+  return (uint8_t)(c * 255.0f + 0.5f);
+}
+
+size_t BytesPerTexel(TexelFormat format) {
+  return format == TexelFormat::kRGBA8 ? 4 : 8;
+}
+
+}  // namespace
+
+V3D Texture::GetColorAt(double u, double v, double footprint) const {
   u = fmod(u, 1.0);
   v = fmod(v, 1.0);
   if (u < 0.0) u += 1.0;
@@ -19,6 +59,144 @@ V3D Texture::GetColorAt(double u, double v, double distance) const {
   // Flip the vertical.
   v = 1.0 - v;
 
+  // Lazy textures need to be loaded at least once to know their size. If
+  // that fails, act as if there was no texture.
+  const V3D kNoTexture{ 1.0, 1.0, 1.0 };
+  if (cache != nullptr && !loaded.load(std::memory_order_acquire)) {
+    if (!LoadLevels(0)) {
+      return kNoTexture;
+    }
+    cache->EvictUnused();
+  }
+
+  // Texture failed to load in the background (see TextureLoader).
+  if (mip_levels.empty()) {
+    return kNoTexture;
+  }
+
+  // Level of detail, i.e. log2 of the footprint size in texels of the full
+  // resolution level.
+  const MipLevel& base = mip_levels[0];
+  const double texels = footprint * (double)std::max(base.width, base.height);
+  const double lod = texels > 1.0 ? log2(texels) : 0.0;  // Also takes NaNs.
+  const size_t last_level = mip_levels.size() - 1;
+  size_t level = (size_t)lod;
+  float blend = 0.0f;  // Towards level + 1.
+
+  if (level >= last_level) {
+    level = last_level;
+  } else {
+    blend = (float)(lod - (double)level);
+  }
+
+  if (!UseLevel(level) || (blend != 0.0f && !UseLevel(level + 1))) {
+    return kNoTexture;
+  }
+
+  float c[4];
+  GetColorAtLevel(mip_levels[level], u, v, c);
+  if (blend != 0.0f) {
+    float c_next[4];
+    GetColorAtLevel(mip_levels[level + 1], u, v, c_next);
+    for (int i = 0; i < 3; i++) {
+      c[i] += (c_next[i] - c[i]) * blend;
+    }
+  }
+
+  return { c[0], c[1], c[2] };
+}
+
+bool Texture::UseLevel(size_t level) const {
+  if (cache == nullptr) {
+    return true;  // Not a lazy texture, everything is always in memory.
+  }
+
+  // The level must be marked as used before checking whether it's resident
+  // (see TextureCache::Evict). Once marked, it can't be evicted until the
+  // next epoch.
+  LevelState& state = level_state[level];
+  const uint32_t epoch = cache->GetEpoch();
+  const bool first_use =
+      state.last_used.load(std::memory_order_acquire) != epoch;
+  if (first_use) {
+    state.last_used.store(epoch);
+  }
+
+  if (!state.resident.load()) {
+    if (!LoadLevels(level)) {
+      return false;
+    }
+    cache->EvictUnused();
+  } else if (first_use) {
+    cache->OnHit();
+  }
+
+  return true;
+}
+
+bool Texture::LoadLevels(size_t level) const {
+  std::lock_guard<std::mutex> lock(load_mutex);
+  if (failed) {
+    return false;
+  }
+
+  // Another thread might have loaded it in the meantime.
+  if (loaded.load() && level_state[level].resident.load()) {
+    return true;
+  }
+
+  // Since the mip levels are generated from the full image, the whole file
+  // needs to be loaded anyway, but only the missing levels are kept.
+  TextureOptions eager_options = options;
+  eager_options.lazy = false;
+  std::unique_ptr<Texture> fresh(
+      file_data.empty() ?
+      LoadFromFile(path.c_str(), eager_options) :
+      LoadFromMemory(
+          file_data.data(), file_data.size(), path.c_str(), eager_options));
+  if (fresh == nullptr) {
+    fprintf(stderr, "error: cannot load texture \"%s\"\n", path.c_str());
+    failed = true;
+    return false;
+  }
+
+  const uint32_t epoch = cache->GetEpoch();
+  size_t levels_loaded = 0;
+  size_t bytes_loaded = 0;
+
+  if (!loaded.load()) {
+    mip_levels = std::move(fresh->mip_levels);
+    level_state.reset(new LevelState[mip_levels.size()]);
+    for (size_t i = 0; i < mip_levels.size(); i++) {
+      level_state[i].last_used = epoch;
+      level_state[i].resident = true;
+      levels_loaded++;
+      bytes_loaded += mip_levels[i].texels.size();
+    }
+    loaded.store(true, std::memory_order_release);
+  } else {
+    for (size_t i = 0; i < mip_levels.size(); i++) {
+      if (level_state[i].resident.load()) {
+        continue;
+      }
+
+      mip_levels[i].texels = std::move(fresh->mip_levels[i].texels);
+      level_state[i].last_used = epoch;
+      level_state[i].resident.store(true, std::memory_order_release);
+      levels_loaded++;
+      bytes_loaded += mip_levels[i].texels.size();
+    }
+  }
+
+  cache->OnLoad(levels_loaded, bytes_loaded);
+  return true;
+}
+
+void Texture::GetColorAtLevel(
+    const MipLevel& level, double u, double v, float rgba[4]) const {
+  const size_t width = level.width;
+  const size_t height = level.height;
+
   double x = u * (double)(width - 1);
   double y = v * (double)(height - 1);
 
@@ -36,36 +214,167 @@ V3D Texture::GetColorAt(double u, double v, double distance) const {
       base_y + 1 == height ? base_y : base_y + 1 }
   };
 
-  V3D c[4];
+  float c[4][4];
   for (int i = 0; i < 4; i++) {
-    c[i] = colors.at(coords[i][0] + coords[i][1] * width);
+    DecodeTexel(level, GetTexelIndex(level, coords[i][0], coords[i][1]), c[i]);
   }
 
-  double dist_x = fmod(x, 1.0);
-  double dist_y = fmod(y, 1.0);
+  float dist_x = (float)fmod(x, 1.0);
+  float dist_y = (float)fmod(y, 1.0);
 
-  double area[4] = {
-    (1.0 - dist_x) * (1.0 - dist_y),
-    dist_x * (1.0 - dist_y),
-    (1.0 - dist_x) * dist_y,
+  float area[4] = {
+    (1.0f - dist_x) * (1.0f - dist_y),
+    dist_x * (1.0f - dist_y),
+    (1.0f - dist_x) * dist_y,
     dist_x * dist_y
-  };  
+  };
+
+#ifdef __SSE2__
+  __m128 res = _mm_mul_ps(_mm_loadu_ps(c[0]), _mm_set1_ps(area[0]));
+  res = _mm_add_ps(res, _mm_mul_ps(_mm_loadu_ps(c[1]), _mm_set1_ps(area[1])));
+  res = _mm_add_ps(res, _mm_mul_ps(_mm_loadu_ps(c[2]), _mm_set1_ps(area[2])));
+  res = _mm_add_ps(res, _mm_mul_ps(_mm_loadu_ps(c[3]), _mm_set1_ps(area[3])));
+  _mm_storeu_ps(rgba, res);
+#else
+  for (int k = 0; k < 4; k++) {
+    rgba[k] = c[0][k] * area[0] +
+              c[1][k] * area[1] +
+              c[2][k] * area[2] +
+              c[3][k] * area[3];
+  }
+#endif
+}
+
+void Texture::DecodeTexel(
+    const MipLevel& level, size_t idx, float rgba[4]) const {
+  if (options.format == TexelFormat::kRGBA8) {
+    const uint8_t *px = &level.texels[idx * 4];
+    const float *table = options.srgb ? kByteDecode.srgb : kByteDecode.linear;
+    rgba[0] = table[px[0]];
+    rgba[1] = table[px[1]];
+    rgba[2] = table[px[2]];
+    rgba[3] = kByteDecode.linear[px[3]];  // Alpha is always linear.
+    return;
+  }
+
+  uint16_t px[4];
+  memcpy(px, &level.texels[idx * 8], sizeof(px));
+  for (int i = 0; i < 4; i++) {
+    rgba[i] = HalfToFloat(px[i]);
+  }
+}
 
-  return c[0] * area[0] +
-         c[1] * area[1] +
-         c[2] * area[2] +
-         c[3] * area[3];
+void Texture::EncodeTexel(
+    const float rgba[4], MipLevel *level, size_t idx) const {
+  if (options.format == TexelFormat::kRGBA8) {
+    uint8_t *px = &level->texels[idx * 4];
+    px[0] = EncodeByte(rgba[0], options.srgb);
+    px[1] = EncodeByte(rgba[1], options.srgb);
+    px[2] = EncodeByte(rgba[2], options.srgb);
+    px[3] = EncodeByte(rgba[3], false);
+    return;
+  }
+
+  uint16_t px[4];
+  for (int i = 0; i < 4; i++) {
+    px[i] = FloatToHalf(rgba[i]);
+  }
+  memcpy(&level->texels[idx * 8], px, sizeof(px));
 }
 
-Texture *Texture::LoadFromFile(const char *fname) {
+void Texture::AllocateLevel(MipLevel *level) const {
+  size_t texel_count = level->width * level->height;
+
+  // Tiled levels are padded to whole tiles.
+  if (options.tiled) {
+    level->tiles_per_row = (level->width + kTileSize - 1) / kTileSize;
+    const size_t tile_rows = (level->height + kTileSize - 1) / kTileSize;
+    texel_count = level->tiles_per_row * tile_rows * kTileSize * kTileSize;
+  }
+
+  level->texels.resize(texel_count * BytesPerTexel(options.format));
+}
+
+void Texture::GenerateMipLevels() {
+  while (mip_levels.back().width > 1 || mip_levels.back().height > 1) {
+    const MipLevel& src = mip_levels.back();
+    MipLevel dst;
+    dst.width = std::max(src.width / 2, (size_t)1);
+    dst.height = std::max(src.height / 2, (size_t)1);
+    AllocateLevel(&dst);
+
+    // Box filter (on linear values). For odd sizes the last row/column of the
+    // source level is skipped; it's a mipmap, no one will notice.
+    for (size_t j = 0; j < dst.height; j++) {
+      const size_t y0 = std::min(j * 2, src.height - 1);
+      const size_t y1 = std::min(j * 2 + 1, src.height - 1);
+      for (size_t i = 0; i < dst.width; i++) {
+        const size_t x0 = std::min(i * 2, src.width - 1);
+        const size_t x1 = std::min(i * 2 + 1, src.width - 1);
+
+        float c[4][4];
+        DecodeTexel(src, GetTexelIndex(src, x0, y0), c[0]);
+        DecodeTexel(src, GetTexelIndex(src, x1, y0), c[1]);
+        DecodeTexel(src, GetTexelIndex(src, x0, y1), c[2]);
+        DecodeTexel(src, GetTexelIndex(src, x1, y1), c[3]);
+
+        float avg[4];
+        for (int k = 0; k < 4; k++) {
+          avg[k] = (c[0][k] + c[1][k] + c[2][k] + c[3][k]) * 0.25f;
+        }
+
+        EncodeTexel(avg, &dst, GetTexelIndex(dst, i, j));
+      }
+    }
+
+    // Note: This might invalidate src.
+    mip_levels.push_back(std::move(dst));
+  }
+}
+
+size_t Texture::GetMemoryUsage() const {
+  size_t sz = 0;
+  for (const auto& level : mip_levels) {
+    sz += level.texels.size();
+  }
+  return sz;
+}
+
+Texture *Texture::LoadFromFile(
+    const char *fname, const TextureOptions& options) {
   fprintf(stderr, "info: loading texture \"%s\"\n", fname);
+  Texture *tex = LoadFromSurface(IMG_Load(fname), fname, options);
+  if (tex != nullptr) {
+    tex->path = fname;
+  }
+  return tex;
+}
+
+Texture *Texture::LoadFromMemory(
+    const uint8_t *data, size_t size, const char *name,
+    const TextureOptions& options) {
+  fprintf(stderr, "info: loading texture \"%s\" from memory\n", name);
+  SDL_RWops *rw = SDL_RWFromConstMem(data, (int)size);
+  if (rw == nullptr) {
+    return nullptr;
+  }
+
+  Texture *tex = LoadFromSurface(IMG_Load_RW(rw, /*freesrc=*/1), name, options);
+  if (tex != nullptr) {
+    tex->path = name;
+  }
+  return tex;
+}
+
+Texture *Texture::LoadFromSurface(
+    SDL_Surface *surface, const char *fname, const TextureOptions& options) {
   struct SDLSurfaceDeleter {
     void operator()(SDL_Surface *s) const {
       SDL_FreeSurface(s);
     }
   };
 
-  std::unique_ptr<SDL_Surface, SDLSurfaceDeleter> s(IMG_Load(fname));
+  std::unique_ptr<SDL_Surface, SDLSurfaceDeleter> s(surface);
   if (s == nullptr) {
     return nullptr;
   }
@@ -87,26 +396,74 @@ Texture *Texture::LoadFromFile(const char *fname) {
     }
   }
 
-  // Allocate and convert texture.
+  Texture *tex = CreateFromRGBA8(
+      (size_t)s->w, (size_t)s->h, (const uint8_t*)s->pixels,
+      (size_t)s->pitch, options);
+
+  fprintf(stderr, "info: texture %ix%i, %zu mip levels, %.1f MB\n",
+          s->w, s->h, tex->mip_levels.size(),
+          (double)tex->GetMemoryUsage() / (1024.0 * 1024.0));
+
+  return tex;
+}
+
+Texture *Texture::CreateLazy(
+    const char *fname, const TextureOptions& options, TextureCache *cache) {
+  std::unique_ptr<Texture> tex(new Texture);
+  tex->options = options;
+  tex->path = fname;
+  tex->cache = cache;
+  cache->Register(tex.get());
+  return tex.release();
+}
+
+Texture *Texture::CreateLazyFromMemory(
+    std::vector<uint8_t> file, const char *name,
+    const TextureOptions& options, TextureCache *cache) {
+  Texture *tex = CreateLazy(name, options, cache);
+  tex->file_data = std::move(file);
+  return tex;
+}
+
+Texture *Texture::CreateFromRGBA8(
+    size_t width, size_t height, const uint8_t *pixels, size_t pitch,
+    const TextureOptions& options) {
   std::unique_ptr<Texture> tex(new Texture);
-  tex->width = (size_t)s->w;
-  tex->height = (size_t)s->h;
-  tex->colors.resize(tex->width * tex->height);
-
-  size_t idx = 0;
-  uint8_t *px = (uint8_t*)s->pixels;
-  for (size_t j = 0; j < tex->height; j++) {
-    for (size_t i = 0; i < tex->width; i++, idx++, px += 4) {
-      tex->colors[idx] = {
-        (double)px[0] / 255.0,
-        (double)px[1] / 255.0,
-        (double)px[2] / 255.0
-      };
+  tex->options = options;
+  tex->mip_levels.resize(1);
+  Texture::MipLevel& level = tex->mip_levels[0];
+  level.width = width;
+  level.height = height;
+  tex->AllocateLevel(&level);
+
+  for (size_t j = 0; j < level.height; j++) {
+    const uint8_t *px = pixels + j * pitch;
+
+    // RGBA32 is already the 8-bit texel format, so just copy the pixels over
+    // (a tile-wide run at a time if tiled).
+    if (options.format == TexelFormat::kRGBA8) {
+      const size_t run = options.tiled ? kTileSize : level.width;
+      for (size_t i = 0; i < level.width; i += run) {
+        memcpy(&level.texels[tex->GetTexelIndex(level, i, j) * 4], px + i * 4,
+               std::min(run, level.width - i) * 4);
+      }
+      continue;
+    }
+
+    for (size_t i = 0; i < level.width; i++, px += 4) {
+      float rgba[4];
+      const float *table =
+          options.srgb ? kByteDecode.srgb : kByteDecode.linear;
+      rgba[0] = table[px[0]];
+      rgba[1] = table[px[1]];
+      rgba[2] = table[px[2]];
+      rgba[3] = kByteDecode.linear[px[3]];
+      tex->EncodeTexel(rgba, &level, tex->GetTexelIndex(level, i, j));
     }
   }
-  
+
+  tex->GenerateMipLevels();
   return tex.release();
 }
 
 };  // namespace raytracer
-
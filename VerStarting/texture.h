@@ -1,25 +1,172 @@
 #pragma once
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include <stdint.h>
 #include "math3d.h"
 #include "texture.h"
 
+struct SDL_Surface;
+
 namespace raytracer {
 
 using math3d::V3D;
 
+class TextureCache;
+class TextureLoader;
+
+enum class TexelFormat {
+  kRGBA8,    // 4 bytes per texel.
+  kRGBA16F,  // Half-floats, 8 bytes per texel.
+};
+
+struct TextureOptions {
+  TexelFormat format = TexelFormat::kRGBA8;
+
+  // Treat the source images as sRGB encoded, i.e. convert them to linear
+  // values (when sampling for 8-bit texels, at load time for half-floats).
+  // Off by default, as the rendered image isn't gamma encoded either (see
+  // MythTracer::V3DtoRGB).
+  bool srgb = false;
+
+  // Store texels in 8x8 tiles instead of rows, so that the texels read by a
+  // bilinear lookup (and by lookups of neighboring rays) are close in memory.
+  bool tiled = true;
+
+  // Decode the image only once the texture is actually sampled, and keep it
+  // in memory only as long as the texture cache allows (see TextureCache).
+  // Off by default, as eagerly loaded textures are decoded in parallel while
+  // the scene is being read (see TextureLoader). Useful if the textures don't
+  // fit in memory, or if most of them are never sampled.
+  bool lazy = false;
+
+  // Share a single texture between files with identical contents.
+  bool dedup = true;
+};
+
 class Texture {
  public:
-  // Retrieves the interpolated color for the uv location at the given distance.
-  V3D GetColorAt(double u, double v, double distance) const;
+  // Retrieves the interpolated color for the uv location. The footprint is the
+  // size of the sampled area in UV units (e.g. the pixel projected onto the
+  // surface) and is used to pick the mip levels, which are then filtered
+  // trilinearly. Zero means the full resolution level.
+  V3D GetColorAt(double u, double v, double footprint) const;
+
+  static Texture *LoadFromFile(
+      const char *fname, const TextureOptions& options = TextureOptions{});
+
+  // Decodes an image file which is already in memory. The name is used only
+  // for messages and as the texture's path (see GetPath).
+  static Texture *LoadFromMemory(
+      const uint8_t *data, size_t size, const char *name,
+      const TextureOptions& options = TextureOptions{});
+
+  // Creates a texture from 8-bit RGBA pixels.
+  static Texture *CreateFromRGBA8(
+      size_t width, size_t height, const uint8_t *pixels, size_t pitch,
+      const TextureOptions& options = TextureOptions{});
+
+  // Creates a texture which is loaded from the file on first use, and whose
+  // mip levels can be evicted by the cache (and get reloaded if needed).
+  static Texture *CreateLazy(
+      const char *fname, const TextureOptions& options, TextureCache *cache);
+
+  // Same as above, but for an image file which is already in memory (e.g. a
+  // scene received over the network). The file is kept, as it's needed to
+  // reload evicted levels. The name is used only for messages and as the
+  // texture's path.
+  static Texture *CreateLazyFromMemory(
+      std::vector<uint8_t> file, const char *name,
+      const TextureOptions& options, TextureCache *cache);
+
+  static const size_t kTileSize = 8;  // In texels, both dimensions.
+
+  struct MipLevel {
+    size_t width = 0;
+    size_t height = 0;
+    size_t tiles_per_row = 0;  // Only for tiled textures.
+    std::vector<uint8_t> texels;  // RGBA, packed according to the format.
+  };
+
+  // Builds the rest of the mip pyramid from the first level (which needs to
+  // be the only one present).
+  void GenerateMipLevels();
+
+  // Number of bytes used by the texel data of all levels.
+  size_t GetMemoryUsage() const;
+
+  // The file the texture was loaded from, or an empty string if it was
+  // created from pixels.
+  const std::string& GetPath() const { return path; }
+
+  // The image file of a lazy texture created from memory, otherwise empty.
+  const std::vector<uint8_t>& GetFileData() const { return file_data; }
+
+  TextureOptions options;
+
+  // Level 0 is the full resolution image, each next one is half the size (in
+  // both dimensions), down to 1x1.
+  // Note: For lazy textures this is empty until the first load, and then the
+  // texels of each level are present only if it's resident (hence mutable).
+  mutable std::vector<MipLevel> mip_levels;
+
+ private:
+  friend TextureCache;
+  friend TextureLoader;
+
+  // Takes ownership of the surface.
+  static Texture *LoadFromSurface(
+      SDL_Surface *surface, const char *fname, const TextureOptions& options);
+
+  // Residency of a mip level of a lazy texture.
+  struct LevelState {
+    std::atomic<bool> resident{false};
+    std::atomic<uint32_t> last_used{0};  // TextureCache epoch.
+  };
+
+  // Makes sure the texels of the level are in memory (loading the file if
+  // needed) and marks the level as used. Returns false if the texture
+  // couldn't be loaded.
+  bool UseLevel(size_t level) const;
+  bool LoadLevels(size_t level) const;
+
+  // Lazy loading state. Note that these are mutable, as from the outside
+  // point of view sampling doesn't change the texture.
+  // Note: The path is also set for eagerly loaded textures (see GetPath).
+  std::string path;
+  std::vector<uint8_t> file_data;  // If set, used instead of the path.
+  TextureCache *cache = nullptr;
+  mutable std::mutex load_mutex;
+  mutable std::atomic<bool> loaded{false};
+  mutable std::atomic<bool> failed{false};
+  mutable std::unique_ptr<LevelState[]> level_state;
+
+  // Bilinear filtering within a single level. The uv coordinates need to be
+  // already wrapped to the [0, 1) range. Returns RGBA.
+  void GetColorAtLevel(
+      const MipLevel& level, double u, double v, float rgba[4]) const;
+
+  // Allocates the texel storage of the level (with width and height already
+  // set).
+  void AllocateLevel(MipLevel *level) const;
+
+  // Index of the texel in the level's storage (in texels, not bytes).
+  size_t GetTexelIndex(const MipLevel& level, size_t x, size_t y) const {
+    if (!options.tiled) {
+      return x + y * level.width;
+    }
 
-  static Texture *LoadFromFile(const char *fname);
+    const size_t tile = (x / kTileSize) + (y / kTileSize) * level.tiles_per_row;
+    return tile * kTileSize * kTileSize +
+           (x % kTileSize) + (y % kTileSize) * kTileSize;
+  }
 
-  size_t width = 0;
-  size_t height = 0;
-  std::vector<V3D> colors;
+  // Converts a texel to linear RGBA.
+  void DecodeTexel(const MipLevel& level, size_t idx, float rgba[4]) const;
+  void EncodeTexel(const float rgba[4], MipLevel *level, size_t idx) const;
 };
 
 typedef std::unordered_map<std::string, std::unique_ptr<Texture>> TextureMap;
@@ -0,0 +1,115 @@
+// Texture sampling benchmark. Compares row-major and tiled texel layouts on
+// a large synthetic texture, using a few access patterns.
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include "test_helper.h"
+#include "texture.h"
+
+using math3d::V3D;
+using namespace raytracer;
+using test::Rand;
+
+const size_t kTextureSize = 4096;
+const int kScreenSize = 1024;
+
+// Texture coordinates of the given screen pixel.
+struct UVMapping {
+  const char *name;
+  double angle;  // Rotation of the texture on the screen, in degrees.
+  double scale;  // Texels per pixel.
+  bool random;
+};
+
+static double Benchmark(const Texture& tex, const UVMapping& mapping,
+                        double *checksum) {
+  const double c = cos(math3d::Deg2Rad(mapping.angle));
+  const double s = sin(math3d::Deg2Rad(mapping.angle));
+  const double texel = 1.0 / (double)kTextureSize;
+  const double footprint = mapping.scale * texel;
+  uint32_t rand_state = 1;
+
+  auto start = std::chrono::steady_clock::now();
+
+  V3D sum;
+  for (int y = 0; y < kScreenSize; y++) {
+    for (int x = 0; x < kScreenSize; x++) {
+      double u, v;
+      if (mapping.random) {
+        u = Rand(&rand_state);
+        v = Rand(&rand_state);
+      } else {
+        u = (x * c - y * s) * footprint;
+        v = (x * s + y * c) * footprint;
+      }
+      sum += tex.GetColorAt(u, v, footprint);
+    }
+  }
+
+  auto end = std::chrono::steady_clock::now();
+  *checksum += sum.v[0] + sum.v[1] + sum.v[2];
+
+  const double seconds = std::chrono::duration<double>(end - start).count();
+  return (double)kScreenSize * kScreenSize / seconds / 1e6;
+}
+
+int main(void) {
+  // Something with some detail, so that all the texels are different.
+  std::vector<uint8_t> pixels(kTextureSize * kTextureSize * 4);
+  uint32_t rand_state = 1;
+  for (auto& px : pixels) {
+    px = (uint8_t)(Rand(&rand_state) * 256.0);
+  }
+
+  const UVMapping mappings[] = {
+    { "aligned 1:1", 0.0, 1.0, false },
+    { "rotated 1:1", 30.0, 1.0, false },
+    { "vertical 1:1", 90.0, 1.0, false },  // Walks down the columns.
+    { "rotated 4:1", 30.0, 4.0, false },  // Minified, i.e. a distant surface.
+    { "random", 0.0, 1.0, true },
+  };
+
+  const struct {
+    const char *name;
+    TexelFormat format;
+  } formats[] = {
+    { "RGBA8", TexelFormat::kRGBA8 },
+    { "RGBA16F", TexelFormat::kRGBA16F },
+  };
+
+  printf("%ux%u texture, %ux%u samples per test, Msamples/s\n",
+         (unsigned)kTextureSize, (unsigned)kTextureSize,
+         kScreenSize, kScreenSize);
+  printf("%-8s %-12s %10s %10s %8s\n",
+         "format", "mapping", "row-major", "tiled", "speedup");
+
+  double checksum = 0.0;
+  for (const auto& format : formats) {
+    TextureOptions options;
+    options.format = format.format;
+
+    options.tiled = false;
+    std::unique_ptr<Texture> linear(Texture::CreateFromRGBA8(
+        kTextureSize, kTextureSize, &pixels[0], kTextureSize * 4, options));
+
+    options.tiled = true;
+    std::unique_ptr<Texture> tiled(Texture::CreateFromRGBA8(
+        kTextureSize, kTextureSize, &pixels[0], kTextureSize * 4, options));
+
+    for (const auto& mapping : mappings) {
+      const double linear_speed = Benchmark(*linear, mapping, &checksum);
+      const double tiled_speed = Benchmark(*tiled, mapping, &checksum);
+      printf("%-8s %-12s %10.2f %10.2f %7.2fx\n",
+             format.name, mapping.name, linear_speed, tiled_speed,
+             tiled_speed / linear_speed);
+    }
+  }
+
+  // Prevents the compiler from optimizing the sampling away.
+  printf("(checksum %f)\n", checksum);
+
+  return 0;
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <algorithm>
+#include "texture_cache.h"
+
+namespace raytracer {
+
+void TextureCache::Register(Texture *tex) {
+  std::lock_guard<std::mutex> lock(m);
+  textures.push_back(tex);
+}
+
+void TextureCache::OnLoad(size_t levels, size_t bytes) {
+  misses.fetch_add(levels, std::memory_order_relaxed);
+  const uint64_t resident =
+      bytes_resident.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+  uint64_t peak = bytes_peak.load(std::memory_order_relaxed);
+  while (resident > peak &&
+         !bytes_peak.compare_exchange_weak(peak, resident)) {
+  }
+}
+
+void TextureCache::Trim() {
+  std::lock_guard<std::mutex> lock(m);
+  epoch.fetch_add(1, std::memory_order_relaxed);
+  Evict();
+}
+
+void TextureCache::EvictUnused() {
+  if (bytes_resident.load(std::memory_order_relaxed) <= capacity) {
+    return;
+  }
+
+  // If another thread is already evicting, there is no point in waiting.
+  std::unique_lock<std::mutex> lock(m, std::try_to_lock);
+  if (lock.owns_lock()) {
+    Evict();
+  }
+}
+
+void TextureCache::Evict() {
+  if (bytes_resident.load() <= capacity) {
+    return;
+  }
+
+  const uint32_t current_epoch = epoch.load(std::memory_order_relaxed);
+
+  struct Candidate {
+    uint32_t last_used;
+    Texture *tex;
+    size_t level;
+  };
+
+  std::vector<Candidate> candidates;
+  for (Texture *tex : textures) {
+    if (!tex->loaded.load()) {
+      continue;
+    }
+
+    for (size_t i = 0; i < tex->mip_levels.size(); i++) {
+      const Texture::LevelState& state = tex->level_state[i];
+      const uint32_t last_used = state.last_used.load();
+      if (state.resident.load() && last_used != current_epoch) {
+        candidates.push_back({ last_used, tex, i });
+      }
+    }
+  }
+
+  // Oldest first. For levels used at the same time, evict the bigger (i.e.
+  // more detailed) ones first, as these are likely to be needed only by a
+  // small part of the image anyway.
+  std::sort(candidates.begin(), candidates.end(),
+      [](const Candidate& a, const Candidate& b) {
+        if (a.last_used != b.last_used) {
+          return a.last_used < b.last_used;
+        }
+        return a.level < b.level;
+      });
+
+  for (const auto& c : candidates) {
+    if (bytes_resident.load() <= capacity) {
+      break;
+    }
+
+    // The level is first marked as not resident, and only then checked for
+    // being used. Texture::UseLevel does the opposite (marks the level as
+    // used and then checks whether it's resident), so either the level is
+    // left alone here, or the texture sees it's gone and reloads it (which
+    // waits for the load_mutex).
+    std::lock_guard<std::mutex> tex_lock(c.tex->load_mutex);
+    Texture::LevelState& state = c.tex->level_state[c.level];
+    if (!state.resident.load()) {
+      continue;
+    }
+
+    state.resident = false;
+    if (state.last_used.load() == current_epoch) {
+      state.resident = true;
+      continue;
+    }
+
+    Texture::MipLevel& level = c.tex->mip_levels[c.level];
+    bytes_resident -= level.texels.size();
+    std::vector<uint8_t>().swap(level.texels);
+    evictions++;
+  }
+}
+
+void TextureCache::PrintStats() const {
+  printf("Texture cache: %llu hits, %llu misses, %llu evictions, "
+         "%.1f MB resident (peak %.1f MB, capacity %.1f MB)\n",
+         (unsigned long long)hits.load(),
+         (unsigned long long)misses.load(),
+         (unsigned long long)evictions.load(),
+         (double)bytes_resident.load() / (1024.0 * 1024.0),
+         (double)bytes_peak.load() / (1024.0 * 1024.0),
+         (double)capacity / (1024.0 * 1024.0));
+}
+
+}  // namespace raytracer
+
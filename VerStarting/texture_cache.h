@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include "texture.h"
+
+namespace raytracer {
+
+// Keeps track of the memory used by lazily loaded textures and evicts their
+// least recently used mip levels when over capacity. Levels are loaded on
+// demand by the textures themselves. While rendering, only levels which
+// weren't used in the current epoch can be evicted (a texture marks a level
+// as used before reading it), so that sampling doesn't need any locking.
+class TextureCache {
+ public:
+  static const size_t kDefaultCapacity = (size_t)1 << 30;  // 1 GB.
+
+  // Capacity in bytes of texel data. Note that the cache might still go over
+  // the capacity if a single render uses more than that.
+  size_t capacity = kDefaultCapacity;
+
+  // Adds a lazy texture to the cache (Texture::CreateLazy does this).
+  void Register(Texture *tex);
+
+  // Starts a new epoch (i.e. render) and evicts the least recently used mip
+  // levels until the resident size fits the capacity.
+  // Note: This must not be called while any texture might be sampled.
+  void Trim();
+
+  // If over capacity, evicts the least recently used mip levels which weren't
+  // used in the current epoch. Textures call this after loading a level; it's
+  // safe to call while rendering.
+  void EvictUnused();
+
+  uint32_t GetEpoch() const {
+    return epoch.load(std::memory_order_relaxed);
+  }
+
+  // Called by textures.
+  void OnHit() { hits.fetch_add(1, std::memory_order_relaxed); }
+  void OnLoad(size_t levels, size_t bytes);
+
+  void PrintStats() const;
+
+ private:
+  std::mutex m;  // Guards textures.
+  std::vector<Texture*> textures;
+  std::atomic<uint32_t> epoch{1};
+
+  std::atomic<uint64_t> hits{0};  // First use of a resident level per epoch.
+  std::atomic<uint64_t> misses{0};  // Level wasn't resident, file was loaded.
+  std::atomic<uint64_t> evictions{0};  // Mip levels.
+  std::atomic<uint64_t> bytes_resident{0};
+  std::atomic<uint64_t> bytes_peak{0};
+
+  // Evicts levels not used in the current epoch until the resident size fits
+  // the capacity. Requires m to be locked.
+  void Evict();
+};
+
+}  // namespace raytracer
+
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <algorithm>
+#include <memory>
+#include "texture_loader.h"
+
+namespace raytracer {
+
+TextureLoader::TextureLoader(unsigned thread_count)
+    : thread_count(thread_count) {
+  if (this->thread_count == 0) {
+    this->thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+}
+
+TextureLoader::~TextureLoader() {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    quit = true;
+  }
+  job_available.notify_all();
+
+  // Note: Workers finish the remaining jobs before quitting.
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+void TextureLoader::Enqueue(Texture *tex, const std::string& path) {
+  Enqueue({ tex, path, nullptr, 0 });
+}
+
+void TextureLoader::Enqueue(Texture *tex, const uint8_t *data, size_t size,
+                            const std::string& name) {
+  Enqueue({ tex, name, data, size });
+}
+
+void TextureLoader::Enqueue(Job job) {
+  {
+    std::lock_guard<std::mutex> lock(m);
+    if (jobs.empty() && jobs_in_progress == 0) {
+      first_job_time = std::chrono::steady_clock::now();
+    }
+    jobs.push_back(std::move(job));
+
+    if (threads.size() < thread_count) {
+      threads.emplace_back(&TextureLoader::WorkerThread, this);
+    }
+  }
+  job_available.notify_one();
+}
+
+size_t TextureLoader::Wait() {
+  std::unique_lock<std::mutex> lock(m);
+  job_done.wait(lock, [this] {
+      return jobs.empty() && jobs_in_progress == 0;
+  });
+
+  if (textures_decoded + textures_failed != 0) {
+    const double wall_ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - first_job_time).count();
+    fprintf(stderr,
+            "info: decoded %zu textures (%zu failed) in %.1f ms, "
+            "%.1f ms of decoding on %zu threads\n",
+            textures_decoded, textures_failed, wall_ms, decode_ms,
+            threads.size());
+  }
+
+  const size_t failed = textures_failed;
+  textures_decoded = 0;
+  textures_failed = 0;
+  decode_ms = 0.0;
+  return failed;
+}
+
+void TextureLoader::WorkerThread() {
+  std::unique_lock<std::mutex> lock(m);
+  for (;;) {
+    job_available.wait(lock, [this] { return quit || !jobs.empty(); });
+    if (jobs.empty()) {
+      return;  // Quitting.
+    }
+
+    Job job = std::move(jobs.front());
+    jobs.pop_front();
+    jobs_in_progress++;
+    lock.unlock();
+
+    const auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<Texture> decoded(
+        job.data != nullptr ?
+        Texture::LoadFromMemory(
+            job.data, job.size, job.path.c_str(), job.tex->options) :
+        Texture::LoadFromFile(job.path.c_str(), job.tex->options));
+    if (decoded != nullptr) {
+      job.tex->mip_levels = std::move(decoded->mip_levels);
+      job.tex->path = std::move(decoded->path);
+    }
+    const double ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+
+    if (decoded != nullptr) {
+      fprintf(stderr, "info: texture \"%s\" decoded in %.1f ms\n",
+              job.path.c_str(), ms);
+    } else {
+      fprintf(stderr, "error: cannot load texture \"%s\"\n",
+              job.path.c_str());
+    }
+
+    lock.lock();
+    jobs_in_progress--;
+    decode_ms += ms;
+    if (decoded != nullptr) {
+      textures_decoded++;
+    } else {
+      textures_failed++;
+    }
+
+    if (jobs.empty() && jobs_in_progress == 0) {
+      job_done.notify_all();
+    }
+  }
+}
+
+}  // namespace raytracer
+
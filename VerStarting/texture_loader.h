@@ -0,0 +1,65 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "texture.h"
+
+namespace raytracer {
+
+// Decodes textures on a pool of threads, so that scene loading can go on
+// while the images are being decoded.
+class TextureLoader {
+ public:
+  // Zero means one thread per core. Threads are started with the first job.
+  explicit TextureLoader(unsigned thread_count = 0);
+  ~TextureLoader();  // Waits for all the jobs.
+
+  // Queues the file to be decoded into the (empty) texture, using the
+  // texture's options. If decoding fails the texture stays empty.
+  void Enqueue(Texture *tex, const std::string& path);
+
+  // Same as above, but decodes an image file which is already in memory (see
+  // Texture::LoadFromMemory). The data needs to stay valid until Wait
+  // returns.
+  void Enqueue(Texture *tex, const uint8_t *data, size_t size,
+               const std::string& name);
+
+  // Waits until all the queued textures are decoded and prints a summary.
+  // Returns the number of textures which failed to load.
+  size_t Wait();
+
+ private:
+  struct Job {
+    Texture *tex;
+    std::string path;  // Or the name if the file is in memory.
+    const uint8_t *data;
+    size_t size;
+  };
+
+  void Enqueue(Job job);
+
+  void WorkerThread();
+
+  unsigned thread_count;
+  std::vector<std::thread> threads;
+
+  std::mutex m;
+  std::condition_variable job_available;
+  std::condition_variable job_done;
+  std::deque<Job> jobs;
+  size_t jobs_in_progress = 0;
+  bool quit = false;
+
+  // Stats since the last Wait.
+  std::chrono::steady_clock::time_point first_job_time;
+  size_t textures_decoded = 0;
+  size_t textures_failed = 0;
+  double decode_ms = 0.0;  // Summed over all threads.
+};
+
+}  // namespace raytracer
+
@@ -0,0 +1,61 @@
+#include <algorithm>
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+#include "tonemap.h"
+
+namespace raytracer {
+
+static uint8_t ToneMapValue(float v, const ToneMapSettings& settings) {
+  v *= settings.exposure;
+  if (settings.op == ToneMapSettings::Operator::kReinhard) {
+    v = v / (1.0f + v);
+  }
+
+  if (!(v > 0.0f)) {  // Also catches NaNs.
+    return 0;
+  }
+
+  // Note: Like MythTracer::V3DtoRGB, this truncates instead of rounding.
+  return (uint8_t)(std::min(v, 1.0f) * 255.0f);
+}
+
+void ToneMap(const float *hdr, size_t pixel_count,
+             const ToneMapSettings& settings, uint8_t *rgb) {
+  // Channels are independent, so the pixels are treated as a flat array.
+  const size_t count = pixel_count * 3;
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128 exposure = _mm_set1_ps(settings.exposure);
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 scale = _mm_set1_ps(255.0f);
+  const bool reinhard = settings.op == ToneMapSettings::Operator::kReinhard;
+
+  // 16 values per iteration, so that the packed bytes fill a whole register.
+  for (; i + 16 <= count; i += 16) {
+    __m128i v[4];
+    for (int k = 0; k < 4; k++) {
+      __m128 x = _mm_mul_ps(_mm_loadu_ps(hdr + i + k * 4), exposure);
+      if (reinhard) {
+        x = _mm_div_ps(x, _mm_add_ps(one, x));
+      }
+      x = _mm_min_ps(_mm_max_ps(x, zero), one);
+      v[k] = _mm_cvttps_epi32(_mm_mul_ps(x, scale));
+    }
+
+    // Values are in the 0-255 range, so saturation never kicks in.
+    const __m128i lo = _mm_packs_epi32(v[0], v[1]);
+    const __m128i hi = _mm_packs_epi32(v[2], v[3]);
+    _mm_storeu_si128((__m128i*)(rgb + i), _mm_packus_epi16(lo, hi));
+  }
+#endif
+
+  for (; i < count; i++) {
+    rgb[i] = ToneMapValue(hdr[i], settings);
+  }
+}
+
+}  // namespace raytracer
+
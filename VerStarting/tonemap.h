@@ -0,0 +1,22 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace raytracer {
+
+struct ToneMapSettings {
+  enum class Operator {
+    kClamp,     // Same as what the renderer does for 8-bit output.
+    kReinhard,  // x / (1 + x), i.e. highlights are compressed, not clipped.
+  };
+
+  Operator op = Operator::kClamp;
+  float exposure = 1.0f;  // Linear multiplier applied before the operator.
+};
+
+// Converts linear RGB floats to 8-bit RGB. Count is in pixels.
+void ToneMap(const float *hdr, size_t pixel_count,
+             const ToneMapSettings& settings, uint8_t *rgb);
+
+}  // namespace raytracer
+
@@ -0,0 +1,84 @@
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "tonemap.h"
+#include "test_helper.h"
+
+using namespace test;
+using raytracer::ToneMap;
+using raytracer::ToneMapSettings;
+
+// Converts the whole buffer at once (i.e. mostly with SSE2 if available) and
+// then pixel by pixel (3 values are always handled by the scalar code), and
+// checks that both give exactly the same result.
+static void TestMatchesScalar(const std::vector<float>& hdr,
+                              const ToneMapSettings& settings) {
+  const size_t pixel_count = hdr.size() / 3;
+  std::vector<uint8_t> bulk(hdr.size());
+  ToneMap(&hdr[0], pixel_count, settings, &bulk[0]);
+
+  int mismatches = 0;
+  for (size_t i = 0; i < pixel_count; i++) {
+    uint8_t scalar[3];
+    ToneMap(&hdr[i * 3], 1, settings, scalar);
+    for (size_t k = 0; k < 3; k++) {
+      if (bulk[i * 3 + k] != scalar[k]) {
+        if (mismatches++ < 5) {
+          TESTEQ((int)bulk[i * 3 + k], (int)scalar[k]);
+        }
+      }
+    }
+  }
+  TESTEQ(mismatches, 0);
+}
+
+int main(void) {
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const float inf = std::numeric_limits<float>::infinity();
+
+  // 1001 pixels, i.e. 3003 values, which is not a multiple of 16 so that the
+  // scalar tail is used as well.
+  std::vector<float> hdr;
+  for (int i = 0; i < 3003; i++) {
+    hdr.push_back(-2.0f + (float)i * (5.0f / 3003.0f));
+  }
+
+  // Exact 8-bit steps (truncation has to agree) and special values, some of
+  // them landing in the tail.
+  for (int i = 0; i <= 255; i++) {
+    hdr[i * 7] = (float)i / 255.0f;
+  }
+  const float special[] = {
+    nan, -nan, inf, -inf, 0.0f, -0.0f, 1.0f, -1.0f, 1e30f, -1e30f,
+    1e-30f, 0.999999f, 1.000001f
+  };
+  const size_t special_count = sizeof(special) / sizeof(special[0]);
+  for (size_t i = 0; i < special_count; i++) {
+    hdr[101 + i * 13] = special[i];
+    hdr[hdr.size() - 1 - i] = special[i];
+  }
+
+  for (auto op : { ToneMapSettings::Operator::kClamp,
+                   ToneMapSettings::Operator::kReinhard }) {
+    for (float exposure : { 1.0f, 0.5f, 3.7f }) {
+      ToneMapSettings settings;
+      settings.op = op;
+      settings.exposure = exposure;
+      TestMatchesScalar(hdr, settings);
+    }
+  }
+
+  // A few known values.
+  ToneMapSettings clamp;
+  const float values[] = { nan, -0.5f, 2.0f, 0.5f, 1.0f, 0.0f };
+  uint8_t rgb[6];
+  ToneMap(values, 2, clamp, rgb);
+  TESTEQ((int)rgb[0], 0);
+  TESTEQ((int)rgb[1], 0);
+  TESTEQ((int)rgb[2], 255);
+  TESTEQ((int)rgb[3], 127);
+  TESTEQ((int)rgb[4], 255);
+  TESTEQ((int)rgb[5], 0);
+
+  return 0;
+}